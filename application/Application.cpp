@@ -1,6 +1,95 @@
 #include <engine.hpp>
 
-int main() {
-  Engine e;
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// usage: application [--gpu-sim] [--load PATH] [--save PATH] [--record PATH]
+//                    [--trace PATH] [--present MODE] [--fps N]
+//                    [width [height]]
+//
+// --load starts from a snapshot, the world takes its size. F5 saves to the
+// --save path, world.vsnp by default. --record journals every edit, replay
+// it with sim_bench --replay. --trace writes a Chrome trace of the profiler
+// zones on exit, F6 prints their last second. --present is low-latency
+// (default), power-saving or uncapped, F7 cycles through them. --fps caps
+// power-saving, 30 by default.
+int main(int argc, char **argv) {
+  uint32_t width = DEFAULT_GRID_SIZE_X;
+  uint32_t height = DEFAULT_GRID_SIZE_Y;
+  bool gpuSim = false;
+  const char *loadPath = nullptr;
+  const char *savePath = nullptr;
+  const char *recordPath = nullptr;
+  const char *tracePath = nullptr;
+  PresentMode presentMode = PresentMode::LowLatency;
+  double fps = 0.0;
+
+  std::vector<const char *> sizes;
+  for (int i = 1; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    if (std::strcmp(argv[i], "--gpu-sim") == 0) {
+      gpuSim = true;
+    } else if (std::strcmp(argv[i], "--load") == 0 && hasValue) {
+      loadPath = argv[++i];
+    } else if (std::strcmp(argv[i], "--save") == 0 && hasValue) {
+      savePath = argv[++i];
+    } else if (std::strcmp(argv[i], "--record") == 0 && hasValue) {
+      recordPath = argv[++i];
+    } else if (std::strcmp(argv[i], "--trace") == 0 && hasValue) {
+      tracePath = argv[++i];
+    } else if (std::strcmp(argv[i], "--present") == 0 && hasValue) {
+      const char *mode = argv[++i];
+      if (std::strcmp(mode, "low-latency") == 0) {
+        presentMode = PresentMode::LowLatency;
+      } else if (std::strcmp(mode, "power-saving") == 0) {
+        presentMode = PresentMode::PowerSaving;
+      } else if (std::strcmp(mode, "uncapped") == 0) {
+        presentMode = PresentMode::Uncapped;
+      } else {
+        std::fprintf(stderr, "unknown present mode: %s\n", mode);
+        return 2;
+      }
+    } else if (std::strcmp(argv[i], "--fps") == 0 && hasValue) {
+      fps = std::strtod(argv[++i], nullptr);
+    } else {
+      sizes.push_back(argv[i]);
+    }
+  }
+
+  if (!sizes.empty()) {
+    width = static_cast<uint32_t>(std::strtoul(sizes[0], nullptr, 10));
+    height = sizes.size() > 1
+                 ? static_cast<uint32_t>(std::strtoul(sizes[1], nullptr, 10))
+                 : width;
+  }
+
+  std::unique_ptr<Snapshot> snapshot;
+  if (loadPath) {
+    snapshot = std::make_unique<Snapshot>(loadPath);
+    width = snapshot->width();
+    height = snapshot->height();
+  }
+
+  Engine e(width, height, gpuSim);
+  if (snapshot) {
+    e.restore(*snapshot);
+    snapshot.reset();
+  }
+  if (savePath) {
+    e.setSnapshotPath(savePath);
+  }
+  if (recordPath) {
+    e.record(recordPath);
+  }
+  if (tracePath) {
+    e.setTracePath(tracePath);
+  }
+  e.setPresentMode(presentMode);
+  if (fps > 0.0) {
+    e.setTargetFps(fps);
+  }
   e.Run();
 }
@@ -0,0 +1,177 @@
+// Headless check of the GPU sim against its CPU reference.
+//
+// Steps a random world with GpuSim and with stepMargolus side by side and
+// compares them cell for cell, the whole grid plus a sub-region read back
+// on their own. Prints the first mismatch and exits with 1. Needs no window,
+// a software device like lavapipe does fine.
+//
+// usage: gpu_sim_check [--steps N] [--size N] [--seed N] [--batch N]
+//                      [--device NAME]
+//
+// --device picks the first device whose name contains NAME.
+
+#include <gpuAllocator.hpp>
+#include <gpuSim.hpp>
+#include <margolus.hpp>
+#include <utils.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options {
+  uint32_t steps = 300;
+  uint32_t size = 256;
+  uint32_t seed = 1;
+  // ticks per GPU submission between comparisons
+  uint32_t batch = 10;
+  std::string device;
+};
+
+Options parseOptions(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "--steps") && hasValue) {
+      options.steps = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!strcmp(argv[i], "--size") && hasValue) {
+      options.size = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!strcmp(argv[i], "--seed") && hasValue) {
+      options.seed = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!strcmp(argv[i], "--batch") && hasValue) {
+      options.batch = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!strcmp(argv[i], "--device") && hasValue) {
+      options.device = argv[++i];
+    } else {
+      std::fprintf(stderr, "unknown argument: %s\n", argv[i]);
+      std::exit(2);
+    }
+  }
+  options.batch = std::max(options.batch, 1u);
+  return options;
+}
+
+// compares a width x height region at (x0, y0) of the reference with cells
+bool compare(const tGrid &reference, uint32_t gridWidth,
+             const std::vector<Cell> &cells, uint32_t x0, uint32_t y0,
+             uint32_t width, uint64_t tick) {
+  for (size_t i = 0; i < cells.size(); ++i) {
+    uint32_t x = x0 + uint32_t(i % width);
+    uint32_t y = y0 + uint32_t(i / width);
+    uint32_t expected = reference[size_t(y) * gridWidth + x].value;
+    uint32_t actual = cells[i].value;
+    if (actual != expected) {
+      std::printf("{\"result\":\"mismatch\",\"tick\":%llu,\"x\":%u,\"y\":%u,"
+                  "\"cpu\":%u,\"gpu\":%u}\n",
+                  static_cast<unsigned long long>(tick), x, y, expected,
+                  actual);
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options = parseOptions(argc, argv);
+
+  vk::raii::Context context;
+  vk::ApplicationInfo appInfo("gpu_sim_check", 1, nullptr, 0,
+                              VK_API_VERSION_1_1);
+  vk::raii::Instance instance(context, vk::InstanceCreateInfo({}, &appInfo));
+
+  vk::raii::PhysicalDevice physicalDevice{nullptr};
+  uint32_t queueFamily = 0;
+  for (vk::raii::PhysicalDevice &candidate :
+       vk::raii::PhysicalDevices(instance)) {
+    std::string name = candidate.getProperties().deviceName.data();
+    if (!options.device.empty() &&
+        name.find(options.device) == std::string::npos)
+      continue;
+
+    std::vector<vk::QueueFamilyProperties> families =
+        candidate.getQueueFamilyProperties();
+    for (uint32_t i = 0; i < families.size(); ++i) {
+      // the same kind of queue the renderer hands GpuSim
+      if ((families[i].queueFlags & vk::QueueFlagBits::eGraphics) &&
+          (families[i].queueFlags & vk::QueueFlagBits::eCompute)) {
+        physicalDevice = std::move(candidate);
+        queueFamily = i;
+        break;
+      }
+    }
+    if (*physicalDevice)
+      break;
+  }
+  if (!*physicalDevice) {
+    std::fprintf(stderr,
+                 "[GpuSimCheck]: No device with a graphics + compute queue!\n");
+    return 2;
+  }
+
+  float queuePriority = 1.0f;
+  vk::DeviceQueueCreateInfo queueInfo({}, queueFamily, 1, &queuePriority);
+  vk::raii::Device device(physicalDevice, vk::DeviceCreateInfo({}, queueInfo));
+  vk::raii::Queue queue(device, queueFamily, 0);
+
+  const uint32_t size = options.size;
+  tGrid reference(size_t(size) * size);
+  std::mt19937 rng(options.seed);
+  std::uniform_int_distribution<uint32_t> pick(0, ELEMENT_TYPE_COUNT - 1);
+  for (Cell &cell : reference) {
+    cell.value = static_cast<uint8_t>(pick(rng));
+  }
+
+  std::printf("{\"device\":\"%s\",\"size\":%u,\"steps\":%u,\"seed\":%u}\n",
+              physicalDevice.getProperties().deviceName.data(), size,
+              options.steps, options.seed);
+
+  GpuAllocator allocator(physicalDevice, device);
+  GpuSim gpuSim(physicalDevice, device, allocator, queueFamily, queue, size,
+                size, utils::getExecutableDir() / "res/shaders");
+  gpuSim.setSeed(options.seed);
+  gpuSim.upload(reference);
+
+  // the sub-region is checked on its own to cover the strided copies
+  const uint32_t regionX = size / 4;
+  const uint32_t regionY = size / 3;
+  const uint32_t regionSize = std::max(size / 3, 1u);
+
+  std::vector<Cell> cells;
+  uint64_t tick = 0;
+  while (tick < options.steps) {
+    uint32_t ticks =
+        static_cast<uint32_t>(std::min<uint64_t>(options.batch,
+                                                 options.steps - tick));
+    gpuSim.step(ticks);
+    for (uint32_t i = 0; i < ticks; ++i) {
+      stepMargolus(reference,
+                   margolusParams(size, size, uint32_t(tick + i),
+                                  options.seed));
+    }
+    tick += ticks;
+
+    uint64_t whole = gpuSim.requestRegion(0, 0, size, size);
+    uint64_t region =
+        gpuSim.requestRegion(regionX, regionY, regionSize, regionSize);
+    gpuSim.waitIdle();
+
+    if (!gpuSim.takeRegion(whole, cells) ||
+        !compare(reference, size, cells, 0, 0, size, tick))
+      return 1;
+    if (!gpuSim.takeRegion(region, cells) ||
+        !compare(reference, size, cells, regionX, regionY, regionSize, tick))
+      return 1;
+  }
+
+  std::printf("{\"result\":\"match\",\"ticks\":%llu}\n",
+              static_cast<unsigned long long>(tick));
+  return 0;
+}
@@ -0,0 +1,242 @@
+// Headless benchmark for the render path.
+//
+// Steps a world with Sim and draws every tick with a windowless Renderer,
+// the way Engine does but into offscreen images. Prints one JSON object with
+// the time spent in render() and how many cell bytes went to the GPU.
+// Needs no window or surface, a software device like lavapipe does fine.
+//
+// usage: render_bench [--frames N] [--warmup N] [--size WxH] [--image WxH]
+//                     [--seed N] [--threads N] [--readback] [--out PATH]
+//                     [--trace PATH]
+//
+// --readback copies every frame back to the CPU as it's drawn, collected a
+// few frames later without stalling. --out writes the last frame to PATH as
+// a binary PPM, to be diffed against a golden image. --trace writes the
+// profiler's Chrome trace to PATH and prints a line per zone, it needs a
+// build with ENGINE_PROFILER.
+
+#include <profiler.hpp>
+#include <renderer.hpp>
+#include <sim.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options {
+  uint32_t frames = 300;
+  uint32_t warmup = 30;
+  uint32_t gridWidth = 256;
+  uint32_t gridHeight = 256;
+  uint32_t imageWidth = 512;
+  uint32_t imageHeight = 512;
+  uint32_t seed = 1;
+  uint32_t threads = 1;
+  bool readback = false;
+  std::string out;
+  std::string trace;
+};
+
+void parseSize(const char *text, uint32_t &width, uint32_t &height) {
+  char *end = nullptr;
+  width = static_cast<uint32_t>(std::strtoul(text, &end, 10));
+  height = width;
+  if (end && *end == 'x') {
+    height = static_cast<uint32_t>(std::strtoul(end + 1, nullptr, 10));
+  }
+  if (width == 0 || height == 0) {
+    std::fprintf(stderr, "bad size: %s\n", text);
+    std::exit(2);
+  }
+}
+
+Options parseOptions(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "--frames") && hasValue) {
+      options.frames = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!strcmp(argv[i], "--warmup") && hasValue) {
+      options.warmup = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!strcmp(argv[i], "--size") && hasValue) {
+      parseSize(argv[++i], options.gridWidth, options.gridHeight);
+    } else if (!strcmp(argv[i], "--image") && hasValue) {
+      parseSize(argv[++i], options.imageWidth, options.imageHeight);
+    } else if (!strcmp(argv[i], "--seed") && hasValue) {
+      options.seed = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!strcmp(argv[i], "--threads") && hasValue) {
+      options.threads = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!strcmp(argv[i], "--readback")) {
+      options.readback = true;
+    } else if (!strcmp(argv[i], "--out") && hasValue) {
+      options.out = argv[++i];
+    } else if (!strcmp(argv[i], "--trace") && hasValue) {
+      options.trace = argv[++i];
+    } else {
+      std::fprintf(stderr, "unknown argument: %s\n", argv[i]);
+      std::exit(2);
+    }
+  }
+  options.threads = std::max(options.threads, 1u);
+  return options;
+}
+
+// water against the left wall, a sand column in the middle and scattered
+// stone, so every frame has a good share of chunks moving
+void setupWorld(Sim &sim, uint32_t seed) {
+  for (uint32_t y = 0; y < sim.height() * 3 / 4; ++y) {
+    for (uint32_t x = 0; x < sim.width() / 3; ++x) {
+      sim.set(x, y, ElementType::Water);
+    }
+  }
+  for (uint32_t y = 0; y < sim.height(); ++y) {
+    for (uint32_t x = sim.width() * 7 / 16; x < sim.width() * 9 / 16; ++x) {
+      sim.set(x, y, ElementType::Sand);
+    }
+  }
+
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<uint32_t> pickX(0, sim.width() - 1);
+  std::uniform_int_distribution<uint32_t> pickY(0, sim.height() - 1);
+  for (size_t i = 0; i < size_t(sim.width()) * sim.height() / 64; ++i) {
+    sim.set(pickX(rng), pickY(rng), ElementType::Stone);
+  }
+}
+
+bool writePpm(const std::string &path, const std::vector<uint8_t> &pixels,
+              uint32_t width, uint32_t height) {
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (!file)
+    return false;
+
+  std::fprintf(file, "P6\n%u %u\n255\n", width, height);
+  std::vector<uint8_t> row(size_t(width) * 3);
+  for (uint32_t y = 0; y < height; ++y) {
+    const uint8_t *rgba = pixels.data() + size_t(y) * width * 4;
+    for (uint32_t x = 0; x < width; ++x) {
+      memcpy(&row[size_t(x) * 3], rgba + size_t(x) * 4, 3);
+    }
+    std::fwrite(row.data(), 1, row.size(), file);
+  }
+  return std::fclose(file) == 0;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty())
+    return 0.0;
+  size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options = parseOptions(argc, argv);
+
+  tGrid worldMatrix;
+  Sim sim(worldMatrix, options.gridWidth, options.gridHeight, options.threads);
+  sim.setSeed(options.seed);
+  setupWorld(sim, options.seed);
+
+  Renderer renderer;
+  renderer.initHeadless(options.imageWidth, options.imageHeight,
+                        options.gridWidth, options.gridHeight);
+  renderer.render(worldMatrix);
+
+  std::vector<DirtyRect> dirty;
+  sim.takeDirtyRects(dirty);
+
+  std::vector<double> frameMs;
+  frameMs.reserve(options.frames);
+  double totalMs = 0.0;
+  uint64_t uploadBytes = 0;
+  uint64_t readbacks = 0;
+  std::deque<uint64_t> pending;
+  std::vector<uint8_t> pixels;
+
+  const uint32_t total = options.warmup + options.frames;
+  for (uint32_t frame = 0; frame < total; ++frame) {
+    sim.step();
+    dirty.clear();
+    bool partial = sim.takeDirtyRects(dirty);
+
+    bool last = frame + 1 == total;
+    if (options.readback || (last && !options.out.empty())) {
+      pending.push_back(renderer.requestFrame());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    renderer.render(worldMatrix, partial ? &dirty : nullptr);
+    auto end = std::chrono::steady_clock::now();
+
+    // collected in order once the GPU is done with them, never waited on
+    while (!pending.empty() && renderer.takeFrame(pending.front(), pixels)) {
+      pending.pop_front();
+      ++readbacks;
+    }
+
+    if (frame < options.warmup)
+      continue;
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+    frameMs.push_back(ms);
+    totalMs += ms;
+    uploadBytes += renderer.lastUploadBytes();
+  }
+
+  // what's left is the last frame or two, the one --out wants at the back
+  renderer.waitIdle();
+  while (!pending.empty() && renderer.takeFrame(pending.front(), pixels)) {
+    pending.pop_front();
+    ++readbacks;
+  }
+
+  std::sort(frameMs.begin(), frameMs.end());
+  double frames = std::max<double>(frameMs.size(), 1.0);
+  std::printf(
+      "{\"grid\":\"%ux%u\",\"image\":\"%ux%u\",\"frames\":%zu,"
+      "\"ms_per_frame\":%.4f,\"p50_ms\":%.4f,\"p99_ms\":%.4f,"
+      "\"upload_bytes_per_frame\":%.0f,\"upload_mb_per_s\":%.2f,"
+      "\"readbacks\":%llu}\n",
+      options.gridWidth, options.gridHeight, options.imageWidth,
+      options.imageHeight, frameMs.size(), totalMs / frames,
+      percentile(frameMs, 0.5), percentile(frameMs, 0.99),
+      uploadBytes / frames,
+      totalMs > 0.0 ? uploadBytes / (1024.0 * 1024.0) / (totalMs / 1000.0)
+                    : 0.0,
+      static_cast<unsigned long long>(readbacks));
+
+  if (!options.trace.empty()) {
+    // the whole run, warmup included
+    for (const profiler::ZoneSummary &zone : profiler::summary(1e12)) {
+      std::printf("{\"zone\":\"%s\",\"gpu\":%s,\"count\":%llu,"
+                  "\"min_ms\":%.4f,\"avg_ms\":%.4f,\"p99_ms\":%.4f}\n",
+                  zone.name.c_str(), zone.gpu ? "true" : "false",
+                  static_cast<unsigned long long>(zone.count), zone.minMs,
+                  zone.avgMs, zone.p99Ms);
+    }
+    if (!profiler::writeChromeTrace(options.trace)) {
+      std::fprintf(stderr, "[RenderBench]: Couldn't write %s\n",
+                   options.trace.c_str());
+      return 1;
+    }
+  }
+
+  if (!options.out.empty()) {
+    vk::Extent2D extent = renderer.frameExtent();
+    if (!writePpm(options.out, pixels, extent.width, extent.height)) {
+      std::fprintf(stderr, "[RenderBench]: Couldn't write %s\n",
+                   options.out.c_str());
+      return 1;
+    }
+  }
+  return 0;
+}
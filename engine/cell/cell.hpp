@@ -1,6 +1,13 @@
 #pragma once
 #include <stdint.h>
 
+// A material id, one byte per cell. The GPU reads them packed four to a
+// uint, cell i in byte i % 4 of word i / 4.
 struct Cell {
-  alignas(16) uint32_t value = 0;
+  uint8_t value = 0;
 };
+
+// bytes a grid of cellCount cells takes on the GPU, whole words
+inline uint64_t packedCellBytes(uint64_t cellCount) {
+  return (cellCount + 3) & ~uint64_t(3);
+}
@@ -1,13 +1,18 @@
 #pragma once
 
+#include <alignedAllocator.hpp>
 #include <cell.hpp>
-#include <array>
 
-const uint32_t GRID_SIZE_X = 256;
-const uint32_t GRID_SIZE_Y = 256;
-const uint32_t MIN_FRAME_TIME = 16;
+// default world size, the actual one is picked at runtime
+const uint32_t DEFAULT_GRID_SIZE_X = 256;
+const uint32_t DEFAULT_GRID_SIZE_Y = 256;
+// frame rate cap of PresentMode::PowerSaving unless --fps says otherwise
+const uint32_t POWER_SAVING_FPS = 30;
+// sim steps per second, independent of the frame rate
+const uint32_t SIM_TICK_RATE = 60;
 
-typedef std::array<Cell, GRID_SIZE_X * GRID_SIZE_Y> tGrid;
+// one Cell per grid cell, row-major from the bottom row up
+typedef AlignedVector<Cell> tGrid;
 
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 800;
@@ -1,46 +1,350 @@
 #include "includes/utils.hpp"
 #include <engine.hpp>
+#include <gpuSim.hpp>
+#include <profiler.hpp>
 #include <sim.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <thread>
 
-Engine::Engine() : m_Sim(m_WorldMatrix) {
+Engine::Engine(uint32_t gridWidth, uint32_t gridHeight, bool gpuSim)
+    : m_Sim(m_WorldMatrix, gridWidth, gridHeight,
+            std::max(1u, std::thread::hardware_concurrency())),
+      m_SimThread(m_Sim, m_WorldMatrix), m_GpuSimEnabled(gpuSim) {
   initWindow();
-  m_Renderer.init(m_Window, &m_WorldMatrix);
+  m_Renderer.init(m_Window, gridWidth, gridHeight);
+
+  m_Pacer.setTargetRate(POWER_SAVING_FPS);
+  // paced to the primary monitor's rate, the window may well be on another
+  if (const GLFWvidmode *mode = glfwGetVideoMode(glfwGetPrimaryMonitor())) {
+    m_Pacer.setRefreshRate(mode->refreshRate);
+  }
+}
+
+void Engine::setPresentMode(PresentMode mode) {
+  m_Pacer.setMode(mode);
+  m_Renderer.setPresentMode(mode);
+}
+
+void Engine::cyclePresentMode() {
+  switch (m_Pacer.mode()) {
+  case PresentMode::LowLatency:
+    setPresentMode(PresentMode::PowerSaving);
+    break;
+  case PresentMode::PowerSaving:
+    setPresentMode(PresentMode::Uncapped);
+    break;
+  case PresentMode::Uncapped:
+    setPresentMode(PresentMode::LowLatency);
+    break;
+  }
+  std::printf("[Engine]: Present mode %s\n", presentModeName(m_Pacer.mode()));
+  std::fflush(stdout);
 }
 
 Engine::~Engine() {
+  m_SimThread.stop();
   glfwDestroyWindow(m_Window);
   glfwTerminate();
 }
 
 void Engine::Run() {
+  PROFILE_THREAD("main");
+
   // X errors on close if i don't render before the main loop, no idea why
-  m_Renderer.render();
+  m_Renderer.render(m_WorldMatrix);
+
+  if (m_GpuSimEnabled) {
+    runGpuSim();
+    writeTrace();
+    return;
+  }
+
+  // from here on m_Sim and m_WorldMatrix belong to the sim thread, frames
+  // come out of m_SimThread and edits go in through it
+  SchedulerConfig schedulerConfig;
+  // a tick that takes longer than its own period gets sliced, so stop() and
+  // the stats never wait on a whole slow tick
+  schedulerConfig.frameBudget = schedulerConfig.tickPeriod;
+  m_SimThread.start(schedulerConfig);
 
   auto last_time = std::chrono::high_resolution_clock::now();
+  auto last_title = last_time;
+  bool saveHeld = false;
+  bool profileHeld = false;
+  bool presentHeld = false;
+  // last cursor sample of the drag in progress
+  bool stroking = false;
+  bool strokeSink = false;
+  double strokeX = 0.0, strokeY = 0.0;
 
   while (!glfwWindowShouldClose(m_Window)) {
+    FramePacer::clock::time_point inputTime;
+    {
+      PROFILE_ZONE("pacer");
+      inputTime = m_Pacer.waitForInput();
+    }
+    PROFILE_ZONE("Engine::frame");
     auto now = std::chrono::high_resolution_clock::now();
     auto deltaTime = now - last_time;
-    auto end = now + std::chrono::milliseconds(MIN_FRAME_TIME);
+    last_time = now;
+
+    updateFrameStats(
+        std::chrono::duration<double, std::milli>(deltaTime).count());
+
+    if (now - last_title > std::chrono::seconds(1)) {
+      updateTitle();
+      last_title = now;
+    }
+
+    glfwPollEvents();
+
+    bool savePressed = glfwGetKey(m_Window, GLFW_KEY_F5) == GLFW_PRESS;
+    if (savePressed && !saveHeld) {
+      if (m_SimThread.push({SimCommand::Type::Save}))
+        ++m_CommandsPushed;
+    }
+    saveHeld = savePressed;
+
+    bool profilePressed = glfwGetKey(m_Window, GLFW_KEY_F6) == GLFW_PRESS;
+    if (profilePressed && !profileHeld) {
+      printProfile();
+    }
+    profileHeld = profilePressed;
+
+    bool presentPressed = glfwGetKey(m_Window, GLFW_KEY_F7) == GLFW_PRESS;
+    if (presentPressed && !presentHeld) {
+      cyclePresentMode();
+    }
+    presentHeld = presentPressed;
+
+    // A fast drag moves the cursor many cells between two frames, the
+    // brush is dragged from the last sample instead of stamped at each one
+    bool drawn = false;
+    if (glfwGetWindowAttrib(m_Window, GLFW_HOVERED)) {
+      double xpos, ypos;
+      glfwGetCursorPos(m_Window, &xpos, &ypos);
+      bool left =
+          glfwGetMouseButton(m_Window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+      bool right =
+          glfwGetMouseButton(m_Window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
+      if (left || right) {
+        SimCommand command{SimCommand::Type::Mouse, xpos, ypos, !left};
+        if (stroking && strokeSink == command.sink) {
+          command.type = SimCommand::Type::Stroke;
+          command.fromX = strokeX;
+          command.fromY = strokeY;
+        }
+        if (m_SimThread.push(command)) {
+          m_PendingEdits.emplace_back(m_CommandsPushed++, inputTime);
+        }
+        drawn = true;
+        strokeX = xpos;
+        strokeY = ypos;
+        strokeSink = command.sink;
+      }
+    }
+    stroking = drawn;
+
+    // only what changed since the last frame goes to the GPU
+    const SimFrame &frame = m_SimThread.latestFrame();
+    m_Dirty.clear();
+    bool partial =
+        m_SimThread.dirtySince(m_RenderedGeneration, frame.generation, m_Dirty);
+    m_Renderer.render(frame.cells, partial ? &m_Dirty : nullptr);
+    m_RenderedGeneration = frame.generation;
+    FramePacer::clock::time_point shown = m_Pacer.presented(inputTime);
+
+    // edits usually wait a tick or two on the sim thread before a frame
+    // has them
+    while (!m_PendingEdits.empty() &&
+           m_PendingEdits.front().first < frame.commands) {
+      m_Pacer.inputShown(m_PendingEdits.front().second, shown);
+      m_PendingEdits.pop_front();
+    }
+  }
+
+  m_SimThread.stop();
+  writeTrace();
+}
+
+// Same loop with the world on the GPU, ticks are recorded into the frame
+// that draws them and edits become buffer fills.
+void Engine::runGpuSim() {
+  m_Renderer.enableGpuSim(m_WorldMatrix,
+                          static_cast<uint32_t>(m_Sim.seed()));
+  GpuSim &gpuSim = *m_Renderer.gpuSim();
+
+  using clock = std::chrono::steady_clock;
+  const clock::duration tickPeriod =
+      std::chrono::nanoseconds(1000000000 / SIM_TICK_RATE);
+  // a long frame doesn't turn into a burst of ticks
+  const uint32_t maxTicksPerFrame = 4;
+
+  clock::time_point last_time = clock::now();
+  clock::time_point last_title = last_time;
+  clock::duration accumulator{0};
+  bool profileHeld = false;
+  bool presentHeld = false;
+  // last brush position of the drag in progress
+  bool stroking = false;
+  ElementType strokeType = ElementType::Sand;
+  int64_t strokeX = 0, strokeY = 0;
+
+  while (!glfwWindowShouldClose(m_Window)) {
+    clock::time_point inputTime;
+    {
+      PROFILE_ZONE("pacer");
+      inputTime = m_Pacer.waitForInput();
+    }
+    PROFILE_ZONE("Engine::frame");
+    clock::time_point now = clock::now();
+    clock::duration deltaTime = now - last_time;
+    last_time = now;
+
+    updateFrameStats(
+        std::chrono::duration<double, std::milli>(deltaTime).count());
+
+    if (now - last_title > std::chrono::seconds(1)) {
+      updateTitle();
+      last_title = now;
+    }
 
     glfwPollEvents();
-    m_Sim.step();
-    m_Renderer.render();
 
+    bool profilePressed = glfwGetKey(m_Window, GLFW_KEY_F6) == GLFW_PRESS;
+    if (profilePressed && !profileHeld) {
+      printProfile();
+    }
+    profileHeld = profilePressed;
+
+    bool presentPressed = glfwGetKey(m_Window, GLFW_KEY_F7) == GLFW_PRESS;
+    if (presentPressed && !presentHeld) {
+      cyclePresentMode();
+    }
+    presentHeld = presentPressed;
+
+    // Sim::brush's square, stamped at every cell along the line from the
+    // last sample so a fast drag leaves no gaps like Sim::stroke
+    bool drawn = false;
     if (glfwGetWindowAttrib(m_Window, GLFW_HOVERED)) {
       double xpos, ypos;
       glfwGetCursorPos(m_Window, &xpos, &ypos);
-      if (glfwGetMouseButton(m_Window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
-        m_Sim.mouse(xpos, ypos);
-      } else if (glfwGetMouseButton(m_Window, GLFW_MOUSE_BUTTON_RIGHT) ==
-                 GLFW_PRESS) {
-        m_Sim.mouse(xpos, ypos, true);
+      bool left =
+          glfwGetMouseButton(m_Window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+      bool right =
+          glfwGetMouseButton(m_Window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
+      if (left || right) {
+        const int64_t r = Sim::BRUSH_RADIUS;
+        ElementType type = left ? ElementType::Sand : ElementType::Water;
+        auto [x, y] = m_Sim.windowToGrid(xpos, ypos);
+        if (!stroking || strokeType != type) {
+          strokeX = x;
+          strokeY = y;
+        }
+        // the last sample was stamped the frame before, unless it's new
+        int64_t dx = x - strokeX, dy = y - strokeY;
+        int64_t steps = std::max(std::abs(dx), std::abs(dy));
+        for (int64_t i = steps > 0 ? 1 : 0; i <= steps; ++i) {
+          int64_t cx = steps > 0 ? strokeX + dx * i / steps : x;
+          int64_t cy = steps > 0 ? strokeY + dy * i / steps : y;
+          gpuSim.fill(cx - r, cy - r, cx + r, cy + r, type);
+        }
+        drawn = true;
+        strokeType = type;
+        strokeX = x;
+        strokeY = y;
       }
     }
+    stroking = drawn;
 
-    // std::this_thread::sleep_until(end);
+    accumulator += deltaTime;
+    uint32_t ticks = 0;
+    while (accumulator >= tickPeriod && ticks < maxTicksPerFrame) {
+      accumulator -= tickPeriod;
+      ++ticks;
+    }
+    if (ticks == maxTicksPerFrame) {
+      accumulator = clock::duration{0};
+    }
+
+    m_Renderer.renderGpuSim(ticks);
+    m_GpuTicks += ticks;
+    FramePacer::clock::time_point shown = m_Pacer.presented(inputTime);
+    // the fills went out with this frame
+    if (drawn)
+      m_Pacer.inputShown(inputTime, shown);
+  }
+}
+
+void Engine::printProfile() {
+  for (const profiler::ZoneSummary &zone : profiler::summary()) {
+    std::printf("[Profiler]: %-24s %s min %.3f avg %.3f p99 %.3f ms (%llu)\n",
+                zone.name.c_str(), zone.gpu ? "gpu" : "cpu", zone.minMs,
+                zone.avgMs, zone.p99Ms,
+                static_cast<unsigned long long>(zone.count));
+  }
+  std::fflush(stdout);
+}
+
+void Engine::writeTrace() {
+  if (m_TracePath.empty())
+    return;
+  if (!profiler::writeChromeTrace(m_TracePath)) {
+    std::printf("[Profiler]: Couldn't write %s\n",
+                m_TracePath.string().c_str());
+  }
+}
+
+void Engine::updateFrameStats(double frameMs) {
+  m_FrameStats.lastFrameMs = frameMs;
+  m_FrameStats.maxFrameMs = std::max(m_FrameStats.maxFrameMs, frameMs);
+  m_FrameStats.avgFrameMs = m_FrameStats.frames++ == 0
+                                ? frameMs
+                                : m_FrameStats.avgFrameMs * 0.95 + frameMs * 0.05;
+}
+
+void Engine::updateTitle() {
+  if (m_GpuSimEnabled) {
+    char title[192];
+    std::snprintf(title, sizeof(title),
+                  "HAHAHA | %.1f fps | %s, input %.1f ms | gpu | %llu ticks",
+                  m_FrameStats.avgFrameMs > 0.0
+                      ? 1000.0 / m_FrameStats.avgFrameMs
+                      : 0.0,
+                  presentModeName(m_Pacer.mode()),
+                  m_Pacer.stats().avgInputMs,
+                  static_cast<unsigned long long>(m_GpuTicks));
+    glfwSetWindowTitle(m_Window, title);
+    return;
   }
+
+  SchedulerStats sim = m_SimThread.stats();
+  SimStats activity = m_SimThread.simStats();
+
+  // ours out of what the process may use of VRAM, 0 without a budget
+  double vramBudget = 0.0;
+  for (const GpuHeapBudget &heap : m_Renderer.allocator().budgets()) {
+    if (heap.deviceLocal)
+      vramBudget += heap.budget;
+  }
+
+  char title[256];
+  std::snprintf(title, sizeof(title),
+                "HAHAHA | %.1f fps | %s, input %.1f ms | tick %.2f ms | "
+                "%llu ticks, %llu dropped | %.0f%% chunks awake | "
+                "upload %.1f KB | gpu mem %.1f / %.0f MB",
+                m_FrameStats.avgFrameMs > 0.0 ? 1000.0 / m_FrameStats.avgFrameMs
+                                              : 0.0,
+                presentModeName(m_Pacer.mode()), m_Pacer.stats().avgInputMs,
+                sim.avgTickMs, static_cast<unsigned long long>(sim.ticks),
+                static_cast<unsigned long long>(sim.droppedTicks),
+                activity.chunkActivity * 100.0,
+                m_Renderer.lastUploadBytes() / 1024.0,
+                m_Renderer.allocator().stats().blockBytes / (1024.0 * 1024.0),
+                vramBudget / (1024.0 * 1024.0));
+  glfwSetWindowTitle(m_Window, title);
 }
 
 void Engine::initWindow() {
@@ -0,0 +1,133 @@
+#include <framePacer.hpp>
+
+#include <algorithm>
+#include <thread>
+
+namespace {
+
+using clock = FramePacer::clock;
+
+// left between a frame being done and its deadline, covers the present
+// call and the odd frame running over the estimate
+const clock::duration WAKE_MARGIN = std::chrono::microseconds(1000);
+// sleep_until wakes up late by up to this much, the rest is spun
+const clock::duration SPIN = std::chrono::microseconds(500);
+
+double toMs(clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+} // namespace
+
+FramePacer::FramePacer(PresentMode mode) : m_Mode(mode) {}
+
+void FramePacer::setMode(PresentMode mode) {
+  m_Mode = mode;
+  // picked up again from the next frame
+  m_Deadline = clock::time_point{};
+}
+
+void FramePacer::setRefreshRate(double hz) {
+  if (hz > 0.0) {
+    m_RefreshRate = hz;
+  }
+}
+
+void FramePacer::setTargetRate(double hz) {
+  if (hz > 0.0) {
+    m_TargetRate = hz;
+  }
+}
+
+clock::duration FramePacer::period() const {
+  double hz = 0.0;
+  switch (m_Mode) {
+  case PresentMode::LowLatency:
+    hz = m_RefreshRate;
+    break;
+  case PresentMode::PowerSaving:
+    hz = m_TargetRate;
+    break;
+  case PresentMode::Uncapped:
+    return clock::duration{0};
+  }
+  return std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(1.0 / hz));
+}
+
+clock::time_point FramePacer::waitForInput() {
+  clock::time_point now = clock::now();
+  clock::duration framePeriod = period();
+  if (framePeriod == clock::duration{0}) {
+    m_Stats.lastWaitMs = 0.0;
+    return now;
+  }
+
+  if (m_Deadline == clock::time_point{}) {
+    m_Deadline = now + framePeriod;
+  }
+
+  // LowLatency's deadlines aren't the display's vblanks, there's no way to
+  // know those here. With MAILBOX it doesn't matter, the newest image is
+  // shown at the next one, this only keeps frames from being drawn for
+  // nothing and input from going stale while they queue.
+  clock::time_point wake =
+      m_Mode == PresentMode::LowLatency
+          ? m_Deadline - std::min(m_WorkEstimate + WAKE_MARGIN, framePeriod)
+          : m_Deadline - framePeriod;
+
+  if (wake > now) {
+    if (wake - now > SPIN) {
+      std::this_thread::sleep_until(wake - SPIN);
+    }
+    while (clock::now() < wake) {
+      std::this_thread::yield();
+    }
+  }
+
+  clock::time_point sampled = clock::now();
+  m_Stats.lastWaitMs = toMs(sampled - now);
+  return sampled;
+}
+
+clock::time_point FramePacer::presented(clock::time_point inputTime) {
+  clock::time_point now = clock::now();
+  clock::duration work = now - inputTime;
+
+  double workMs = toMs(work);
+  m_Stats.lastWorkMs = workMs;
+  m_Stats.maxWorkMs = std::max(m_Stats.maxWorkMs, workMs);
+  m_Stats.avgWorkMs = m_Stats.frames++ == 0
+                          ? workMs
+                          : m_Stats.avgWorkMs * 0.95 + workMs * 0.05;
+
+  if (work > m_WorkEstimate) {
+    m_WorkEstimate = work;
+  } else {
+    m_WorkEstimate -= (m_WorkEstimate - work) / 32;
+  }
+  m_Stats.workEstimateMs = toMs(m_WorkEstimate);
+
+  clock::duration framePeriod = period();
+  if (framePeriod == clock::duration{0} || m_Deadline == clock::time_point{})
+    return now;
+
+  if (now > m_Deadline) {
+    ++m_Stats.missed;
+    // skip the deadlines already gone by, keeping their phase, instead of
+    // rushing a burst of frames to catch up
+    m_Deadline += framePeriod * ((now - m_Deadline) / framePeriod);
+  }
+  m_Deadline += framePeriod;
+  return now;
+}
+
+void FramePacer::inputShown(clock::time_point sampled,
+                            clock::time_point shown) {
+  double inputMs = toMs(shown - sampled);
+  m_Stats.lastInputMs = inputMs;
+  m_Stats.maxInputMs = std::max(m_Stats.maxInputMs, inputMs);
+  m_Stats.avgInputMs = m_Stats.inputs++ == 0
+                           ? inputMs
+                           : m_Stats.avgInputMs * 0.95 + inputMs * 0.05;
+}
@@ -1,21 +1,78 @@
 #pragma once
 
 #include <GLFW/glfw3.h>
+#include <framePacer.hpp>
 #include <renderer.hpp>
 #include <sim.hpp>
+#include <simThread.hpp>
 
 class Engine {
 public:
-  Engine();
+  // gpuSim steps the world with GpuSim instead of Sim
+  Engine(uint32_t gridWidth = DEFAULT_GRID_SIZE_X,
+         uint32_t gridHeight = DEFAULT_GRID_SIZE_Y, bool gpuSim = false);
   ~Engine();
   void Run();
 
+  // before Run(), the snapshot has to match the world size
+  void restore(const Snapshot &snapshot) { m_Sim.restore(snapshot); }
+  // where F5 saves to
+  void setSnapshotPath(const std::filesystem::path &path) {
+    m_SimThread.setSnapshotPath(path);
+  }
+  // before Run(), journals every edit for sim_bench --replay
+  void record(const std::filesystem::path &path) { m_SimThread.record(path); }
+  // Chrome trace of the profiler zones, written when Run() returns. Nothing
+  // is recorded in builds without ENGINE_PROFILER.
+  void setTracePath(const std::filesystem::path &path) { m_TracePath = path; }
+  // F7 cycles through them while running
+  void setPresentMode(PresentMode mode);
+  // PowerSaving's frame rate cap
+  void setTargetFps(double fps) { m_Pacer.setTargetRate(fps); }
+
+  struct FrameStats {
+    uint64_t frames = 0;
+    double lastFrameMs = 0.0;
+    double avgFrameMs = 0.0;
+    double maxFrameMs = 0.0;
+  };
+  const FrameStats &frameStats() const { return m_FrameStats; }
+  // input to present latency and how long frames waited for it
+  const PacerStats &pacerStats() const { return m_Pacer.stats(); }
+  SchedulerStats simStats() { return m_SimThread.stats(); }
+  // census and activity counters of the last tick
+  SimStats simActivity() { return m_SimThread.simStats(); }
+
 private:
   void initWindow();
+  void updateTitle();
+  void updateFrameStats(double frameMs);
+  void cyclePresentMode();
+  void runGpuSim();
+  void printProfile();
+  void writeTrace();
 
 private:
   GLFWwindow *m_Window{nullptr};
   Renderer m_Renderer;
   tGrid m_WorldMatrix;
   Sim m_Sim;
+  SimThread m_SimThread;
+
+  // newest sim frame handed to the renderer
+  uint64_t m_RenderedGeneration = 0;
+  std::vector<DirtyRect> m_Dirty;
+  // commands the sim thread took, and when the edits among them were
+  // sampled by how many came before, until a presented frame has them
+  uint64_t m_CommandsPushed = 0;
+  std::deque<std::pair<uint64_t, FramePacer::clock::time_point>>
+      m_PendingEdits;
+
+  bool m_GpuSimEnabled = false;
+  // GPU ticks taken, the title's tick counter in GPU mode
+  uint64_t m_GpuTicks = 0;
+
+  FrameStats m_FrameStats;
+  FramePacer m_Pacer;
+  std::filesystem::path m_TracePath;
 };
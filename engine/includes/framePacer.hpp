@@ -0,0 +1,77 @@
+#pragma once
+
+#include <presentMode.hpp>
+
+#include <chrono>
+#include <cstdint>
+
+struct PacerStats {
+  // from sampling input to the present call returning, what a frame costs
+  // whether or not anything was edited
+  double lastWorkMs = 0.0;
+  double avgWorkMs = 0.0;
+  double maxWorkMs = 0.0;
+  // From sampling an edit to the present of the first frame that has it,
+  // sim ticks in between included. Scanout isn't seen from here.
+  double lastInputMs = 0.0;
+  double avgInputMs = 0.0;
+  double maxInputMs = 0.0;
+  uint64_t inputs = 0;
+  // time spent waiting before sampling input
+  double lastWaitMs = 0.0;
+  // how long a frame is expected to take from input to present
+  double workEstimateMs = 0.0;
+  uint64_t frames = 0;
+  // presents that came after their deadline
+  uint64_t missed = 0;
+};
+
+// CPU side frame limiter. Each frame calls waitForInput() right before
+// polling input and presented() once the present call returned, and
+// inputShown() for an edit once a presented frame has it.
+//
+// Every mode but Uncapped has a present deadline per period. LowLatency
+// wakes up as late as it can and still make it, that's the frame's
+// expected time plus a margin before the deadline, so input is sampled as
+// close to the present as possible. PowerSaving wakes at the start of the
+// period and lets FIFO do the rest.
+class FramePacer {
+public:
+  using clock = std::chrono::steady_clock;
+
+  explicit FramePacer(PresentMode mode = PresentMode::LowLatency);
+
+  void setMode(PresentMode mode);
+  PresentMode mode() const { return m_Mode; }
+  // the display's, LowLatency paces to it
+  void setRefreshRate(double hz);
+  // PowerSaving's rate
+  void setTargetRate(double hz);
+
+  // sleeps until input should be sampled, returns when that was
+  clock::time_point waitForInput();
+  // inputTime is what waitForInput returned for this frame, returns when
+  // the present was done
+  clock::time_point presented(clock::time_point inputTime);
+  // sampled is when the edit's input was, shown the present returned above
+  void inputShown(clock::time_point sampled, clock::time_point shown);
+
+  const PacerStats &stats() const { return m_Stats; }
+
+private:
+  // 0 for uncapped
+  clock::duration period() const;
+
+private:
+  PresentMode m_Mode;
+  double m_RefreshRate = 60.0;
+  double m_TargetRate = 30.0;
+
+  // when the next frame should be presented by
+  clock::time_point m_Deadline;
+  // fast to grow and slow to shrink, a single long frame pushes input
+  // sampling earlier for a while
+  clock::duration m_WorkEstimate{0};
+
+  PacerStats m_Stats;
+};
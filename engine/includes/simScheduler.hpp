@@ -0,0 +1,68 @@
+#pragma once
+
+#include <config.hpp>
+#include <sim.hpp>
+
+#include <chrono>
+#include <cstdint>
+
+struct SchedulerConfig {
+  std::chrono::nanoseconds tickPeriod{1'000'000'000 / SIM_TICK_RATE};
+  // most ticks one update() runs to catch up, time beyond that is dropped
+  uint32_t maxSubsteps = 4;
+  // CPU time one update() may spend stepping before it returns, a tick
+  // that doesn't fit is finished by the next update(). 0 never slices.
+  std::chrono::nanoseconds frameBudget{0};
+};
+
+struct SchedulerStats {
+  uint64_t ticks = 0;
+  // ticks skipped because catching up would have taken too many substeps
+  uint64_t droppedTicks = 0;
+  // ticks that took more than one update() to finish
+  uint64_t slicedTicks = 0;
+  // ticks finished by the last update()
+  uint32_t lastSubsteps = 0;
+
+  // CPU time per tick, summed over all slices of it
+  double lastTickMs = 0.0;
+  double avgTickMs = 0.0;
+  double maxTickMs = 0.0;
+  // time the last update() spent stepping
+  double lastUpdateMs = 0.0;
+};
+
+// Fixed timestep driver for Sim. Wall time goes into an accumulator and
+// comes out as whole ticks, so the sim runs at the same speed whatever rate
+// update() is called at.
+class SimScheduler {
+public:
+  using clock = std::chrono::steady_clock;
+
+  explicit SimScheduler(Sim &sim, const SchedulerConfig &config = {});
+
+  // forget accumulated time, e.g. before the first update()
+  void reset(clock::time_point now);
+
+  // runs the ticks that are due at now, returns how many finished
+  uint32_t update(clock::time_point now);
+
+  // earliest time update() will have something to do
+  clock::time_point nextTickTime() const;
+
+  const SchedulerStats &stats() const { return m_Stats; }
+  const SchedulerConfig &config() const { return m_Config; }
+  void setConfig(const SchedulerConfig &config) { m_Config = config; }
+
+private:
+  Sim &m_Sim;
+  SchedulerConfig m_Config;
+  SchedulerStats m_Stats;
+
+  clock::time_point m_LastUpdate;
+  std::chrono::nanoseconds m_Accumulator{0};
+
+  // tick that's been started but not finished yet
+  double m_PartialTickMs = 0.0;
+  uint32_t m_PartialSlices = 0;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <config.hpp>
+#include <journal.hpp>
+#include <sim.hpp>
+#include <simScheduler.hpp>
+#include <snapshot.hpp>
+#include <spscQueue.hpp>
+#include <tripleBuffer.hpp>
+
+#include <atomic>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// edits sent from the window thread to the sim thread
+struct SimCommand {
+  enum class Type {
+    Mouse,
+    // the brush dragged from (fromX, fromY) to (xpos, ypos), the cursor's
+    // last two samples while a button is held
+    Stroke,
+    // snapshot to the path set with setSnapshotPath, written in the
+    // background
+    Save,
+  };
+
+  Type type = Type::Mouse;
+  double xpos = 0.0;
+  double ypos = 0.0;
+  bool sink = false;
+  double fromX = 0.0;
+  double fromY = 0.0;
+};
+
+// a finished tick as handed to the window thread
+struct SimFrame {
+  tGrid cells;
+  // counts publishes, consecutive frames differ by SimThread::dirtySince
+  uint64_t generation = 0;
+  // commands applied before it, in the order they were pushed
+  uint64_t commands = 0;
+};
+
+// Runs Sim on its own thread, ticked by a SimScheduler. Finished frames are
+// published through a triple buffer so the renderer never waits on the sim
+// and the sim never waits on present.
+class SimThread {
+public:
+  // worldMatrix is the grid sim writes into, it's only touched from the
+  // sim thread once start() is called
+  SimThread(Sim &sim, tGrid &worldMatrix);
+  ~SimThread();
+
+  void start(const SchedulerConfig &config = {});
+  void stop();
+
+  // window thread, false if the queue is full and the command was dropped
+  bool push(const SimCommand &command);
+
+  // window thread, newest frame the sim finished. Stays valid until the
+  // next call.
+  const SimFrame &latestFrame();
+
+  // Any thread, appends the rects that changed between two generations.
+  // False if they're too far apart or the whole world changed, the caller
+  // has to take the frame as changed everywhere then.
+  bool dirtySince(uint64_t from, uint64_t to, std::vector<DirtyRect> &rects);
+
+  // any thread, copy of the scheduler stats as of the last update
+  SchedulerStats stats();
+  // any thread, Sim::stats() as of the last finished tick
+  SimStats simStats();
+
+  // before start()
+  void setSnapshotPath(const std::filesystem::path &path) {
+    m_SnapshotPath = path;
+  }
+  // Before start(), logs every edit to a journal at path from the sim's
+  // current tick on. It's closed by stop().
+  void record(const std::filesystem::path &path) {
+    m_Journal = std::make_unique<JournalWriter>(path, m_Sim);
+  }
+
+private:
+  void run();
+  void apply(const SimCommand &command);
+  void publish();
+
+private:
+  Sim &m_Sim;
+  tGrid &m_WorldMatrix;
+
+  TripleBuffer<SimFrame> m_Frames;
+
+  // what changed in each of the last publishes, by generation. An entry
+  // without rects is a whole world change.
+  struct DirtyEntry {
+    uint64_t generation;
+    bool partial;
+    std::vector<DirtyRect> rects;
+  };
+  static constexpr size_t DIRTY_HISTORY = 16;
+  std::mutex m_DirtyMutex;
+  std::deque<DirtyEntry> m_DirtyHistory;
+  uint64_t m_Generation = 0;
+  std::vector<DirtyRect> m_DirtyScratch;
+  uint64_t m_CommandsApplied = 0;
+
+  SpscQueue<SimCommand, 1024> m_Commands;
+
+  SimScheduler m_Scheduler;
+  std::filesystem::path m_SnapshotPath = "world.vsnp";
+  SnapshotWriter m_SnapshotWriter;
+  std::unique_ptr<JournalWriter> m_Journal;
+
+  std::mutex m_StatsMutex;
+  SchedulerStats m_Stats;
+  SimStats m_SimStats;
+
+  std::atomic<bool> m_Running{false};
+  std::thread m_Thread;
+};
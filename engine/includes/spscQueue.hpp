@@ -0,0 +1,38 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+template <typename T, size_t Capacity> class SpscQueue {
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "SpscQueue capacity has to be a power of two");
+
+public:
+  // producer side, false if the queue is full
+  bool push(const T &value) {
+    size_t tail = m_Tail.load(std::memory_order_relaxed);
+    if (tail - m_Head.load(std::memory_order_acquire) == Capacity)
+      return false;
+    m_Items[tail & (Capacity - 1)] = value;
+    m_Tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer side, false if the queue is empty
+  bool pop(T &value) {
+    size_t head = m_Head.load(std::memory_order_relaxed);
+    if (head == m_Tail.load(std::memory_order_acquire))
+      return false;
+    value = m_Items[head & (Capacity - 1)];
+    m_Head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::array<T, Capacity> m_Items;
+  // kept on separate cache lines so the two threads don't fight over them
+  alignas(64) std::atomic<size_t> m_Head{0};
+  alignas(64) std::atomic<size_t> m_Tail{0};
+};
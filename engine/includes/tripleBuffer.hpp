@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Lock-free hand-off of whole frames from one writer thread to one reader
+// thread. The writer fills back() and publish()es it, the reader picks up
+// the newest published frame with update(). Neither side ever waits, the
+// reader just skips frames it was too slow for.
+template <typename T> class TripleBuffer {
+public:
+  TripleBuffer() = default;
+  explicit TripleBuffer(const T &initial) { reset(initial); }
+
+  // not thread safe, only while neither side is running
+  void reset(const T &initial) {
+    m_Slots.fill(initial);
+    m_Back = 0;
+    m_Middle.store(1, std::memory_order_relaxed);
+    m_Front = 2;
+  }
+
+  // writer side
+  T &back() { return m_Slots[m_Back]; }
+  void publish() {
+    uint8_t previous =
+        m_Middle.exchange(m_Back | FRESH, std::memory_order_acq_rel);
+    m_Back = previous & INDEX;
+  }
+
+  // reader side, returns false if nothing new was published since last time
+  bool update() {
+    if (!(m_Middle.load(std::memory_order_relaxed) & FRESH))
+      return false;
+    uint8_t previous = m_Middle.exchange(m_Front, std::memory_order_acq_rel);
+    m_Front = previous & INDEX;
+    return true;
+  }
+  const T &front() const { return m_Slots[m_Front]; }
+
+private:
+  static constexpr uint8_t INDEX = 0x3;
+  static constexpr uint8_t FRESH = 0x4;
+
+  std::array<T, 3> m_Slots;
+  uint8_t m_Back = 0;
+  // slot in between, plus FRESH if the writer published it after the
+  // reader last looked
+  std::atomic<uint8_t> m_Middle{1};
+  uint8_t m_Front = 2;
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+// Scoped CPU zones and GPU timings, exported as a Chrome trace
+// (chrome://tracing, ui.perfetto.dev) or summed up per zone.
+//
+//   void Sim::stepFor(...) {
+//     PROFILE_ZONE("Sim::stepFor");
+//
+// Every thread records into a ring of its own, a zone costs two clock reads
+// and a few stores, no locks. Rings keep the newest RING_SIZE zones.
+//
+// Built with ENGINE_PROFILER=0 (the CMake option, off in Release) the macros
+// expand to nothing and the functions below are empty inlines.
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#ifndef ENGINE_PROFILER
+#define ENGINE_PROFILER 0
+#endif
+
+namespace profiler {
+
+// zones kept per thread
+constexpr size_t RING_SIZE = size_t(1) << 15;
+
+struct ZoneSummary {
+  std::string name;
+  // measured with GPU timestamps
+  bool gpu = false;
+  uint64_t count = 0;
+  double minMs = 0.0;
+  double avgMs = 0.0;
+  double p99Ms = 0.0;
+};
+
+#if ENGINE_PROFILER
+
+// nanoseconds since the profiler's first use, steady clock
+uint64_t now();
+
+// name has to outlive the profiler, string literals do
+void record(const char *name, uint64_t start, uint64_t end);
+// a GPU zone already moved onto now()'s clock, from one thread only
+void recordGpu(const char *name, uint64_t start, uint64_t end);
+// what the calling thread is called in traces
+void setThreadName(const char *name);
+
+// Zones that ended in the last windowMs, slowest average first. Reads the
+// rings while they're written to, zones overwritten meanwhile are skipped.
+std::vector<ZoneSummary> summary(double windowMs = 1000.0);
+// everything still in the rings, false if the file couldn't be written
+bool writeChromeTrace(const std::filesystem::path &path);
+
+class Zone {
+public:
+  explicit Zone(const char *name) : m_Name(name), m_Start(now()) {}
+  ~Zone() { record(m_Name, m_Start, now()); }
+
+  Zone(const Zone &) = delete;
+  Zone &operator=(const Zone &) = delete;
+
+private:
+  const char *m_Name;
+  uint64_t m_Start;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_ZONE(name)                                                     \
+  profiler::Zone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_THREAD(name) profiler::setThreadName(name)
+
+#else
+
+inline std::vector<ZoneSummary> summary(double = 1000.0) { return {}; }
+inline bool writeChromeTrace(const std::filesystem::path &) { return false; }
+
+#define PROFILE_ZONE(name) ((void)0)
+#define PROFILE_THREAD(name) ((void)0)
+
+#endif
+
+} // namespace profiler
@@ -0,0 +1,232 @@
+#include <profiler.hpp>
+
+#if ENGINE_PROFILER
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace profiler {
+
+namespace {
+
+// Written by its owner only. Fields are relaxed atomics so a reader copying
+// a slot that's being overwritten gets a stale or new value instead of a
+// data race, which zones it can trust is decided by head.
+struct Slot {
+  std::atomic<const char *> name{nullptr};
+  std::atomic<uint64_t> start{0};
+  std::atomic<uint64_t> end{0};
+};
+
+struct Ring {
+  std::unique_ptr<Slot[]> slots{new Slot[RING_SIZE]};
+  // zones written so far, slot head % RING_SIZE is next
+  std::atomic<uint64_t> head{0};
+  // guarded by Registry::mutex
+  std::string name;
+  uint32_t id = 0;
+};
+
+struct Recorded {
+  const char *name;
+  uint64_t start;
+  uint64_t end;
+};
+
+struct Registry {
+  std::mutex mutex;
+  // kept after their threads exit so their zones still show up
+  std::vector<std::unique_ptr<Ring>> rings;
+  Ring gpu;
+  std::chrono::steady_clock::time_point epoch =
+      std::chrono::steady_clock::now();
+
+  Registry() { gpu.name = "GPU"; }
+};
+
+Registry &registry() {
+  static Registry instance;
+  return instance;
+}
+
+Ring &threadRing() {
+  thread_local Ring *ring = nullptr;
+  if (!ring) {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.rings.push_back(std::make_unique<Ring>());
+    ring = reg.rings.back().get();
+    // the GPU track is 0
+    ring->id = static_cast<uint32_t>(reg.rings.size());
+    ring->name = "thread " + std::to_string(ring->id);
+  }
+  return *ring;
+}
+
+void push(Ring &ring, const char *name, uint64_t start, uint64_t end) {
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  Slot &slot = ring.slots[head % RING_SIZE];
+  slot.name.store(name, std::memory_order_relaxed);
+  slot.start.store(start, std::memory_order_relaxed);
+  slot.end.store(end, std::memory_order_relaxed);
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+// oldest first
+std::vector<Recorded> read(const Ring &ring) {
+  uint64_t head = ring.head.load(std::memory_order_acquire);
+  uint64_t first = head > RING_SIZE ? head - RING_SIZE : 0;
+
+  std::vector<Recorded> zones;
+  zones.reserve(head - first);
+  for (uint64_t i = first; i < head; ++i) {
+    const Slot &slot = ring.slots[i % RING_SIZE];
+    zones.push_back({slot.name.load(std::memory_order_relaxed),
+                     slot.start.load(std::memory_order_relaxed),
+                     slot.end.load(std::memory_order_relaxed)});
+  }
+
+  // the owner may have lapped the copy, those slots hold newer zones now
+  std::atomic_thread_fence(std::memory_order_acquire);
+  uint64_t after = ring.head.load(std::memory_order_relaxed);
+  uint64_t overwritten = after > RING_SIZE ? after - RING_SIZE : 0;
+  if (overwritten > first) {
+    zones.erase(zones.begin(),
+                zones.begin() + std::min<uint64_t>(overwritten - first,
+                                                   zones.size()));
+  }
+  return zones;
+}
+
+void writeEscaped(FILE *file, const std::string &text) {
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      std::fputc('\\', file);
+    }
+    std::fputc(c, file);
+  }
+}
+
+} // namespace
+
+uint64_t now() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - registry().epoch)
+          .count());
+}
+
+void record(const char *name, uint64_t start, uint64_t end) {
+  push(threadRing(), name, start, end);
+}
+
+void recordGpu(const char *name, uint64_t start, uint64_t end) {
+  push(registry().gpu, name, start, end);
+}
+
+void setThreadName(const char *name) {
+  Ring &ring = threadRing();
+  std::lock_guard<std::mutex> lock(registry().mutex);
+  ring.name = name;
+}
+
+std::vector<ZoneSummary> summary(double windowMs) {
+  uint64_t end = now();
+  uint64_t window = static_cast<uint64_t>(windowMs * 1e6);
+  uint64_t since = end > window ? end - window : 0;
+
+  // durations by (gpu, name)
+  std::map<std::pair<bool, std::string>, std::vector<uint64_t>> durations;
+  auto collect = [&](const Ring &ring, bool gpu) {
+    for (const Recorded &zone : read(ring)) {
+      if (zone.end >= since && zone.name) {
+        durations[{gpu, zone.name}].push_back(zone.end - zone.start);
+      }
+    }
+  };
+
+  Registry &reg = registry();
+  {
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    for (const std::unique_ptr<Ring> &ring : reg.rings) {
+      collect(*ring, false);
+    }
+  }
+  collect(reg.gpu, true);
+
+  std::vector<ZoneSummary> summaries;
+  for (auto &[key, times] : durations) {
+    std::sort(times.begin(), times.end());
+    uint64_t total = 0;
+    for (uint64_t time : times) {
+      total += time;
+    }
+
+    ZoneSummary zone;
+    zone.gpu = key.first;
+    zone.name = key.second;
+    zone.count = times.size();
+    zone.minMs = times.front() / 1e6;
+    zone.avgMs = total / 1e6 / times.size();
+    zone.p99Ms = times[std::min(times.size() - 1,
+                                static_cast<size_t>(times.size() * 0.99))] /
+                 1e6;
+    summaries.push_back(std::move(zone));
+  }
+
+  std::sort(summaries.begin(), summaries.end(),
+            [](const ZoneSummary &a, const ZoneSummary &b) {
+              return a.avgMs > b.avgMs;
+            });
+  return summaries;
+}
+
+bool writeChromeTrace(const std::filesystem::path &path) {
+  FILE *file = std::fopen(path.string().c_str(), "wb");
+  if (!file)
+    return false;
+
+  std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+  bool first = true;
+  auto writeRing = [&](const Ring &ring) {
+    std::fprintf(file,
+                 "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+                 "\"tid\":%u,\"args\":{\"name\":\"",
+                 first ? "" : ",\n", ring.id);
+    writeEscaped(file, ring.name);
+    std::fputs("\"}}", file);
+    first = false;
+
+    // ts and dur are in microseconds
+    for (const Recorded &zone : read(ring)) {
+      if (!zone.name)
+        continue;
+      std::fputs(",\n{\"ph\":\"X\",\"name\":\"", file);
+      writeEscaped(file, zone.name);
+      std::fprintf(file, "\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                   ring.id, zone.start / 1e3, (zone.end - zone.start) / 1e3);
+    }
+  };
+
+  Registry &reg = registry();
+  writeRing(reg.gpu);
+  {
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    for (const std::unique_ptr<Ring> &ring : reg.rings) {
+      writeRing(*ring);
+    }
+  }
+  std::fputs("\n]}\n", file);
+
+  return std::fclose(file) == 0;
+}
+
+} // namespace profiler
+
+#endif
@@ -0,0 +1,375 @@
+#include <gpuAllocator.hpp>
+
+#include <algorithm>
+#include <bitset>
+#include <stdexcept>
+#include <string>
+
+struct GpuMemoryBlock {
+  struct Range {
+    vk::DeviceSize offset;
+    vk::DeviceSize size;
+  };
+
+  vk::raii::DeviceMemory memory{nullptr};
+  uint32_t type = 0;
+  vk::DeviceSize size = 0;
+  uint8_t *mapped = nullptr;
+  // made for one allocation, freed along with it
+  bool dedicated = false;
+  uint32_t allocationCount = 0;
+  // sorted by offset, two free ranges never touch
+  std::vector<Range> free;
+};
+
+namespace {
+
+struct UsageFlags {
+  vk::MemoryPropertyFlags required;
+  vk::MemoryPropertyFlags preferred;
+  vk::MemoryPropertyFlags unwanted;
+};
+
+UsageFlags usageFlags(MemoryUsage usage) {
+  using Flag = vk::MemoryPropertyFlagBits;
+  // Host visible memory is always asked to be coherent too, nothing that
+  // writes or reads through mapped() flushes or invalidates.
+  switch (usage) {
+  case MemoryUsage::GpuOnly:
+    return {Flag::eDeviceLocal, {}, Flag::eHostVisible};
+  case MemoryUsage::Upload:
+    return {Flag::eHostVisible | Flag::eHostCoherent, {}, Flag::eDeviceLocal};
+  case MemoryUsage::Stream:
+    return {Flag::eHostVisible | Flag::eHostCoherent, Flag::eDeviceLocal, {}};
+  case MemoryUsage::Readback:
+    return {Flag::eHostVisible | Flag::eHostCoherent, Flag::eHostCached, {}};
+  }
+  return {};
+}
+
+uint32_t countFlags(vk::MemoryPropertyFlags flags) {
+  return static_cast<uint32_t>(
+      std::bitset<32>(static_cast<VkMemoryPropertyFlags>(flags)).count());
+}
+
+vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+} // namespace
+
+GpuAllocation &GpuAllocation::operator=(GpuAllocation &&other) noexcept {
+  if (this != &other) {
+    release();
+    m_Allocator = other.m_Allocator;
+    m_Block = other.m_Block;
+    m_Offset = other.m_Offset;
+    m_Size = other.m_Size;
+    m_Mapped = other.m_Mapped;
+    other.m_Allocator = nullptr;
+    other.m_Block = nullptr;
+    other.m_Mapped = nullptr;
+  }
+  return *this;
+}
+
+vk::DeviceMemory GpuAllocation::memory() const {
+  return m_Block ? *m_Block->memory : vk::DeviceMemory{};
+}
+
+void GpuAllocation::release() {
+  if (!m_Block)
+    return;
+  m_Allocator->free(m_Block, m_Offset, m_Size);
+  m_Allocator = nullptr;
+  m_Block = nullptr;
+  m_Mapped = nullptr;
+}
+
+GpuAllocator::GpuAllocator(const vk::raii::PhysicalDevice &physicalDevice,
+                           const vk::raii::Device &device, bool memoryBudget)
+    : m_Device(device), m_PhysicalDevice(physicalDevice),
+      m_MemoryProperties(physicalDevice.getMemoryProperties()),
+      m_BufferImageGranularity(
+          physicalDevice.getProperties().limits.bufferImageGranularity),
+      m_MemoryBudget(memoryBudget),
+      m_Blocks(m_MemoryProperties.memoryTypeCount) {}
+
+// the blocks' memory is freed with them, allocations still around dangle
+GpuAllocator::~GpuAllocator() = default;
+
+std::pair<vk::raii::Buffer, GpuAllocation>
+GpuAllocator::createBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage,
+                           MemoryUsage memoryUsage,
+                           const std::vector<uint32_t> &queueFamilies) {
+  vk::BufferCreateInfo bufferInfo(vk::BufferCreateFlags{}, size, usage,
+                                  vk::SharingMode::eExclusive);
+  if (queueFamilies.size() > 1) {
+    bufferInfo.setSharingMode(vk::SharingMode::eConcurrent);
+    bufferInfo.setQueueFamilyIndices(queueFamilies);
+  }
+  vk::raii::Buffer buffer(m_Device, bufferInfo);
+
+  GpuAllocation allocation =
+      allocate(buffer.getMemoryRequirements(), memoryUsage);
+  buffer.bindMemory(allocation.memory(), allocation.offset());
+
+  return std::make_pair(std::move(buffer), std::move(allocation));
+}
+
+std::vector<uint32_t> GpuAllocator::rankMemoryTypes(uint32_t typeBits,
+                                                    MemoryUsage usage) const {
+  const UsageFlags flags = usageFlags(usage);
+  // never picked for plain buffers
+  const vk::MemoryPropertyFlags excluded =
+      vk::MemoryPropertyFlagBits::eLazilyAllocated |
+      vk::MemoryPropertyFlagBits::eProtected;
+
+  std::vector<std::pair<uint32_t, uint32_t>> ranked; // cost, type
+  for (uint32_t i = 0; i < m_MemoryProperties.memoryTypeCount; ++i) {
+    vk::MemoryPropertyFlags properties =
+        m_MemoryProperties.memoryTypes[i].propertyFlags;
+    if (!(typeBits & (1u << i)) ||
+        (properties & flags.required) != flags.required ||
+        (properties & excluded)) {
+      continue;
+    }
+    uint32_t cost = countFlags(flags.preferred & ~properties) +
+                    countFlags(flags.unwanted & properties);
+    ranked.emplace_back(cost, i);
+  }
+
+  // the spec lists the types of a heap from fastest to slowest, a stable sort
+  // keeps that order between types of the same cost
+  std::stable_sort(
+      ranked.begin(), ranked.end(),
+      [](const auto &a, const auto &b) { return a.first < b.first; });
+
+  std::vector<uint32_t> types;
+  types.reserve(ranked.size());
+  for (const auto &entry : ranked) {
+    types.push_back(entry.second);
+  }
+  return types;
+}
+
+GpuAllocation GpuAllocator::allocate(const vk::MemoryRequirements &requirements,
+                                     MemoryUsage memoryUsage, bool linear) {
+  std::vector<uint32_t> types =
+      rankMemoryTypes(requirements.memoryTypeBits, memoryUsage);
+  if (types.empty()) {
+    throw std::runtime_error(
+        "[GpuAllocator]: No memory type has the properties asked for!");
+  }
+
+  // Linear resources share blocks with optimal images. Those take whole
+  // granularity pages, so nothing linear can land on a page of theirs.
+  vk::DeviceSize size = requirements.size;
+  vk::DeviceSize alignment =
+      std::max<vk::DeviceSize>(requirements.alignment, 1);
+  if (!linear) {
+    alignment = std::max(alignment, m_BufferImageGranularity);
+    size = alignUp(size, m_BufferImageGranularity);
+  }
+  const bool dedicated = size > BLOCK_SIZE / 2;
+
+  std::lock_guard<std::mutex> lock(m_Mutex);
+
+  if (!dedicated) {
+    for (uint32_t type : types) {
+      for (const std::unique_ptr<GpuMemoryBlock> &block : m_Blocks[type]) {
+        if (block->dedicated)
+          continue;
+        if (std::optional<GpuAllocation> allocation =
+                allocateFrom(*block, size, alignment)) {
+          return std::move(*allocation);
+        }
+      }
+    }
+  }
+
+  // A new block, in the best type whose heap still has budget for it. Past
+  // that anywhere the driver gives out memory, a small ReBAR heap being full
+  // just means streaming from system memory.
+  const vk::DeviceSize blockSize = dedicated ? size : BLOCK_SIZE;
+  for (bool respectBudget : {true, false}) {
+    for (uint32_t type : types) {
+      if (respectBudget && !fitsBudget(type, blockSize))
+        continue;
+      if (GpuMemoryBlock *block = createBlock(type, blockSize, dedicated)) {
+        return std::move(*allocateFrom(*block, size, alignment));
+      }
+    }
+    if (!m_MemoryBudget)
+      break;
+  }
+
+  throw std::runtime_error("[GpuAllocator]: Out of device memory for " +
+                           std::to_string(size) + " bytes!");
+}
+
+std::optional<GpuAllocation>
+GpuAllocator::allocateFrom(GpuMemoryBlock &block, vk::DeviceSize size,
+                           vk::DeviceSize alignment) {
+  // first fit, the alignment padding in front stays free
+  for (size_t i = 0; i < block.free.size(); ++i) {
+    GpuMemoryBlock::Range range = block.free[i];
+    vk::DeviceSize offset = alignUp(range.offset, alignment);
+    vk::DeviceSize end = range.offset + range.size;
+    if (offset + size > end)
+      continue;
+
+    block.free.erase(block.free.begin() + i);
+    if (offset + size < end) {
+      block.free.insert(block.free.begin() + i,
+                        {offset + size, end - (offset + size)});
+    }
+    if (offset > range.offset) {
+      block.free.insert(block.free.begin() + i,
+                        {range.offset, offset - range.offset});
+    }
+
+    GpuAllocation allocation;
+    allocation.m_Allocator = this;
+    allocation.m_Block = &block;
+    allocation.m_Offset = offset;
+    allocation.m_Size = size;
+    allocation.m_Mapped = block.mapped ? block.mapped + offset : nullptr;
+
+    ++block.allocationCount;
+    ++m_Stats.allocationCount;
+    m_Stats.usedBytes += size;
+    return allocation;
+  }
+  return std::nullopt;
+}
+
+GpuMemoryBlock *GpuAllocator::createBlock(uint32_t type, vk::DeviceSize size,
+                                          bool dedicated) {
+  auto block = std::make_unique<GpuMemoryBlock>();
+  try {
+    block->memory =
+        vk::raii::DeviceMemory(m_Device, vk::MemoryAllocateInfo(size, type));
+  } catch (const vk::OutOfDeviceMemoryError &) {
+    return nullptr;
+  } catch (const vk::OutOfHostMemoryError &) {
+    return nullptr;
+  }
+
+  block->type = type;
+  block->size = size;
+  block->dedicated = dedicated;
+  block->free.push_back({0, size});
+  // mapped once for its whole life, mapping per allocation isn't allowed
+  // while another range of the same memory is mapped
+  if (m_MemoryProperties.memoryTypes[type].propertyFlags &
+      vk::MemoryPropertyFlagBits::eHostVisible) {
+    block->mapped = static_cast<uint8_t *>(block->memory.mapMemory(0, size));
+  }
+
+  ++m_Stats.blockCount;
+  m_Stats.blockBytes += size;
+  m_Blocks[type].push_back(std::move(block));
+  return m_Blocks[type].back().get();
+}
+
+bool GpuAllocator::fitsBudget(uint32_t type, vk::DeviceSize size) const {
+  if (!m_MemoryBudget)
+    return true;
+
+  auto properties = m_PhysicalDevice.getMemoryProperties2<
+      vk::PhysicalDeviceMemoryProperties2,
+      vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+  const auto &budget =
+      properties.get<vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+  uint32_t heap = m_MemoryProperties.memoryTypes[type].heapIndex;
+  return budget.heapUsage[heap] + size <= budget.heapBudget[heap];
+}
+
+void GpuAllocator::free(GpuMemoryBlock *block, vk::DeviceSize offset,
+                        vk::DeviceSize size) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+
+  --m_Stats.allocationCount;
+  m_Stats.usedBytes -= size;
+
+  // back into the free list, merged with the ranges either side
+  auto next = std::lower_bound(
+      block->free.begin(), block->free.end(), offset,
+      [](const GpuMemoryBlock::Range &range, vk::DeviceSize value) {
+        return range.offset < value;
+      });
+  GpuMemoryBlock::Range range{offset, size};
+  if (next != block->free.end() && range.offset + range.size == next->offset) {
+    range.size += next->size;
+    next = block->free.erase(next);
+  }
+  if (next != block->free.begin()) {
+    auto previous = std::prev(next);
+    if (previous->offset + previous->size == range.offset) {
+      previous->size += range.size;
+      range.size = 0;
+    }
+  }
+  if (range.size) {
+    block->free.insert(next, range);
+  }
+
+  if (--block->allocationCount > 0)
+    return;
+
+  // One empty block per type is kept for the next allocation, the rest go
+  // back to the driver.
+  std::vector<std::unique_ptr<GpuMemoryBlock>> &blocks = m_Blocks[block->type];
+  bool keep = !block->dedicated &&
+              std::none_of(blocks.begin(), blocks.end(),
+                           [block](const std::unique_ptr<GpuMemoryBlock> &b) {
+                             return b.get() != block && !b->dedicated &&
+                                    b->allocationCount == 0;
+                           });
+  if (keep)
+    return;
+
+  --m_Stats.blockCount;
+  m_Stats.blockBytes -= block->size;
+  blocks.erase(std::find_if(blocks.begin(), blocks.end(),
+                            [block](const std::unique_ptr<GpuMemoryBlock> &b) {
+                              return b.get() == block;
+                            }));
+}
+
+GpuMemoryStats GpuAllocator::stats() const {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Stats;
+}
+
+std::vector<GpuHeapBudget> GpuAllocator::budgets() const {
+  std::vector<GpuHeapBudget> heaps(m_MemoryProperties.memoryHeapCount);
+  for (uint32_t i = 0; i < m_MemoryProperties.memoryHeapCount; ++i) {
+    const vk::MemoryHeap &heap = m_MemoryProperties.memoryHeaps[i];
+    heaps[i].size = heap.size;
+    heaps[i].deviceLocal =
+        bool(heap.flags & vk::MemoryHeapFlagBits::eDeviceLocal);
+  }
+
+  if (m_MemoryBudget) {
+    auto properties = m_PhysicalDevice.getMemoryProperties2<
+        vk::PhysicalDeviceMemoryProperties2,
+        vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+    const auto &budget =
+        properties.get<vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+    for (uint32_t i = 0; i < m_MemoryProperties.memoryHeapCount; ++i) {
+      heaps[i].usage = budget.heapUsage[i];
+      heaps[i].budget = budget.heapBudget[i];
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  for (const auto &blocks : m_Blocks) {
+    for (const std::unique_ptr<GpuMemoryBlock> &block : blocks) {
+      heaps[m_MemoryProperties.memoryTypes[block->type].heapIndex]
+          .blockBytes += block->size;
+    }
+  }
+  return heaps;
+}
@@ -0,0 +1,434 @@
+#include <gpuSim.hpp>
+#include <margolus.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <tuple>
+
+namespace {
+
+// everything that touches the cells outside of the compute shader
+const vk::PipelineStageFlags CELL_USERS =
+    vk::PipelineStageFlagBits::eFragmentShader |
+    vk::PipelineStageFlagBits::eComputeShader |
+    vk::PipelineStageFlagBits::eTransfer;
+const vk::AccessFlags CELL_ACCESS =
+    vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite |
+    vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite;
+
+// cells per material in GpuSim::m_FillPatterns, a row that doesn't cover a
+// whole word is at most 6 bytes
+const size_t FILL_PATTERN = 8;
+
+void cellBarrier(const vk::raii::CommandBuffer &commandBuffer,
+                 vk::PipelineStageFlags srcStage, vk::AccessFlags srcAccess,
+                 vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess) {
+  vk::MemoryBarrier barrier(srcAccess, dstAccess);
+  commandBuffer.pipelineBarrier(srcStage, dstStage, vk::DependencyFlags{},
+                                barrier, nullptr, nullptr);
+}
+
+std::vector<char> readShader(const std::filesystem::path &path) {
+  std::ifstream file(path, std::ios::ate | std::ios::binary);
+  if (!file.is_open()) {
+    throw std::runtime_error(std::string("[GpuSim]: Failed to open shader: ") +
+                             path.string());
+  }
+
+  std::vector<char> code(static_cast<size_t>(file.tellg()));
+  file.seekg(0);
+  file.read(code.data(), code.size());
+  return code;
+}
+
+} // namespace
+
+GpuSim::GpuSim(const vk::raii::PhysicalDevice &physicalDevice,
+               const vk::raii::Device &device, GpuAllocator &allocator,
+               uint32_t queueFamily, const vk::raii::Queue &queue,
+               uint32_t width, uint32_t height,
+               const std::filesystem::path &shaderDir,
+               const vk::raii::PipelineCache *pipelineCache)
+    : m_Device(device), m_Queue(queue), m_Allocator(allocator),
+      m_Width(width), m_Height(height) {
+  if (cellBufferSize() >
+      physicalDevice.getProperties().limits.maxStorageBufferRange) {
+    throw std::runtime_error(
+        "[GpuSim]: World is too large for a single storage buffer!");
+  }
+
+  std::tie(m_CellBuffer, m_CellMemory) = m_Allocator.createBuffer(
+      cellBufferSize(),
+      vk::BufferUsageFlagBits::eStorageBuffer |
+          vk::BufferUsageFlagBits::eTransferSrc |
+          vk::BufferUsageFlagBits::eTransferDst,
+      MemoryUsage::GpuOnly);
+
+  vk::DescriptorSetLayoutBinding binding(0, vk::DescriptorType::eStorageBuffer,
+                                         1, vk::ShaderStageFlagBits::eCompute);
+  m_DescriptorSetLayout = vk::raii::DescriptorSetLayout(
+      m_Device,
+      vk::DescriptorSetLayoutCreateInfo(vk::DescriptorSetLayoutCreateFlags{},
+                                        binding));
+
+  vk::DescriptorPoolSize poolSize(vk::DescriptorType::eStorageBuffer, 1);
+  m_DescriptorPool = vk::raii::DescriptorPool(
+      m_Device,
+      vk::DescriptorPoolCreateInfo(
+          vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet, 1, poolSize));
+
+  vk::raii::DescriptorSets descriptorSets(
+      m_Device,
+      vk::DescriptorSetAllocateInfo(*m_DescriptorPool, *m_DescriptorSetLayout));
+  m_DescriptorSet = vk::raii::DescriptorSet(std::move(descriptorSets.front()));
+
+  vk::DescriptorBufferInfo cellBufferInfo(*m_CellBuffer, 0, cellBufferSize());
+  vk::WriteDescriptorSet descriptorWrite(
+      *m_DescriptorSet, 0, 0, vk::DescriptorType::eStorageBuffer, nullptr,
+      cellBufferInfo, nullptr, nullptr);
+  m_Device.updateDescriptorSets(descriptorWrite, nullptr);
+
+  vk::PushConstantRange pushConstants(vk::ShaderStageFlagBits::eCompute, 0,
+                                      sizeof(MargolusParams));
+  m_PipelineLayout = vk::raii::PipelineLayout(
+      m_Device, vk::PipelineLayoutCreateInfo(vk::PipelineLayoutCreateFlags{},
+                                             *m_DescriptorSetLayout,
+                                             pushConstants));
+
+  std::vector<char> code = readShader(shaderDir / "margolus.spv");
+  vk::raii::ShaderModule shaderModule(
+      m_Device, vk::ShaderModuleCreateInfo{
+                    vk::ShaderModuleCreateFlags{}, code.size(),
+                    reinterpret_cast<const uint32_t *>(code.data())});
+
+  vk::PipelineShaderStageCreateInfo stage{
+      vk::PipelineShaderStageCreateFlags{}, // flags
+      vk::ShaderStageFlagBits::eCompute,    // stage
+      *shaderModule,                        // module
+      "main",                               // pName -> Entrypoint
+      nullptr                               // pSpecializationInfo
+  };
+  m_Pipeline = vk::raii::Pipeline(
+      m_Device, vk::Optional<const vk::raii::PipelineCache>(pipelineCache),
+      vk::ComputePipelineCreateInfo(vk::PipelineCreateFlags{}, stage,
+                                    *m_PipelineLayout));
+
+  m_CommandPool = vk::raii::CommandPool(
+      m_Device,
+      vk::CommandPoolCreateInfo(vk::CommandPoolCreateFlagBits::eTransient |
+                                    vk::CommandPoolCreateFlagBits::
+                                        eResetCommandBuffer,
+                                queueFamily));
+
+  m_FillPatterns =
+      createHostBuffer(FILL_PATTERN * ELEMENT_TYPE_COUNT,
+                       vk::BufferUsageFlagBits::eTransferSrc,
+                       MemoryUsage::Upload);
+  for (size_t i = 0; i < ELEMENT_TYPE_COUNT; ++i) {
+    memset(static_cast<uint8_t *>(m_FillPatterns.mapped) + FILL_PATTERN * i,
+           static_cast<int>(i), sizeof(Cell) * FILL_PATTERN);
+  }
+
+  // all air until something is uploaded
+  vk::raii::CommandBuffer commandBuffer = beginCommands();
+  commandBuffer.fillBuffer(*m_CellBuffer, 0, VK_WHOLE_SIZE, 0);
+  submit(std::move(commandBuffer));
+}
+
+GpuSim::~GpuSim() { waitIdle(); }
+
+vk::raii::CommandBuffer GpuSim::beginCommands() {
+  retire();
+
+  vk::CommandBufferAllocateInfo allocInfo(*m_CommandPool,
+                                          vk::CommandBufferLevel::ePrimary, 1);
+  vk::raii::CommandBuffer commandBuffer =
+      std::move(vk::raii::CommandBuffers(m_Device, allocInfo).front());
+
+  commandBuffer.begin(vk::CommandBufferBeginInfo{
+      vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+  return commandBuffer;
+}
+
+uint64_t GpuSim::submit(vk::raii::CommandBuffer &&commandBuffer,
+                        std::optional<HostBuffer> readback,
+                        std::optional<HostBuffer> source) {
+  commandBuffer.end();
+
+  Submission submission;
+  submission.id = m_NextId++;
+  submission.commandBuffer = std::move(commandBuffer);
+  submission.fence = vk::raii::Fence(m_Device, vk::FenceCreateInfo{});
+  submission.readback = std::move(readback);
+  submission.source = std::move(source);
+
+  m_Queue.submit(vk::SubmitInfo(nullptr, nullptr, *submission.commandBuffer,
+                                nullptr),
+                 *submission.fence);
+
+  m_Submissions.push_back(std::move(submission));
+  return m_Submissions.back().id;
+}
+
+void GpuSim::retire() {
+  m_Submissions.erase(
+      std::remove_if(m_Submissions.begin(), m_Submissions.end(),
+                     [](const Submission &submission) {
+                       return !submission.readback &&
+                              submission.fence.getStatus() ==
+                                  vk::Result::eSuccess;
+                     }),
+      m_Submissions.end());
+}
+
+GpuSim::Submission *GpuSim::findSubmission(uint64_t id) {
+  for (Submission &submission : m_Submissions) {
+    if (submission.id == id)
+      return &submission;
+  }
+  return nullptr;
+}
+
+void GpuSim::upload(const tGrid &worldMatrix) {
+  if (worldMatrix.size() != size_t(m_Width) * m_Height) {
+    throw std::runtime_error("[GpuSim]: Uploaded world has the wrong size!");
+  }
+
+  // they'd be overwritten anyway
+  m_PendingFills.clear();
+
+  const vk::DeviceSize size = sizeof(Cell) * worldMatrix.size();
+  auto [staging, stagingMemory] = m_Allocator.createBuffer(
+      size, vk::BufferUsageFlagBits::eTransferSrc, MemoryUsage::Upload);
+  memcpy(stagingMemory.mapped(), worldMatrix.data(), size);
+
+  vk::raii::CommandBuffer commandBuffer = beginCommands();
+  cellBarrier(commandBuffer, CELL_USERS, CELL_ACCESS,
+              vk::PipelineStageFlagBits::eTransfer,
+              vk::AccessFlagBits::eTransferWrite);
+  commandBuffer.copyBuffer(*staging, *m_CellBuffer,
+                           vk::BufferCopy(0, 0, size));
+  cellBarrier(commandBuffer, vk::PipelineStageFlagBits::eTransfer,
+              vk::AccessFlagBits::eTransferWrite, CELL_USERS, CELL_ACCESS);
+  submit(std::move(commandBuffer));
+
+  // the staging buffer dies with this scope
+  waitIdle();
+}
+
+void GpuSim::recordStep(const vk::raii::CommandBuffer &commandBuffer,
+                        uint32_t ticks) {
+  recordFills(commandBuffer);
+  if (ticks == 0)
+    return;
+
+  cellBarrier(commandBuffer, CELL_USERS, CELL_ACCESS,
+              vk::PipelineStageFlagBits::eComputeShader,
+              vk::AccessFlagBits::eShaderRead |
+                  vk::AccessFlagBits::eShaderWrite);
+
+  commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *m_Pipeline);
+  commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                   *m_PipelineLayout, 0, *m_DescriptorSet,
+                                   nullptr);
+
+  // 8x8 blocks per workgroup, see margolus.comp
+  uint32_t groupsX = (margolusBlocks(m_Width) + 7) / 8;
+  uint32_t groupsY = (margolusBlocks(m_Height) + 7) / 8;
+
+  for (uint32_t i = 0; i < ticks; ++i) {
+    if (i > 0) {
+      // every tick reads what the last one wrote
+      cellBarrier(commandBuffer, vk::PipelineStageFlagBits::eComputeShader,
+                  vk::AccessFlagBits::eShaderWrite,
+                  vk::PipelineStageFlagBits::eComputeShader,
+                  vk::AccessFlagBits::eShaderRead |
+                      vk::AccessFlagBits::eShaderWrite);
+    }
+
+    MargolusParams params = margolusParams(
+        m_Width, m_Height, static_cast<uint32_t>(m_Tick), m_Seed);
+    commandBuffer.pushConstants<MargolusParams>(
+        *m_PipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, params);
+    commandBuffer.dispatch(groupsX, groupsY, 1);
+    ++m_Tick;
+  }
+
+  cellBarrier(commandBuffer, vk::PipelineStageFlagBits::eComputeShader,
+              vk::AccessFlagBits::eShaderWrite, CELL_USERS, CELL_ACCESS);
+}
+
+void GpuSim::step(uint32_t ticks) {
+  if (ticks == 0 && m_PendingFills.empty())
+    return;
+
+  vk::raii::CommandBuffer commandBuffer = beginCommands();
+  recordStep(commandBuffer, ticks);
+  submit(std::move(commandBuffer));
+}
+
+void GpuSim::fill(int64_t x0, int64_t y0, int64_t x1, int64_t y1,
+                  ElementType type) {
+  x0 = std::max<int64_t>(x0, 0);
+  y0 = std::max<int64_t>(y0, 0);
+  x1 = std::min<int64_t>(x1, m_Width - 1);
+  y1 = std::min<int64_t>(y1, m_Height - 1);
+  if (x0 > x1 || y0 > y1)
+    return;
+
+  const vk::DeviceSize rowBytes = sizeof(Cell) * (x1 - x0 + 1);
+  for (int64_t y = y0; y <= y1; ++y) {
+    m_PendingFills.push_back(
+        {sizeof(Cell) * vk::DeviceSize(y * m_Width + x0), rowBytes, type});
+  }
+}
+
+// Cells are bytes and vkCmdFillBuffer only does whole words, the words
+// inside a row are filled and the odd bytes at its ends copied from
+// m_FillPatterns. Nothing is staged per call.
+//
+// Transfers between two barriers run in any order. That's fine for fills
+// writing the same material, a fill overlapping an earlier one of another
+// material waits for everything before it.
+void GpuSim::recordFills(const vk::raii::CommandBuffer &commandBuffer) {
+  if (m_PendingFills.empty())
+    return;
+
+  cellBarrier(commandBuffer, CELL_USERS, CELL_ACCESS,
+              vk::PipelineStageFlagBits::eTransfer,
+              vk::AccessFlagBits::eTransferWrite);
+
+  std::vector<vk::BufferCopy> ends;
+  // since the last barrier
+  std::vector<const PendingFill *> recorded;
+  for (const PendingFill &fill : m_PendingFills) {
+    const vk::DeviceSize begin = fill.offset;
+    const vk::DeviceSize end = fill.offset + fill.size;
+
+    bool conflict = std::any_of(
+        recorded.begin(), recorded.end(), [&](const PendingFill *other) {
+          return other->type != fill.type && other->offset < end &&
+                 begin < other->offset + other->size;
+        });
+    if (conflict) {
+      if (!ends.empty()) {
+        commandBuffer.copyBuffer(*m_FillPatterns.buffer, *m_CellBuffer, ends);
+        ends.clear();
+      }
+      cellBarrier(commandBuffer, vk::PipelineStageFlagBits::eTransfer,
+                  vk::AccessFlagBits::eTransferWrite,
+                  vk::PipelineStageFlagBits::eTransfer,
+                  vk::AccessFlagBits::eTransferWrite);
+      recorded.clear();
+    }
+    recorded.push_back(&fill);
+    const vk::DeviceSize wordBegin = (begin + 3) & ~vk::DeviceSize(3);
+    const vk::DeviceSize wordEnd = end & ~vk::DeviceSize(3);
+    const vk::DeviceSize pattern =
+        sizeof(Cell) * FILL_PATTERN * static_cast<size_t>(fill.type);
+
+    if (wordBegin >= wordEnd) {
+      ends.emplace_back(pattern, begin, end - begin);
+      continue;
+    }
+    commandBuffer.fillBuffer(*m_CellBuffer, wordBegin, wordEnd - wordBegin,
+                             0x01010101u * static_cast<uint32_t>(fill.type));
+    if (begin < wordBegin)
+      ends.emplace_back(pattern, begin, wordBegin - begin);
+    if (wordEnd < end)
+      ends.emplace_back(pattern, wordEnd, end - wordEnd);
+  }
+  if (!ends.empty()) {
+    commandBuffer.copyBuffer(*m_FillPatterns.buffer, *m_CellBuffer, ends);
+  }
+  m_PendingFills.clear();
+
+  cellBarrier(commandBuffer, vk::PipelineStageFlagBits::eTransfer,
+              vk::AccessFlagBits::eTransferWrite, CELL_USERS, CELL_ACCESS);
+}
+
+GpuSim::HostBuffer GpuSim::createHostBuffer(size_t cellCount,
+                                            vk::BufferUsageFlags usage,
+                                            MemoryUsage memoryUsage) {
+  HostBuffer host;
+  host.cellCount = cellCount;
+  std::tie(host.buffer, host.memory) =
+      m_Allocator.createBuffer(sizeof(Cell) * cellCount, usage, memoryUsage);
+  host.mapped = host.memory.mapped();
+  return host;
+}
+
+uint64_t GpuSim::requestRegion(uint32_t x, uint32_t y, uint32_t width,
+                               uint32_t height) {
+  if (width == 0 || height == 0 || x + width > m_Width ||
+      y + height > m_Height) {
+    throw std::runtime_error("[GpuSim]: Readback region is out of bounds!");
+  }
+
+  HostBuffer readback =
+      createHostBuffer(size_t(width) * height,
+                       vk::BufferUsageFlagBits::eTransferDst,
+                       MemoryUsage::Readback);
+
+  std::vector<vk::BufferCopy> rows;
+  rows.reserve(height);
+  for (uint32_t row = 0; row < height; ++row) {
+    rows.emplace_back(sizeof(Cell) * ((size_t(y) + row) * m_Width + x),
+                      sizeof(Cell) * size_t(row) * width,
+                      sizeof(Cell) * width);
+  }
+
+  vk::raii::CommandBuffer commandBuffer = beginCommands();
+  // the region has to see the edits made before it was asked for
+  recordFills(commandBuffer);
+  cellBarrier(commandBuffer, CELL_USERS, CELL_ACCESS,
+              vk::PipelineStageFlagBits::eTransfer,
+              vk::AccessFlagBits::eTransferRead);
+  commandBuffer.copyBuffer(*m_CellBuffer, *readback.buffer, rows);
+  cellBarrier(commandBuffer, vk::PipelineStageFlagBits::eTransfer,
+              vk::AccessFlagBits::eTransferWrite,
+              vk::PipelineStageFlagBits::eHost, vk::AccessFlagBits::eHostRead);
+
+  return submit(std::move(commandBuffer), std::move(readback));
+}
+
+bool GpuSim::regionReady(uint64_t id) {
+  Submission *submission = findSubmission(id);
+  return submission && submission->readback &&
+         submission->fence.getStatus() == vk::Result::eSuccess;
+}
+
+bool GpuSim::takeRegion(uint64_t id, std::vector<Cell> &cells) {
+  if (!regionReady(id))
+    return false;
+
+  Submission *submission = findSubmission(id);
+  const HostBuffer &readback = *submission->readback;
+  cells.resize(readback.cellCount);
+  memcpy(cells.data(), readback.mapped, sizeof(Cell) * readback.cellCount);
+
+  submission->readback.reset();
+  retire();
+  return true;
+}
+
+void GpuSim::cancelRegion(uint64_t id) {
+  Submission *submission = findSubmission(id);
+  if (!submission || !submission->readback)
+    return;
+  // the copy may still be writing into it
+  submission->source = std::move(submission->readback);
+  submission->readback.reset();
+  retire();
+}
+
+void GpuSim::waitIdle() {
+  for (Submission &submission : m_Submissions) {
+    while (m_Device.waitForFences(*submission.fence, VK_TRUE, UINT64_MAX) ==
+           vk::Result::eTimeout)
+      ;
+  }
+  retire();
+}
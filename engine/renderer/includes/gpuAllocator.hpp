@@ -0,0 +1,145 @@
+#pragma once
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// What a buffer's memory is for, it decides the memory type it goes in.
+enum class MemoryUsage {
+  // only the GPU touches it, device local
+  GpuOnly,
+  // written once by the CPU and copied out by the GPU. Host visible, kept out
+  // of device local memory so it doesn't eat into a small ReBAR heap.
+  Upload,
+  // rewritten by the CPU every frame and read by the GPU. Host visible,
+  // device local (ReBAR) when the device has such a type.
+  Stream,
+  // written by the GPU and read by the CPU, host visible and cached if it can
+  Readback,
+};
+
+struct GpuMemoryBlock;
+class GpuAllocator;
+
+// A range of one of the allocator's blocks, given back when it's destroyed.
+// Allocations have to go before their allocator does.
+class GpuAllocation {
+public:
+  GpuAllocation() = default;
+  ~GpuAllocation() { release(); }
+
+  GpuAllocation(GpuAllocation &&other) noexcept { *this = std::move(other); }
+  GpuAllocation &operator=(GpuAllocation &&other) noexcept;
+  GpuAllocation(const GpuAllocation &) = delete;
+  GpuAllocation &operator=(const GpuAllocation &) = delete;
+
+  vk::DeviceMemory memory() const;
+  vk::DeviceSize offset() const { return m_Offset; }
+  vk::DeviceSize size() const { return m_Size; }
+  // nullptr unless the memory is host visible, mapped for as long as the
+  // allocation lives
+  void *mapped() const { return m_Mapped; }
+
+  explicit operator bool() const { return m_Block != nullptr; }
+
+private:
+  friend class GpuAllocator;
+  void release();
+
+  GpuAllocator *m_Allocator = nullptr;
+  GpuMemoryBlock *m_Block = nullptr;
+  vk::DeviceSize m_Offset = 0;
+  vk::DeviceSize m_Size = 0;
+  void *m_Mapped = nullptr;
+};
+
+struct GpuMemoryStats {
+  uint32_t blockCount = 0;
+  uint32_t allocationCount = 0;
+  // device memory taken from the driver
+  vk::DeviceSize blockBytes = 0;
+  // handed out, alignment included
+  vk::DeviceSize usedBytes = 0;
+};
+
+struct GpuHeapBudget {
+  vk::DeviceSize size = 0;
+  bool deviceLocal = false;
+  // the whole process's use and what it can have, from VK_EXT_memory_budget.
+  // Both 0 without it.
+  vk::DeviceSize usage = 0;
+  vk::DeviceSize budget = 0;
+  // this allocator's blocks
+  vk::DeviceSize blockBytes = 0;
+};
+
+// Sub-allocates buffers and images out of large device memory blocks, one
+// list of blocks per memory type. Drivers cap the number of allocations
+// (often at 4096) and each one is slow, so nothing else calls
+// vkAllocateMemory.
+class GpuAllocator {
+public:
+  // Blocks are this big, an allocation of more than half of it gets a block
+  // of its own.
+  static constexpr vk::DeviceSize BLOCK_SIZE = vk::DeviceSize(64) << 20;
+
+  // memoryBudget says VK_EXT_memory_budget is enabled on device, it needs
+  // Vulkan 1.1.
+  GpuAllocator(const vk::raii::PhysicalDevice &physicalDevice,
+               const vk::raii::Device &device, bool memoryBudget = false);
+  ~GpuAllocator();
+
+  GpuAllocator(const GpuAllocator &) = delete;
+  GpuAllocator &operator=(const GpuAllocator &) = delete;
+
+  // The buffer comes back bound to its allocation. With more than one queue
+  // family it's shared between them concurrently.
+  std::pair<vk::raii::Buffer, GpuAllocation>
+  createBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage,
+               MemoryUsage memoryUsage,
+               const std::vector<uint32_t> &queueFamilies = {});
+  // Throws if no memory type can take it. Buffers and linear images are
+  // linear, an optimal tiling image is padded out to whole
+  // bufferImageGranularity pages so it never shares one with them.
+  GpuAllocation allocate(const vk::MemoryRequirements &requirements,
+                         MemoryUsage memoryUsage, bool linear = true);
+
+  // Memory types allowed by typeBits that can serve usage, best first. Every
+  // one of them has all the properties usage needs.
+  std::vector<uint32_t> rankMemoryTypes(uint32_t typeBits,
+                                        MemoryUsage usage) const;
+
+  GpuMemoryStats stats() const;
+  // one entry per memory heap
+  std::vector<GpuHeapBudget> budgets() const;
+
+private:
+  friend class GpuAllocation;
+
+  std::optional<GpuAllocation> allocateFrom(GpuMemoryBlock &block,
+                                            vk::DeviceSize size,
+                                            vk::DeviceSize alignment);
+  // nullptr if the driver is out of memory for it
+  GpuMemoryBlock *createBlock(uint32_t type, vk::DeviceSize size,
+                              bool dedicated);
+  bool fitsBudget(uint32_t type, vk::DeviceSize size) const;
+  void free(GpuMemoryBlock *block, vk::DeviceSize offset,
+            vk::DeviceSize size);
+
+private:
+  const vk::raii::Device &m_Device;
+  const vk::raii::PhysicalDevice &m_PhysicalDevice;
+  vk::PhysicalDeviceMemoryProperties m_MemoryProperties;
+  vk::DeviceSize m_BufferImageGranularity;
+  bool m_MemoryBudget;
+
+  mutable std::mutex m_Mutex;
+  // per memory type
+  std::vector<std::vector<std::unique_ptr<GpuMemoryBlock>>> m_Blocks;
+  GpuMemoryStats m_Stats;
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include <config.hpp>
+#include <elementType.hpp>
+#include <gpuAllocator.hpp>
+
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Steps the world on the GPU with res/shaders/margolus.comp. The cells live
+// in a device local storage buffer in the same layout the renderer draws
+// from, so a GPU stepped world never goes through the CPU unless a region
+// is read back. stepMargolus in the sim library is the CPU reference.
+//
+// Everything is submitted to the one queue passed in, in order, so work
+// recorded into the renderer's frames and work submitted here don't need
+// anything more than pipeline barriers between them.
+class GpuSim {
+public:
+  // queueFamily has to support graphics and compute, shaderDir has to hold
+  // margolus.spv. Buffers come out of allocator, which has to outlive this.
+  // The pipeline is looked up in and added to pipelineCache if there's one.
+  GpuSim(const vk::raii::PhysicalDevice &physicalDevice,
+         const vk::raii::Device &device, GpuAllocator &allocator,
+         uint32_t queueFamily,
+         const vk::raii::Queue &queue, uint32_t width, uint32_t height,
+         const std::filesystem::path &shaderDir,
+         const vk::raii::PipelineCache *pipelineCache = nullptr);
+  ~GpuSim();
+
+  uint32_t width() const { return m_Width; }
+  uint32_t height() const { return m_Height; }
+
+  // replaces every cell, blocks until the copy is done
+  void upload(const tGrid &worldMatrix);
+
+  void setSeed(uint32_t seed) { m_Seed = seed; }
+  uint64_t tick() const { return m_Tick; }
+
+  // Records the edits made since the last call and ticks into a command
+  // buffer outside of a render pass. The cells are ready for the fragment
+  // shader and transfers once it's executed.
+  void recordStep(const vk::raii::CommandBuffer &commandBuffer,
+                  uint32_t ticks);
+  // same, in a submission of its own, doesn't wait for it
+  void step(uint32_t ticks);
+
+  // Sets every cell in [x0, x1] x [y0, y1] to type, clipped to the grid.
+  // Only queued, it goes in ahead of the next step or region recorded.
+  void fill(int64_t x0, int64_t y0, int64_t x1, int64_t y1, ElementType type);
+
+  // Copies a region out after everything submitted so far. Returns an id to
+  // poll with regionReady and collect with takeRegion, row-major from the
+  // region's bottom row up.
+  uint64_t requestRegion(uint32_t x, uint32_t y, uint32_t width,
+                         uint32_t height);
+  bool regionReady(uint64_t id);
+  // false while the copy is still running, the id is spent once it's true
+  bool takeRegion(uint64_t id, std::vector<Cell> &cells);
+  // For a region that won't be taken, its buffer is freed once the copy is
+  // done. A region is held on to until it's taken or cancelled.
+  void cancelRegion(uint64_t id);
+
+  // waits for everything submitted here
+  void waitIdle();
+
+  const vk::raii::Buffer &cellBuffer() const { return m_CellBuffer; }
+  vk::DeviceSize cellBufferSize() const {
+    return packedCellBytes(uint64_t(m_Width) * m_Height);
+  }
+
+private:
+  // host visible buffer a transfer reads from or writes into
+  struct HostBuffer {
+    vk::raii::Buffer buffer{nullptr};
+    GpuAllocation memory;
+    void *mapped = nullptr;
+    size_t cellCount = 0;
+  };
+
+  struct Submission {
+    uint64_t id = 0;
+    vk::raii::CommandBuffer commandBuffer{nullptr};
+    vk::raii::Fence fence{nullptr};
+    std::optional<HostBuffer> readback;
+    // kept alive until the transfer out of or into it is done
+    std::optional<HostBuffer> source;
+  };
+
+  // a row of cells set by fill, in bytes into the cell buffer
+  struct PendingFill {
+    vk::DeviceSize offset;
+    vk::DeviceSize size;
+    ElementType type;
+  };
+
+  vk::raii::CommandBuffer beginCommands();
+  // records and drops the queued fills
+  void recordFills(const vk::raii::CommandBuffer &commandBuffer);
+  uint64_t submit(vk::raii::CommandBuffer &&commandBuffer,
+                  std::optional<HostBuffer> readback = std::nullopt,
+                  std::optional<HostBuffer> source = std::nullopt);
+  HostBuffer createHostBuffer(size_t cellCount, vk::BufferUsageFlags usage,
+                              MemoryUsage memoryUsage);
+  // drops finished submissions nobody is waiting on
+  void retire();
+  Submission *findSubmission(uint64_t id);
+
+private:
+  const vk::raii::Device &m_Device;
+  const vk::raii::Queue &m_Queue;
+  GpuAllocator &m_Allocator;
+
+  uint32_t m_Width;
+  uint32_t m_Height;
+  uint32_t m_Seed = 0;
+  uint64_t m_Tick = 0;
+
+  vk::raii::Buffer m_CellBuffer{nullptr};
+  GpuAllocation m_CellMemory;
+
+  vk::raii::DescriptorSetLayout m_DescriptorSetLayout{nullptr};
+  vk::raii::DescriptorPool m_DescriptorPool{nullptr};
+  vk::raii::DescriptorSet m_DescriptorSet{nullptr};
+  vk::raii::PipelineLayout m_PipelineLayout{nullptr};
+  vk::raii::Pipeline m_Pipeline{nullptr};
+
+  vk::raii::CommandPool m_CommandPool{nullptr};
+
+  std::vector<PendingFill> m_PendingFills;
+  // FILL_PATTERN cells of every material, where the bytes of a fill that
+  // don't make a whole word are copied from
+  HostBuffer m_FillPatterns;
+
+  uint64_t m_NextId = 1;
+  std::deque<Submission> m_Submissions;
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+// A vk::PipelineCache kept in a file between runs, so pipelines are only
+// compiled the first time a driver sees them.
+//
+// The file is the driver's own cache data. Its header is checked against the
+// device's vendor, device id and pipelineCacheUUID (which changes with the
+// driver version) before the driver gets it, a file from another GPU or
+// driver, or a damaged one, just means starting with an empty cache.
+class PipelineCache {
+public:
+  PipelineCache(const vk::raii::PhysicalDevice &physicalDevice,
+                const vk::raii::Device &device,
+                const std::filesystem::path &path);
+  // saves if anything was added
+  ~PipelineCache();
+
+  PipelineCache(const PipelineCache &) = delete;
+  PipelineCache &operator=(const PipelineCache &) = delete;
+
+  const vk::raii::PipelineCache &cache() const { return m_Cache; }
+  vk::PipelineCache operator*() const { return *m_Cache; }
+
+  // whether the file was there and matched this device
+  bool loaded() const { return m_Loaded; }
+
+  // Writes the cache out if it grew since it was loaded or last saved,
+  // through a temporary file so instances running at the same time never
+  // read half a file. Failing to write only logs.
+  void save();
+
+private:
+  bool validHeader(const std::vector<char> &data) const;
+
+private:
+  const vk::raii::Device &m_Device;
+  vk::PhysicalDeviceProperties m_Properties;
+  std::filesystem::path m_Path;
+
+  vk::raii::PipelineCache m_Cache{nullptr};
+  bool m_Loaded = false;
+  size_t m_SavedSize = 0;
+};
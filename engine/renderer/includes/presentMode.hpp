@@ -0,0 +1,25 @@
+#pragma once
+
+// How frames are paced and presented. The renderer picks the swapchain's
+// present mode from it, FramePacer the CPU side.
+enum class PresentMode {
+  // MAILBOX, else IMMEDIATE. The CPU is held back to the display's rate and
+  // samples input as late as it can before drawing.
+  LowLatency,
+  // FIFO, limited further to a target rate
+  PowerSaving,
+  // IMMEDIATE, else MAILBOX, nothing waits. For benchmarking.
+  Uncapped,
+};
+
+inline const char *presentModeName(PresentMode mode) {
+  switch (mode) {
+  case PresentMode::LowLatency:
+    return "low latency";
+  case PresentMode::PowerSaving:
+    return "power saving";
+  case PresentMode::Uncapped:
+    return "uncapped";
+  }
+  return "";
+}
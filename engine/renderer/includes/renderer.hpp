@@ -14,10 +14,20 @@
 #include <vector>
 #include <optional>
 #include <filesystem>
+#include <memory>
+#include <limits>
 
 #include <glm/glm.hpp>
 
+#include <chunk.hpp>
 #include <config.hpp>
+#include <gpuAllocator.hpp>
+#include <pipelineCache.hpp>
+#include <presentMode.hpp>
+#include <profiler.hpp>
+#include <uploadContext.hpp>
+
+class GpuSim;
 
 
 class Renderer
@@ -26,11 +36,47 @@ class Renderer
 public:
 	Renderer() = default;
 	~Renderer();
-	void init(GLFWwindow* window, tGrid* worldMatrix);
-	void render();
+	void init(GLFWwindow* window, uint32_t gridWidth, uint32_t gridHeight);
+	// No window, frames are drawn into width x height offscreen images
+	// instead of a swapchain and nothing is presented. Needs no surface
+	// support, a software device like lavapipe does fine.
+	void initHeadless(uint32_t width, uint32_t height, uint32_t gridWidth,
+					  uint32_t gridHeight);
+	bool headless() const { return window == nullptr; }
+	// worldMatrix has to stay untouched until the next call. dirty lists the
+	// cells that changed since the last call, nullptr for all of them.
+	void render(const tGrid& worldMatrix,
+				const std::vector<DirtyRect>* dirty = nullptr);
+	// bytes copied to the GPU for the last frame
+	vk::DeviceSize lastUploadBytes() const { return m_LastUploadBytes; }
+	const GpuAllocator& allocator() const { return *m_Allocator; }
+	// Picks the swapchain's present mode, the swapchain is recreated after
+	// the next present. Falls back to FIFO where the mode isn't supported.
+	void setPresentMode(PresentMode mode);
+	PresentMode presentMode() const { return m_PresentMode; }
+	// what the swapchain actually got
+	vk::PresentModeKHR swapchainPresentMode() const { return m_SwapchainPresentMode; }
+
+	// Headless only. The frame drawn by the next render call is copied out,
+	// poll with frameReady and collect with takeFrame. Pixels are RGBA8 in
+	// sRGB, what a window would show, top row first.
+	uint64_t requestFrame();
+	bool frameReady(uint64_t id);
+	// false while the copy is still running, the id is spent once it's true
+	bool takeFrame(uint64_t id, std::vector<uint8_t>& pixels);
+	vk::Extent2D frameExtent() const { return swapchainImageExtent; }
+	// waits for every frame submitted
+	void waitIdle();
 
 	void setCellUpdate(void onUpdate(tGrid&));
 
+	// Moves the world onto the GPU, stepped by GpuSim from here on instead of
+	// being copied from a tGrid every frame.
+	void enableGpuSim(const tGrid& worldMatrix, uint32_t seed);
+	GpuSim* gpuSim() { return m_GpuSim.get(); }
+	// steps the GPU world ticks times ahead of drawing it
+	void renderGpuSim(uint32_t ticks);
+
 private:
 	void initVulkan();
 
@@ -41,14 +87,14 @@ private:
 	void createLogicalDevice();
 	void createSurface();
 	void createSwapchain();
+	// headless stand in for the swapchain, one image per frame in flight
+	void createOffscreenImages();
 	void createRenderPass();
 	void createDescriptorSetLayout();
 	void createGraphicsPipeline();
 	void createFramebuffers();
 	void createCommandPool();
 	
-	void createVertexBuffer();
-	void createIndexBuffer();
 	void createUniformBuffers();
 	void createStorageBuffer();
 	void createCommandBuffers();
@@ -56,25 +102,37 @@ private:
 	void createDescriptorSet();
 
 	void createSyncObjects();
+	// the frame's GPU timestamps, nothing without ENGINE_PROFILER
+	void createTimestampPool();
+	// hands the timestamps of the current slot's last frame to the profiler
+	void collectTimestamps();
 
 	void drawFrame();
 
-	void updateCells();
+	// records the copies of everything the current slot hasn't seen yet
+	void updateCells(vk::raii::CommandBuffer& _commandBuffer);
 	
-	std::pair<vk::raii::Buffer, vk::raii::DeviceMemory> createBuffer(vk::DeviceSize _size, 
+	// _shared buffers can be written by m_Uploads
+	std::pair<vk::raii::Buffer, GpuAllocation> createBuffer(vk::DeviceSize _size, 
 					vk::BufferUsageFlags _usage,
-					vk::MemoryPropertyFlags _propertyFlags);
+					MemoryUsage _memoryUsage,
+					bool _shared = false);
 	
-	void copyBuffer(vk::raii::Buffer& _src, vk::raii::Buffer& _dst, vk::DeviceSize _size);
 
 	void recordCommandBuffer(vk::raii::CommandBuffer& _commandBuffer, uint32_t _imageIndex);
+	// copies the offscreen image into the readback requested for this frame
+	void recordReadback(vk::raii::CommandBuffer& _commandBuffer, uint32_t _imageIndex);
 
 	std::vector<const char*> getRequiredInstanceExtensions();
+	// the swapchain extension, none headless
+	std::vector<const char*> getRequiredDeviceExtensions();
 
 	struct QueueFamilyIndices {
 		//The Physical Device may not support all Queue Families.
 		std::optional<uint32_t> graphicsFamily;
 		std::optional<uint32_t> presentFamily;
+		// a transfer only family for uploads, optional
+		std::optional<uint32_t> transferFamily;
 
 		bool isComplete()
 		{
@@ -112,47 +170,20 @@ private:
 	const bool enableValidationLayers = false;
 #endif
 
-	struct Vertex {
-		glm::vec2 pos;
-
-		static vk::VertexInputBindingDescription getBindingDescription() {
-			vk::VertexInputBindingDescription bindingDescription{
-				0,
-				sizeof(Vertex),
-				vk::VertexInputRate::eVertex
-			};
-
-			return bindingDescription;
-		}
-
-		static std::array<vk::VertexInputAttributeDescription, 1> getAttributeDescription() {
-			std::array<vk::VertexInputAttributeDescription, 1> attributeDescriptions;
-
-			attributeDescriptions[0].binding = 0;
-			attributeDescriptions[0].location = 0;
-			attributeDescriptions[0].offset = offsetof(Vertex, pos);
-			attributeDescriptions[0].format = vk::Format::eR32G32Sfloat;
-
-			return attributeDescriptions;
-		}
-	};
-
+	// std140, see gridf.frag
 	struct UniformBufferObject {
 		glm::vec2 grid_size;
-	} ubo{ glm::vec2(GRID_SIZE_X, GRID_SIZE_Y) };
-
-	tGrid* m_WorldMatrix;
-
-	const std::vector<Vertex> vertices{
-		{{-1.0f, -1.0f}},
-		{{1.0f, -1.0f}},
-		{{1.0f, 1.0f}},
-		{{-1.0f, 1.0f}}
-	};
-
-	const std::vector<uint16_t> indices{
-		0, 1, 2, 2, 3, 0
-	};
+		// a vec4 array starts on a 16 byte boundary
+		glm::vec2 padding;
+		// colour of every material byte, RGBA
+		std::array<glm::vec4, 256> palette;
+	} ubo{ glm::vec2(DEFAULT_GRID_SIZE_X, DEFAULT_GRID_SIZE_Y) };
+
+	// frame handed to the current render() call
+	const tGrid* m_WorldMatrix{nullptr};
+	uint32_t m_GridWidth = 0;
+	uint32_t m_GridHeight = 0;
+	size_t m_CellCount = 0;
 
 	GLFWwindow* window{nullptr};
 
@@ -161,10 +192,18 @@ private:
 	vk::raii::Instance instance{nullptr};
 	vk::raii::PhysicalDevice physicalDevice{nullptr};
 	vk::raii::Device device{nullptr};
+	// every buffer's memory, it outlives them and goes before the device
+	std::unique_ptr<GpuAllocator> m_Allocator;
+	// pipeline_cache.bin next to the executable
+	std::unique_ptr<PipelineCache> m_PipelineCache;
 
 	vk::raii::SurfaceKHR surface{nullptr};
 
 	vk::raii::SwapchainKHR swapchain{nullptr};
+	// headless only, what swapchainImages point at. Declared ahead of the
+	// views so those go first.
+	std::vector<GpuAllocation> m_OffscreenMemory;
+	std::vector<vk::raii::Image> m_OffscreenImages;
 	std::vector<vk::Image> swapchainImages;
 	std::vector<vk::raii::ImageView> swapchainImageViews;
 	vk::Format swapchainImageFormat;
@@ -174,6 +213,13 @@ private:
 
 	vk::raii::Queue graphicsQueue{nullptr};
 	vk::raii::Queue presentQueue{nullptr};
+	// the graphics queue when there's no transfer family
+	vk::raii::Queue transferQueue{nullptr};
+
+	// startup uploads, batched on the transfer queue
+	std::unique_ptr<UploadContext> m_Uploads;
+	// the next frame can't be submitted before this batch is done
+	uint64_t m_UploadTicket = 0;
 
 	vk::raii::RenderPass renderPass{nullptr};
 
@@ -188,6 +234,24 @@ private:
 	std::vector<vk::raii::Semaphore> imageAvailableSemaphores;
 	std::vector<vk::raii::Semaphore> renderFinishedSemaphores;
 	std::vector<vk::raii::Fence> inFlightFences;
+	// frames submitted so far, and the last one each frame in flight slot
+	// submitted
+	uint64_t m_FrameCount = 0;
+	std::vector<uint64_t> m_SlotFrames;
+
+#if ENGINE_PROFILER
+	// Four timestamps per frame in flight, before and after the cell upload
+	// or GPU ticks and before and after the render pass.
+	// Null if the graphics queue doesn't do timestamps.
+	vk::raii::QueryPool m_TimestampPool{nullptr};
+	// nanoseconds per timestamp tick
+	double m_TimestampPeriod = 0.0;
+	// profiler::now() at each slot's last submit, 0 once its timestamps
+	// were collected
+	std::vector<uint64_t> m_SubmitTimes;
+	// GPU nanoseconds + this is the profiler's clock, see collectTimestamps
+	double m_GpuClockOffset = std::numeric_limits<double>::lowest();
+#endif
 
 	vk::raii::DebugUtilsMessengerEXT debugUtilsMessenger{nullptr};
 
@@ -195,21 +259,55 @@ public:
 	bool framebufferResized = false;
 
 private:
-	vk::raii::Buffer vertexBuffer{nullptr};
-	vk::raii::DeviceMemory vertexBufferMemory{nullptr};
-
-	vk::raii::Buffer indexBuffer{nullptr};
-	vk::raii::DeviceMemory indexBufferMemory{nullptr};
+	PresentMode m_PresentMode = PresentMode::LowLatency;
+	bool m_PresentModeChanged = false;
+	vk::PresentModeKHR m_SwapchainPresentMode = vk::PresentModeKHR::eFifo;
 
 	vk::raii::Buffer uniformBuffer{nullptr};
-	vk::raii::DeviceMemory uniformBuffersMemory{nullptr};
-
-	vk::raii::Buffer storageBuffer{nullptr};
-	vk::raii::DeviceMemory storageBufferMemory{nullptr};
-	void* storageBufferWriteLoc{nullptr};
+	GpuAllocation uniformBufferMemory;
 
 	vk::raii::DescriptorPool descriptorPool{nullptr};
-	vk::raii::DescriptorSet descriptorSet{nullptr};
+
+	// What one frame in flight uploads into and draws from. A slot is only
+	// used again after its frame's fence signalled, so its copies never
+	// overwrite cells a draw still in flight is reading.
+	struct CellSlot {
+		// device local cells, written by copies out of staging
+		vk::raii::Buffer buffer{nullptr};
+		GpuAllocation memory;
+		// up to CELL_STAGING_BYTES, a frame's changes past that go through
+		// m_Uploads
+		vk::raii::Buffer staging{nullptr};
+		GpuAllocation stagingMemory;
+		void* stagingMapped = nullptr;
+		vk::DeviceSize stagingSize = 0;
+		vk::raii::DescriptorSet descriptorSet{nullptr};
+
+		// changes this slot hasn't been sent yet, merged per chunk
+		std::vector<DirtyRect> pendingDirty;
+		std::vector<uint32_t> pendingChunks;
+		bool pendingFull = true;
+	};
+	// one per frame in flight, after descriptorPool so the sets go first
+	std::vector<CellSlot> m_CellSlots;
+	std::vector<vk::BufferCopy> m_UploadRegions;
+	vk::DeviceSize m_LastUploadBytes = 0;
+
+	// A headless frame on its way to the CPU. It's done once its slot's fence
+	// signalled, or once the slot was used again since drawFrame waits on
+	// that fence first.
+	struct FrameReadback {
+		uint64_t id = 0;
+		uint32_t slot = 0;
+		// m_FrameCount of the frame copied out, 0 until it's recorded
+		uint64_t frame = 0;
+		vk::raii::Buffer buffer{nullptr};
+		GpuAllocation memory;
+	};
+	std::vector<FrameReadback> m_Readbacks;
+	// taken ones, kept for the next request since they're all the same size
+	std::vector<FrameReadback> m_SpareReadbacks;
+	uint64_t m_NextReadbackId = 1;
 
 	const std::vector<const char*> ValidationLayers{
 		"VK_LAYER_KHRONOS_validation"
@@ -218,4 +316,9 @@ private:
 	const std::vector<const char*> DeviceExtensions{
 		VK_KHR_SWAPCHAIN_EXTENSION_NAME
 	};
+
+	// ticks recorded ahead of the next frame's draw
+	uint32_t m_GpuTicks = 0;
+	// last, it has to go before the device does
+	std::unique_ptr<GpuSim> m_GpuSim;
 };
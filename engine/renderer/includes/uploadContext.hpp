@@ -0,0 +1,126 @@
+#pragma once
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include <gpuAllocator.hpp>
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <vector>
+
+// Batches buffer uploads into one submission per flush, on a transfer queue
+// of their own when the device has one so they run next to the frames.
+// Staging data goes through a ring of host memory that's reused as batches
+// finish, nothing waits for the GPU unless the ring is full.
+//
+// Buffers written here that the graphics queue uses afterwards have to be
+// shared by both families (queueFamilies()), and the first submission using
+// them has to come after wait() on the batch's ticket.
+class UploadContext {
+public:
+  static constexpr vk::DeviceSize DEFAULT_RING_SIZE = vk::DeviceSize(16) << 20;
+
+  // a family with transfer but no graphics, where copies don't queue up
+  // behind draws. Those without compute either are DMA engines, they go
+  // first.
+  static std::optional<uint32_t>
+  findTransferFamily(const vk::raii::PhysicalDevice &physicalDevice);
+
+  // queue has to be of queueFamily, graphicsFamily is the one that uses
+  // what's uploaded
+  UploadContext(const vk::raii::Device &device, GpuAllocator &allocator,
+                uint32_t queueFamily, const vk::raii::Queue &queue,
+                uint32_t graphicsFamily,
+                vk::DeviceSize ringSize = DEFAULT_RING_SIZE);
+  // waits for every batch
+  ~UploadContext();
+
+  UploadContext(const UploadContext &) = delete;
+  UploadContext &operator=(const UploadContext &) = delete;
+
+  // Copies size bytes from data to dst at offset with the next flush. data is
+  // copied right away and can go once this returns.
+  void upload(vk::Buffer dst, vk::DeviceSize offset, const void *data,
+              vk::DeviceSize size);
+  // fills size bytes of dst at offset with value, size and offset have to be
+  // multiples of 4 (or size VK_WHOLE_SIZE)
+  void fill(vk::Buffer dst, vk::DeviceSize offset, vk::DeviceSize size,
+            uint32_t value);
+
+  // Submits everything queued since the last flush as one batch. Returns its
+  // ticket, or the last one if nothing was queued.
+  uint64_t flush();
+  bool isComplete(uint64_t ticket);
+  void wait(uint64_t ticket);
+
+  // the families buffers written here are shared between, one entry if the
+  // uploads run on the graphics queue
+  const std::vector<uint32_t> &queueFamilies() const {
+    return m_QueueFamilies;
+  }
+
+private:
+  struct Op {
+    vk::Buffer src;
+    vk::Buffer dst;
+    vk::BufferCopy region;
+    // copies have a src, fills take this
+    uint32_t value = 0;
+  };
+
+  struct Batch {
+    uint64_t ticket = 0;
+    vk::raii::CommandBuffer commandBuffer{nullptr};
+    vk::raii::Fence fence{nullptr};
+    // ring bytes this batch holds, padding included, up to ringEnd
+    vk::DeviceSize ringBytes = 0;
+    vk::DeviceSize ringEnd = 0;
+    // uploads that didn't fit in the ring
+    std::vector<std::pair<vk::raii::Buffer, GpuAllocation>> staging;
+  };
+
+  // a finished batch's command buffer and fence, both reset
+  struct Recycled {
+    vk::raii::CommandBuffer commandBuffer{nullptr};
+    vk::raii::Fence fence{nullptr};
+  };
+  // more than this many batches in flight is a burst, the rest are freed
+  static constexpr size_t MAX_RECYCLED = 8;
+
+  // an offset in the ring with size bytes free, flushes and waits if it has
+  // to. Returns false if size is more than the ring can ever hold.
+  bool reserve(vk::DeviceSize size, vk::DeviceSize &offset);
+  void record(const vk::raii::CommandBuffer &commandBuffer);
+  // drops finished batches from the front, frees their ring space and
+  // keeps their command buffers and fences for the next flushes
+  void retire();
+
+private:
+  const vk::raii::Device &m_Device;
+  const vk::raii::Queue &m_Queue;
+  GpuAllocator &m_Allocator;
+  std::vector<uint32_t> m_QueueFamilies;
+
+  vk::raii::CommandPool m_CommandPool{nullptr};
+
+  vk::raii::Buffer m_Ring{nullptr};
+  GpuAllocation m_RingMemory;
+  vk::DeviceSize m_RingSize;
+  // bytes from m_RingTail up to m_RingHead, wrapping around, belong to
+  // queued or running batches. With m_RingUsed 0 the ring is empty.
+  vk::DeviceSize m_RingHead = 0;
+  vk::DeviceSize m_RingTail = 0;
+  vk::DeviceSize m_RingUsed = 0;
+
+  // not flushed yet
+  std::vector<Op> m_Ops;
+  vk::DeviceSize m_OpsRingBytes = 0;
+  std::vector<std::pair<vk::raii::Buffer, GpuAllocation>> m_Staging;
+
+  uint64_t m_NextTicket = 1;
+  // every ticket up to this one is done
+  uint64_t m_CompletedTicket = 0;
+  std::deque<Batch> m_Batches;
+  std::vector<Recycled> m_Recycled;
+};
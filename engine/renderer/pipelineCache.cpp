@@ -0,0 +1,110 @@
+#include <pipelineCache.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <system_error>
+
+namespace {
+
+// VkPipelineCacheHeaderVersionOne
+const size_t HEADER_SIZE = 16 + VK_UUID_SIZE;
+
+uint32_t readU32(const char *data) {
+  // the header is in the host's byte order, no swapping
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+std::vector<char> readAll(const std::filesystem::path &path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file.is_open())
+    return {};
+
+  std::vector<char> data(static_cast<size_t>(file.tellg()));
+  file.seekg(0);
+  file.read(data.data(), data.size());
+  if (!file)
+    return {};
+  return data;
+}
+
+} // namespace
+
+PipelineCache::PipelineCache(const vk::raii::PhysicalDevice &physicalDevice,
+                             const vk::raii::Device &device,
+                             const std::filesystem::path &path)
+    : m_Device(device), m_Properties(physicalDevice.getProperties()),
+      m_Path(path) {
+  std::vector<char> data = readAll(m_Path);
+  if (!data.empty() && validHeader(data)) {
+    try {
+      m_Cache = vk::raii::PipelineCache(
+          m_Device, vk::PipelineCacheCreateInfo(vk::PipelineCacheCreateFlags{},
+                                                data.size(), data.data()));
+      m_Loaded = true;
+      m_SavedSize = data.size();
+    } catch (const vk::SystemError &) {
+      // the driver didn't take it after all, same as a stale file
+    }
+  }
+
+  if (!m_Loaded) {
+    m_Cache = vk::raii::PipelineCache(m_Device, vk::PipelineCacheCreateInfo{});
+  }
+}
+
+PipelineCache::~PipelineCache() { save(); }
+
+bool PipelineCache::validHeader(const std::vector<char> &data) const {
+  if (data.size() < HEADER_SIZE)
+    return false;
+
+  uint32_t headerSize = readU32(data.data());
+  uint32_t version = readU32(data.data() + 4);
+  uint32_t vendorId = readU32(data.data() + 8);
+  uint32_t deviceId = readU32(data.data() + 12);
+
+  return headerSize >= HEADER_SIZE && headerSize <= data.size() &&
+         version ==
+             static_cast<uint32_t>(vk::PipelineCacheHeaderVersion::eOne) &&
+         vendorId == m_Properties.vendorID &&
+         deviceId == m_Properties.deviceID &&
+         !memcmp(data.data() + 16, m_Properties.pipelineCacheUUID.data(),
+                 VK_UUID_SIZE);
+}
+
+void PipelineCache::save() {
+  std::vector<uint8_t> data = m_Cache.getData();
+  if (data.size() <= m_SavedSize)
+    return;
+
+  // unique per writer, another instance may be saving too
+  std::filesystem::path temporary = m_Path;
+  temporary += ".tmp" + std::to_string(std::random_device{}());
+
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(data.data()), data.size());
+    if (!file) {
+      std::cout << "[PipelineCache]: Couldn't write " << temporary.string()
+                << "\n";
+      std::error_code ignored;
+      std::filesystem::remove(temporary, ignored);
+      return;
+    }
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temporary, m_Path, error);
+  if (error) {
+    std::cout << "[PipelineCache]: Couldn't replace " << m_Path.string()
+              << ": " << error.message() << "\n";
+    std::filesystem::remove(temporary, error);
+    return;
+  }
+  m_SavedSize = data.size();
+}
@@ -1,7 +1,9 @@
 #include "config.hpp"
+#include <gpuSim.hpp>
 #include <renderer.hpp>
 #include <utils.hpp>
 #include <debugUtils.hpp>
+#include <elementType.hpp>
 #include <wrappers.hpp>
 
 #include <cstring> // strcmp
@@ -21,66 +23,310 @@
 
 #include <glm/glm.hpp>
 
+namespace {
 
-void Renderer::init(GLFWwindow *window, tGrid* worldMatrix) {
+// RGB of every material, indexed by ElementType
+const glm::vec3 MATERIAL_COLORS[ELEMENT_TYPE_COUNT] = {
+    {0, 0, 0},       // air
+    {203, 189, 147}, // sand
+    {48, 92, 222},   // water
+    {110, 106, 112}, // stone
+    {82, 58, 30},    // oil
+    {72, 72, 80},    // smoke
+};
+
+// per frame in flight: around the cell upload or GPU ticks, then around
+// the render pass
+const uint32_t TIMESTAMPS_PER_FRAME = 4;
+
+// Each frame in flight stages up to this much of what changed, plenty for
+// edits and a busy sim. What doesn't fit goes through the UploadContext's
+// ring in pieces this big, instead of every slot holding a whole grid.
+const vk::DeviceSize CELL_STAGING_BYTES = vk::DeviceSize(4) << 20;
+
+} // namespace
+
+void Renderer::init(GLFWwindow *window, uint32_t gridWidth,
+                    uint32_t gridHeight) {
   this->window = window;
-  this->m_WorldMatrix = worldMatrix;
+  ubo.grid_size = glm::vec2(gridWidth, gridHeight);
+  m_GridWidth = gridWidth;
+  m_GridHeight = gridHeight;
+  m_CellCount = size_t(gridWidth) * gridHeight;
   initVulkan();
 }
 
-void Renderer::render() {
-  updateCells();
+void Renderer::initHeadless(uint32_t width, uint32_t height,
+                            uint32_t gridWidth, uint32_t gridHeight) {
+  if (width == 0 || height == 0) {
+    throw std::runtime_error("[Renderer]: Headless frames can't be empty!");
+  }
+  swapchainImageExtent = vk::Extent2D(width, height);
+  init(nullptr, gridWidth, gridHeight);
+}
+
+void Renderer::render(const tGrid &worldMatrix,
+                      const std::vector<DirtyRect> *dirty) {
+  m_WorldMatrix = &worldMatrix;
+
+  // Piles up in every slot until that slot's frame gets recorded, each one
+  // has to catch up on everything drawn since it was last used.
+  const uint32_t chunksX = (m_GridWidth + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  for (CellSlot &slot : m_CellSlots) {
+    if (!dirty) {
+      slot.pendingFull = true;
+    }
+    if (slot.pendingFull)
+      continue;
+
+    for (const DirtyRect &rect : *dirty) {
+      uint32_t chunk =
+          (rect.minY / CHUNK_SIZE) * chunksX + rect.minX / CHUNK_SIZE;
+      DirtyRect &pending = slot.pendingDirty[chunk];
+      if (pending.empty())
+        slot.pendingChunks.push_back(chunk);
+      pending.include(rect.minX, rect.minY, rect.maxX, rect.maxY);
+    }
+  }
+
+  drawFrame();
+}
+
+void Renderer::enableGpuSim(const tGrid &worldMatrix, uint32_t seed) {
+  device.waitIdle();
+
+  m_GpuSim = std::make_unique<GpuSim>(
+      physicalDevice, device, *m_Allocator,
+      queryQueueFamilyIndices(physicalDevice).graphicsFamily.value(),
+      graphicsQueue, m_GridWidth, m_GridHeight,
+      utils::getExecutableDir() / "res/shaders", &m_PipelineCache->cache());
+  m_PipelineCache->save();
+  m_GpuSim->setSeed(seed);
+  m_GpuSim->upload(worldMatrix);
+
+  // the fragment shader reads straight from the simulated cells, every frame
+  // the same buffer since the compute barriers order it
+  vk::DescriptorBufferInfo cellBufferInfo(*m_GpuSim->cellBuffer(), 0,
+                                          m_GpuSim->cellBufferSize());
+  for (CellSlot &slot : m_CellSlots) {
+    vk::WriteDescriptorSet descriptorWrite(
+        *slot.descriptorSet, 1, 0, vk::DescriptorType::eStorageBuffer, nullptr,
+        cellBufferInfo, nullptr, nullptr);
+    device.updateDescriptorSets(descriptorWrite, nullptr);
+  }
+
+  m_WorldMatrix = nullptr;
+}
+
+void Renderer::renderGpuSim(uint32_t ticks) {
+  if (!m_GpuSim) {
+    throw std::runtime_error("[Renderer]: The GPU sim isn't enabled!");
+  }
+
+  m_GpuTicks = ticks;
   drawFrame();
+  m_GpuTicks = 0;
 }
 
+uint64_t Renderer::requestFrame() {
+  if (!headless()) {
+    throw std::runtime_error(
+        "[Renderer]: Frames can only be read back headless!");
+  }
+
+  FrameReadback readback;
+  if (!m_SpareReadbacks.empty()) {
+    readback = std::move(m_SpareReadbacks.back());
+    m_SpareReadbacks.pop_back();
+  } else {
+    std::tie(readback.buffer, readback.memory) = createBuffer(
+        vk::DeviceSize(swapchainImageExtent.width) *
+            swapchainImageExtent.height * 4,
+        vk::BufferUsageFlagBits::eTransferDst, MemoryUsage::Readback);
+  }
+  readback.id = m_NextReadbackId++;
+  readback.frame = 0;
+  m_Readbacks.push_back(std::move(readback));
+  return m_Readbacks.back().id;
+}
+
+bool Renderer::frameReady(uint64_t id) {
+  for (const FrameReadback &readback : m_Readbacks) {
+    if (readback.id != id)
+      continue;
+    if (readback.frame == 0)
+      return false;
+    return m_SlotFrames[readback.slot] != readback.frame ||
+           inFlightFences[readback.slot].getStatus() == vk::Result::eSuccess;
+  }
+  return false;
+}
+
+bool Renderer::takeFrame(uint64_t id, std::vector<uint8_t> &pixels) {
+  if (!frameReady(id))
+    return false;
+
+  auto readback = std::find_if(
+      m_Readbacks.begin(), m_Readbacks.end(),
+      [id](const FrameReadback &candidate) { return candidate.id == id; });
+  pixels.resize(size_t(swapchainImageExtent.width) *
+                swapchainImageExtent.height * 4);
+  memcpy(pixels.data(), readback->memory.mapped(), pixels.size());
+
+  m_SpareReadbacks.push_back(std::move(*readback));
+  m_Readbacks.erase(readback);
+  return true;
+}
+
+void Renderer::waitIdle() { device.waitIdle(); }
+
 Renderer::~Renderer() {
   // cleanup of all resources used in render loop
   device.waitIdle();
 }
 // ???????????????????????????????????
-// void (*Renderer::updateFunc) (std::array<Cell, GRID_SIZE_X * GRID_SIZE_Y>&) =
+// void (*Renderer::updateFunc) (tGrid&) =
 // nullptr;
 
 void Renderer::initVulkan() {
   createInstance();
   setupDebugMessenger();
-  createSurface();
+  if (!headless()) {
+    createSurface();
+  }
   pickPhysicalDevice();
   createLogicalDevice();
-  createSwapchain();
+  if (headless()) {
+    createOffscreenImages();
+  } else {
+    createSwapchain();
+  }
   createRenderPass();
   createDescriptorSetLayout();
   createGraphicsPipeline();
   createFramebuffers();
   createCommandPool();
 
-  createVertexBuffer();
-  createIndexBuffer();
   createUniformBuffers();
   createStorageBuffer();
+  // runs while the rest is set up, the first frame waits for it
+  m_UploadTicket = m_Uploads->flush();
   createCommandBuffers();
   createDescriptorPool();
   createDescriptorSet();
 
   createSyncObjects();
+  createTimestampPool();
+
+  // the next launch skips compiling what was just compiled
+  m_PipelineCache->save();
 }
 
-void Renderer::updateCells() {
-  vk::DeviceSize bufferSize = sizeof(tGrid);
+// Changed rows are packed into this frame's staging buffer and copied into
+// its device local cells, so the upload is as big as what moved since the
+// slot was last drawn. Past the staging buffer's size, a full upload or a
+// very busy frame, the rest goes through m_Uploads and the frame's submit
+// waits for it.
+void Renderer::updateCells(vk::raii::CommandBuffer &_commandBuffer) {
+  PROFILE_ZONE("Renderer::updateCells");
+  m_UploadRegions.clear();
+  m_LastUploadBytes = 0;
+  CellSlot &slot = m_CellSlots[currentFrame];
+  if (!m_WorldMatrix || (!slot.pendingFull && slot.pendingChunks.empty()))
+    return;
+
+  uint8_t *staging = static_cast<uint8_t *>(slot.stagingMapped);
+  const Cell *cells = m_WorldMatrix->data();
+  vk::DeviceSize staged = 0;
+  bool spilled = false;
+
+  auto copyRange = [&](size_t first, size_t count) {
+    vk::DeviceSize src = staged;
+    vk::DeviceSize dst = sizeof(Cell) * first;
+    vk::DeviceSize size = sizeof(Cell) * count;
+    m_LastUploadBytes += size;
+
+    if (staged + size > slot.stagingSize) {
+      const uint8_t *bytes = reinterpret_cast<const uint8_t *>(cells + first);
+      for (vk::DeviceSize done = 0; done < size; done += CELL_STAGING_BYTES) {
+        m_Uploads->upload(*slot.buffer, dst + done, bytes + done,
+                          std::min(CELL_STAGING_BYTES, size - done));
+      }
+      spilled = true;
+      return;
+    }
+    memcpy(staging + src, cells + first, size);
+    staged += size;
+
+    // rows of a full width rect are one range
+    if (!m_UploadRegions.empty()) {
+      vk::BufferCopy &last = m_UploadRegions.back();
+      if (last.srcOffset + last.size == src &&
+          last.dstOffset + last.size == dst) {
+        last.size += size;
+        return;
+      }
+    }
+    m_UploadRegions.emplace_back(src, dst, size);
+  };
 
-  memcpy(storageBufferWriteLoc, m_WorldMatrix, bufferSize);
+  if (slot.pendingFull) {
+    copyRange(0, m_CellCount);
+  } else {
+    for (uint32_t chunk : slot.pendingChunks) {
+      const DirtyRect &rect = slot.pendingDirty[chunk];
+      for (uint32_t y = rect.minY; y <= rect.maxY; ++y) {
+        copyRange(size_t(y) * m_GridWidth + rect.minX,
+                  rect.maxX - rect.minX + 1);
+      }
+    }
+  }
+
+  for (uint32_t chunk : slot.pendingChunks) {
+    slot.pendingDirty[chunk] = DirtyRect{};
+  }
+  slot.pendingChunks.clear();
+  slot.pendingFull = false;
+
+  // done before this frame is submitted
+  if (spilled)
+    m_UploadTicket = m_Uploads->flush();
+
+  // No barrier ahead of the copy, the last draw that read these cells is
+  // behind the fence drawFrame waited on.
+  if (!m_UploadRegions.empty())
+    _commandBuffer.copyBuffer(*slot.staging, *slot.buffer, m_UploadRegions);
+
+  vk::MemoryBarrier after(vk::AccessFlagBits::eTransferWrite,
+                          vk::AccessFlagBits::eShaderRead);
+  _commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                 vk::PipelineStageFlagBits::eFragmentShader,
+                                 vk::DependencyFlags{}, after, nullptr,
+                                 nullptr);
 }
 
 void Renderer::drawFrame() {
+  PROFILE_ZONE("Renderer::drawFrame");
+
   // the * operator on vk::raii::<something> returns vk::<something> & (remember
   // it's a reference)
-  while (device.waitForFences(*inFlightFences[currentFrame], VK_TRUE,
-                              UINT32_MAX) == vk::Result::eTimeout)
-    ;
-
-  auto [result, imageIndex] = SwapchainNextImageWrapper(
-      swapchain, UINT64_MAX, *imageAvailableSemaphores[currentFrame],
-      VK_NULL_HANDLE);
+  {
+    PROFILE_ZONE("waitForFence");
+    while (device.waitForFences(*inFlightFences[currentFrame], VK_TRUE,
+                                UINT32_MAX) == vk::Result::eTimeout)
+      ;
+  }
+  collectTimestamps();
+
+  // headless, every frame in flight has its own offscreen image
+  uint32_t imageIndex = currentFrame;
+  vk::Result result = vk::Result::eSuccess;
+  if (!headless()) {
+    PROFILE_ZONE("acquire");
+    std::tie(result, imageIndex) = SwapchainNextImageWrapper(
+        swapchain, UINT64_MAX, *imageAvailableSemaphores[currentFrame],
+        VK_NULL_HANDLE);
+  }
 
   if (result == vk::Result::eErrorOutOfDateKHR) {
     recreateSwapchain();
@@ -97,6 +343,26 @@ void Renderer::drawFrame() {
   commandBuffers[currentFrame].reset();
   recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
 
+  if (m_UploadTicket) {
+    m_Uploads->wait(m_UploadTicket);
+    m_UploadTicket = 0;
+  }
+
+  m_SlotFrames[currentFrame] = ++m_FrameCount;
+#if ENGINE_PROFILER
+  if (*m_TimestampPool) {
+    m_SubmitTimes[currentFrame] = profiler::now();
+  }
+#endif
+  if (headless()) {
+    // nothing to wait on or present
+    graphicsQueue.submit(vk::SubmitInfo(nullptr, nullptr,
+                                        *commandBuffers[currentFrame], nullptr),
+                         *inFlightFences[currentFrame]);
+    currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+    return;
+  }
+
   vk::Semaphore waitSemaphores[] = {*imageAvailableSemaphores[currentFrame]};
   vk::Semaphore signalSemaphores[] = {*renderFinishedSemaphores[currentFrame]};
   vk::PipelineStageFlags waitStages[] = {
@@ -109,10 +375,15 @@ void Renderer::drawFrame() {
   vk::PresentInfoKHR presentInfo(signalSemaphores, swapchains, imageIndex);
 
   // throws Poco::NotFoundException, apparently a driver issue
-  result = QueuePresentWrapper(instance, presentQueue, presentInfo);
+  {
+    PROFILE_ZONE("present");
+    result = QueuePresentWrapper(instance, presentQueue, presentInfo);
+  }
   if (result == vk::Result::eErrorOutOfDateKHR ||
-      result == vk::Result::eSuboptimalKHR || framebufferResized) {
+      result == vk::Result::eSuboptimalKHR || framebufferResized ||
+      m_PresentModeChanged) {
     framebufferResized = false;
+    m_PresentModeChanged = false;
     recreateSwapchain();
   } else if (result != vk::Result::eSuccess) {
     throw std::runtime_error("[Queue]: Failed to present Graphics Queue!");
@@ -150,7 +421,7 @@ void Renderer::createInstance() {
       VK_MAKE_API_VERSION(0, 1, 0, 0), // applicationVersion
       "NoRenderer",                    // pRendererName
       VK_MAKE_API_VERSION(0, 1, 0, 0), // RendererVersion
-      VK_API_VERSION_1_0               // apiVersion
+      VK_API_VERSION_1_1               // apiVersion
   };
 
   std::vector<const char *> extensions = getRequiredInstanceExtensions();
@@ -222,6 +493,9 @@ void Renderer::createLogicalDevice() {
   // sets don't allow duplicates
   std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(),
                                             indices.presentFamily.value()};
+  if (indices.transferFamily) {
+    uniqueQueueFamilies.insert(*indices.transferFamily);
+  }
 
   float queuePriority = 1.0f;
   for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -236,6 +510,21 @@ void Renderer::createLogicalDevice() {
 
   vk::PhysicalDeviceFeatures deviceFeatures;
 
+  // optional, the allocator reads heap budgets through it. Those come out of
+  // vkGetPhysicalDeviceMemoryProperties2, which needs Vulkan 1.1.
+  std::vector<const char *> extensions = getRequiredDeviceExtensions();
+  bool memoryBudget = false;
+  if (physicalDevice.getProperties().apiVersion >= VK_API_VERSION_1_1) {
+    for (const auto &extension :
+         physicalDevice.enumerateDeviceExtensionProperties()) {
+      if (!strcmp(extension.extensionName,
+                  VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+        extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+        memoryBudget = true;
+      }
+    }
+  }
+
   vk::DeviceCreateInfo deviceCreateInfo{
       vk::DeviceCreateFlags{},                        // flags;
       static_cast<uint32_t>(queueCreateInfos.size()), // queueCreateInfoCount;
@@ -245,15 +534,27 @@ void Renderer::createLogicalDevice() {
       // enabledLayerCount;
       enableValidationLayers ? ValidationLayers.data()
                              : nullptr,               // ppEnabledLayerNames;
-      static_cast<uint32_t>(DeviceExtensions.size()), // enabledExtensionCount;
-      DeviceExtensions.data(), // ppEnabledExtensionNames;
+      static_cast<uint32_t>(extensions.size()), // enabledExtensionCount;
+      extensions.data(),                        // ppEnabledExtensionNames;
       &deviceFeatures          // pEnabledFeatures;
   };
 
   device = vk::raii::Device(physicalDevice, deviceCreateInfo);
+  m_Allocator =
+      std::make_unique<GpuAllocator>(physicalDevice, device, memoryBudget);
+  m_PipelineCache = std::make_unique<PipelineCache>(
+      physicalDevice, device,
+      utils::getExecutableDir() / "pipeline_cache.bin");
 
   graphicsQueue = device.getQueue(indices.graphicsFamily.value(), 0);
   presentQueue = device.getQueue(indices.presentFamily.value(), 0);
+
+  uint32_t transferFamily =
+      indices.transferFamily.value_or(indices.graphicsFamily.value());
+  transferQueue = device.getQueue(transferFamily, 0);
+  m_Uploads = std::make_unique<UploadContext>(device, *m_Allocator,
+                                              transferFamily, transferQueue,
+                                              indices.graphicsFamily.value());
 }
 
 void Renderer::createSurface() {
@@ -273,6 +574,7 @@ void Renderer::createSwapchain() {
       chooseSwapSurfaceFormat(swapchainSupport.formats);
   vk::PresentModeKHR presentMode =
       choostSwapPresentMode(swapchainSupport.presentModes);
+  m_SwapchainPresentMode = presentMode;
   vk::Extent2D extent = chooseSwapExtent(swapchainSupport.capabilities);
 
   // minImageCount may mean waiting on the drivers thus +1
@@ -343,6 +645,52 @@ void Renderer::createSwapchain() {
   }
 }
 
+void Renderer::createOffscreenImages() {
+  // sRGB like the swapchain, so a frame read back looks like it would on
+  // screen
+  swapchainImageFormat = vk::Format::eR8G8B8A8Srgb;
+
+  vk::ImageCreateInfo imageInfo{
+      vk::ImageCreateFlags{},                // flags
+      vk::ImageType::e2D,                    // imageType
+      swapchainImageFormat,                  // format
+      vk::Extent3D(swapchainImageExtent, 1), // extent
+      1,                                     // mipLevels
+      1,                                     // arrayLayers
+      vk::SampleCountFlagBits::e1,           // samples
+      vk::ImageTiling::eOptimal,             // tiling
+      vk::ImageUsageFlagBits::eColorAttachment |
+          vk::ImageUsageFlagBits::eTransferSrc, // usage
+      vk::SharingMode::eExclusive,              // sharingMode
+      0,                                        // queueFamilyIndexCount
+      nullptr,                                  // pQueueFamilyIndices
+      vk::ImageLayout::eUndefined               // initialLayout
+  };
+
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    vk::raii::Image image(device, imageInfo);
+    // optimal tiling, kept off the pages the allocator's buffers are on
+    GpuAllocation memory = m_Allocator->allocate(
+        image.getMemoryRequirements(), MemoryUsage::GpuOnly, false);
+    image.bindMemory(memory.memory(), memory.offset());
+
+    swapchainImages.push_back(*image);
+    m_OffscreenImages.push_back(std::move(image));
+    m_OffscreenMemory.push_back(std::move(memory));
+
+    vk::ImageViewCreateInfo viewInfo{
+        vk::ImageViewCreateFlags{}, // flags;
+        swapchainImages[i],         // image;
+        vk::ImageViewType::e2D,     // viewType;
+        swapchainImageFormat,       // format;
+        vk::ComponentMapping{},     // components;
+        vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0,
+                                  1) // subresourceRange
+    };
+    swapchainImageViews.emplace_back(device, viewInfo);
+  }
+}
+
 void Renderer::createRenderPass() {
   vk::AttachmentDescription colorAttachment{
       vk::AttachmentDescriptionFlags{}, // flags
@@ -353,7 +701,9 @@ void Renderer::createRenderPass() {
       vk::AttachmentLoadOp::eClear,     // stencilLoadOp
       vk::AttachmentStoreOp::eDontCare, // stencilStoreOp
       vk::ImageLayout::eUndefined,      // initialLayout
-      vk::ImageLayout::ePresentSrcKHR   // finalLayout
+      // headless frames are copied out instead of presented
+      headless() ? vk::ImageLayout::eTransferSrcOptimal
+                 : vk::ImageLayout::ePresentSrcKHR // finalLayout
   };
 
   vk::AttachmentReference colorAttachmentReference{
@@ -401,10 +751,10 @@ void Renderer::createDescriptorSetLayout() {
 
   vk::DescriptorSetLayoutBinding uboLayoutBinding(
       0, vk::DescriptorType::eUniformBuffer, 1,
-      vk::ShaderStageFlagBits::eVertex);
+      vk::ShaderStageFlagBits::eFragment);
   vk::DescriptorSetLayoutBinding ssboLayoutBinding(
       1, vk::DescriptorType::eStorageBuffer, 1,
-      vk::ShaderStageFlagBits::eVertex);
+      vk::ShaderStageFlagBits::eFragment);
 
   std::vector<vk::DescriptorSetLayoutBinding> layoutBindings = {
       uboLayoutBinding, ssboLayoutBinding};
@@ -416,9 +766,9 @@ void Renderer::createDescriptorSetLayout() {
 
 void Renderer::createGraphicsPipeline() {
   std::vector<char> vertexShaderCode =
-      readFile(utils::getExecutableDir() / "res/shaders/testv.spv");
+      readFile(utils::getExecutableDir() / "res/shaders/gridv.spv");
   std::vector<char> fragmentShaderCode =
-      readFile(utils::getExecutableDir() / "res/shaders/testf.spv");
+      readFile(utils::getExecutableDir() / "res/shaders/gridf.spv");
 
   vk::raii::ShaderModule vertShaderModule =
       createShaderModule(vertexShaderCode);
@@ -444,15 +794,13 @@ void Renderer::createGraphicsPipeline() {
   vk::PipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo,
                                                       fragShaderStageInfo};
 
-  auto bindingDescription = Vertex::getBindingDescription();
-  auto attributeDescription = Vertex::getAttributeDescription();
-
+  // the fullscreen triangle comes from gl_VertexIndex, no vertex buffers
   vk::PipelineVertexInputStateCreateInfo vertexInputInfo{
       vk::PipelineVertexInputStateCreateFlags{}, // flags;
-      1,                           // vertexBindingDescriptionCount;
-      &bindingDescription,         // pVertexBindingDescriptions;
-      attributeDescription.size(), // vertexAttributeDescriptionCount;
-      attributeDescription.data()  // pVertexAttributeDescriptions;
+      0,       // vertexBindingDescriptionCount;
+      nullptr, // pVertexBindingDescriptions;
+      0,       // vertexAttributeDescriptionCount;
+      nullptr  // pVertexAttributeDescriptions;
   };
 
   vk::PipelineInputAssemblyStateCreateInfo inputAssemblyInfo{
@@ -551,7 +899,8 @@ void Renderer::createGraphicsPipeline() {
       -1                         // basePipelineIndex
   };
 
-  graphicsPipeline = vk::raii::Pipeline(device, nullptr, pipelineInfo);
+  graphicsPipeline =
+      vk::raii::Pipeline(device, m_PipelineCache->cache(), pipelineInfo);
 }
 
 void Renderer::createFramebuffers() {
@@ -590,162 +939,108 @@ void Renderer::createCommandPool() {
 
 [[nodiscard]] auto
 Renderer::createBuffer(vk::DeviceSize _size, vk::BufferUsageFlags _usage,
-                       vk::MemoryPropertyFlags _propertyFlags)
-    -> std::pair<vk::raii::Buffer, vk::raii::DeviceMemory> {
-  vk::BufferCreateInfo bufferInfo{
-      vk::BufferCreateFlags{},     // flags_
-      _size,                       // size_
-      _usage,                      // usage_
-      vk::SharingMode::eExclusive, // sharingMode_
-      0,                           // queueFamilyIndexCount_
-      nullptr,                     // pQueueFamilyIndices_
-      nullptr,                     // pNext_
-  };
-
-  auto buffer = vk::raii::Buffer(device, bufferInfo);
-
-  vk::MemoryRequirements memRequirements = buffer.getMemoryRequirements();
-  vk::PhysicalDeviceMemoryProperties memProperties =
-      physicalDevice.getMemoryProperties();
-
-  uint32_t memoryTypeIndex = 0;
-  for (uint32_t i = 0; i < memProperties.memoryTypeCount; ++i) {
-    if ((memRequirements.memoryTypeBits & (1 << i)) &&
-        (memProperties.memoryTypes[i].propertyFlags & _propertyFlags)) {
-      memoryTypeIndex = i;
-    }
+                       MemoryUsage _memoryUsage, bool _shared)
+    -> std::pair<vk::raii::Buffer, GpuAllocation> {
+  if (_shared) {
+    return m_Allocator->createBuffer(_size, _usage, _memoryUsage,
+                                     m_Uploads->queueFamilies());
   }
-
-  vk::MemoryAllocateInfo allocInfo{memRequirements.size, memoryTypeIndex,
-                                   nullptr};
-
-  auto bufferMemory = vk::raii::DeviceMemory(device, allocInfo);
-  buffer.bindMemory(*bufferMemory, 0);
-
-  return std::make_pair(std::move(buffer), std::move(bufferMemory));
-}
-
-void Renderer::copyBuffer(vk::raii::Buffer &_src, vk::raii::Buffer &_dst,
-                          vk::DeviceSize _size) {
-  vk::CommandBufferAllocateInfo allocInfo(*commandPool,
-                                          vk::CommandBufferLevel::ePrimary, 1);
-  vk::raii::CommandBuffer copyCommandBuffer =
-      std::move(vk::raii::CommandBuffers(device, allocInfo).front());
-
-  copyCommandBuffer.begin(vk::CommandBufferBeginInfo{
-      vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
-  copyCommandBuffer.copyBuffer(
-      *_src, *_dst, std::array<vk::BufferCopy, 1>{vk::BufferCopy(0, 0, _size)});
-  copyCommandBuffer.end();
-
-  graphicsQueue.submit(std::array<vk::SubmitInfo, 1>{
-      vk::SubmitInfo(nullptr, nullptr, *copyCommandBuffer, nullptr)});
-  graphicsQueue.waitIdle();
-
-  copyCommandBuffer.clear();
-}
-
-void Renderer::createVertexBuffer() {
-  vk::DeviceSize bufferSize = sizeof(Vertex) * vertices.size();
-
-  vk::raii::Buffer stagingBuffer(nullptr);
-  vk::raii::DeviceMemory stagingBufferMemory(nullptr);
-  std::tie(stagingBuffer, stagingBufferMemory) =
-      createBuffer(bufferSize, vk::BufferUsageFlagBits::eTransferSrc,
-                   vk::MemoryPropertyFlagBits::eHostVisible |
-                       vk::MemoryPropertyFlagBits::eHostCoherent);
-
-  void *data = stagingBufferMemory.mapMemory(0, bufferSize);
-  memcpy(data, vertices.data(), (size_t)bufferSize);
-
-  std::tie(vertexBuffer, vertexBufferMemory) =
-      createBuffer(bufferSize,
-                   vk::BufferUsageFlagBits::eVertexBuffer |
-                       vk::BufferUsageFlagBits::eTransferDst,
-                   vk::MemoryPropertyFlagBits::eDeviceLocal);
-
-  copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-}
-
-void Renderer::createIndexBuffer() {
-  vk::DeviceSize bufferSize = sizeof(uint16_t) * indices.size();
-
-  vk::raii::Buffer stagingBuffer(nullptr);
-  vk::raii::DeviceMemory stagingBufferMemory(nullptr);
-  std::tie(stagingBuffer, stagingBufferMemory) =
-      createBuffer(bufferSize, vk::BufferUsageFlagBits::eTransferSrc,
-                   vk::MemoryPropertyFlagBits::eHostVisible |
-                       vk::MemoryPropertyFlagBits::eHostCoherent);
-
-  void *data = stagingBufferMemory.mapMemory(0, bufferSize);
-  memcpy(data, indices.data(), (size_t)bufferSize);
-
-  std::tie(indexBuffer, indexBufferMemory) =
-      createBuffer(bufferSize,
-                   vk::BufferUsageFlagBits::eIndexBuffer |
-                       vk::BufferUsageFlagBits::eTransferDst,
-                   vk::MemoryPropertyFlagBits::eDeviceLocal);
-
-  copyBuffer(stagingBuffer, indexBuffer, bufferSize);
+  return m_Allocator->createBuffer(_size, _usage, _memoryUsage);
 }
 
 void Renderer::createUniformBuffers() {
   vk::DeviceSize bufferSize = sizeof(UniformBufferObject);
 
-  std::tie(uniformBuffer, uniformBuffersMemory) =
-      createBuffer(bufferSize, vk::BufferUsageFlagBits::eUniformBuffer,
-                   vk::MemoryPropertyFlagBits::eHostVisible |
-                       vk::MemoryPropertyFlagBits::eHostCoherent);
+  // bytes that aren't a material stay black
+  ubo.palette.fill(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+  for (size_t i = 0; i < ELEMENT_TYPE_COUNT; ++i) {
+    ubo.palette[i] = glm::vec4(MATERIAL_COLORS[i] / 255.0f, 1.0f);
+  }
 
-  void *uniformBufferMapped = uniformBuffersMemory.mapMemory(0, bufferSize);
-  memcpy(uniformBufferMapped, &ubo, bufferSize);
+  // written once, so it goes in VRAM through the upload queue
+  std::tie(uniformBuffer, uniformBufferMemory) =
+      createBuffer(bufferSize,
+                   vk::BufferUsageFlagBits::eUniformBuffer |
+                       vk::BufferUsageFlagBits::eTransferDst,
+                   MemoryUsage::GpuOnly, true);
+  m_Uploads->upload(*uniformBuffer, 0, &ubo, bufferSize);
 }
 
 void Renderer::createStorageBuffer() {
-  vk::DeviceSize bufferSize = sizeof(tGrid);
+  // the shaders read whole words, the staging copies only hold the cells
+  vk::DeviceSize bufferSize = packedCellBytes(m_CellCount);
+  vk::DeviceSize stagingSize =
+      std::min<vk::DeviceSize>(sizeof(Cell) * m_CellCount, CELL_STAGING_BYTES);
 
-  std::tie(storageBuffer, storageBufferMemory) =
-      createBuffer(bufferSize, vk::BufferUsageFlagBits::eStorageBuffer,
-                   vk::MemoryPropertyFlagBits::eHostVisible |
-                       vk::MemoryPropertyFlagBits::eHostCoherent);
+  if (bufferSize > physicalDevice.getProperties().limits.maxStorageBufferRange) {
+    throw std::runtime_error(
+        "[VK_Buffer]: World is too large for a single storage buffer!");
+  }
 
-  storageBufferWriteLoc = storageBufferMemory.mapMemory(0, bufferSize);
+  const uint32_t chunksX = (m_GridWidth + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  const uint32_t chunksY = (m_GridHeight + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+  m_CellSlots.resize(MAX_FRAMES_IN_FLIGHT);
+  for (CellSlot &slot : m_CellSlots) {
+    std::tie(slot.buffer, slot.memory) =
+        createBuffer(bufferSize,
+                     vk::BufferUsageFlagBits::eStorageBuffer |
+                         vk::BufferUsageFlagBits::eTransferDst,
+                     MemoryUsage::GpuOnly, true);
+    // rewritten every frame, ReBAR if there is any
+    std::tie(slot.staging, slot.stagingMemory) = createBuffer(
+        stagingSize, vk::BufferUsageFlagBits::eTransferSrc, MemoryUsage::Stream);
+    slot.stagingMapped = slot.stagingMemory.mapped();
+    slot.stagingSize = stagingSize;
+    slot.pendingDirty.assign(size_t(chunksX) * chunksY, DirtyRect{});
+  }
 
-  memcpy(storageBufferWriteLoc, m_WorldMatrix, bufferSize);
+  // no frame yet, start out as all air
+  for (CellSlot &slot : m_CellSlots) {
+    m_Uploads->fill(*slot.buffer, 0, VK_WHOLE_SIZE, 0);
+  }
 }
 
 void Renderer::createDescriptorPool() {
   auto poolSizes = std::vector<vk::DescriptorPoolSize>{
-      vk::DescriptorPoolSize(vk::DescriptorType::eUniformBuffer, 1),
-      vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, 1),
+      vk::DescriptorPoolSize(vk::DescriptorType::eUniformBuffer,
+                             MAX_FRAMES_IN_FLIGHT),
+      vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer,
+                             MAX_FRAMES_IN_FLIGHT),
   };
 
   vk::DescriptorPoolCreateInfo poolInfo(
-      vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet, 1, poolSizes);
+      vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+      MAX_FRAMES_IN_FLIGHT, poolSizes);
   descriptorPool = vk::raii::DescriptorPool(device, poolInfo);
 }
 
 void Renderer::createDescriptorSet() {
-  auto allocInfo =
-      vk::DescriptorSetAllocateInfo(*descriptorPool, *descriptorSetLayout);
-
+  std::vector<vk::DescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT,
+                                               *descriptorSetLayout);
+  auto allocInfo = vk::DescriptorSetAllocateInfo(*descriptorPool, layouts);
   vk::raii::DescriptorSets descriptorSets(device, allocInfo);
-  descriptorSet = vk::raii::DescriptorSet(std::move(descriptorSets.front()));
 
   vk::DescriptorBufferInfo uniformBufferInfo(*uniformBuffer, 0,
                                              sizeof(UniformBufferObject));
-  vk::DescriptorBufferInfo storageBufferInfo(*storageBuffer, 0,
-                                             sizeof(tGrid));
-
-  vk::WriteDescriptorSet descriptorWrite(
-      *descriptorSet, 0, 0, vk::DescriptorType::eUniformBuffer, nullptr,
-      uniformBufferInfo, nullptr, nullptr);
-  device.updateDescriptorSets(descriptorWrite, nullptr);
-
-  descriptorWrite = vk::WriteDescriptorSet(
-      *descriptorSet, 1, 0, vk::DescriptorType::eStorageBuffer, nullptr,
-      storageBufferInfo, nullptr, nullptr);
-  device.updateDescriptorSets(descriptorWrite, nullptr);
+
+  for (size_t i = 0; i < m_CellSlots.size(); ++i) {
+    CellSlot &slot = m_CellSlots[i];
+    slot.descriptorSet = vk::raii::DescriptorSet(std::move(descriptorSets[i]));
+
+    vk::DescriptorBufferInfo storageBufferInfo(*slot.buffer, 0,
+                                               packedCellBytes(m_CellCount));
+
+    vk::WriteDescriptorSet descriptorWrite(
+        *slot.descriptorSet, 0, 0, vk::DescriptorType::eUniformBuffer, nullptr,
+        uniformBufferInfo, nullptr, nullptr);
+    device.updateDescriptorSets(descriptorWrite, nullptr);
+
+    descriptorWrite = vk::WriteDescriptorSet(
+        *slot.descriptorSet, 1, 0, vk::DescriptorType::eStorageBuffer, nullptr,
+        storageBufferInfo, nullptr, nullptr);
+    device.updateDescriptorSets(descriptorWrite, nullptr);
+  }
 }
 
 void Renderer::createCommandBuffers() {
@@ -776,6 +1071,57 @@ void Renderer::createSyncObjects() {
     renderFinishedSemaphores.emplace_back(device, semaphoreCreateInfo);
     inFlightFences.emplace_back(device, fenceCreateInfo);
   }
+  m_SlotFrames.assign(MAX_FRAMES_IN_FLIGHT, 0);
+}
+
+void Renderer::createTimestampPool() {
+#if ENGINE_PROFILER
+  uint32_t graphicsFamily =
+      queryQueueFamilyIndices(physicalDevice).graphicsFamily.value();
+  if (physicalDevice.getQueueFamilyProperties()[graphicsFamily]
+          .timestampValidBits == 0)
+    return;
+
+  m_TimestampPeriod = physicalDevice.getProperties().limits.timestampPeriod;
+  m_TimestampPool = vk::raii::QueryPool(
+      device, vk::QueryPoolCreateInfo(vk::QueryPoolCreateFlags{},
+                                      vk::QueryType::eTimestamp,
+                                      TIMESTAMPS_PER_FRAME *
+                                          MAX_FRAMES_IN_FLIGHT));
+  m_SubmitTimes.assign(MAX_FRAMES_IN_FLIGHT, 0);
+#endif
+}
+
+void Renderer::collectTimestamps() {
+#if ENGINE_PROFILER
+  if (!*m_TimestampPool || !m_SubmitTimes[currentFrame])
+    return;
+  uint64_t submitted = m_SubmitTimes[currentFrame];
+  m_SubmitTimes[currentFrame] = 0;
+
+  // the slot's fence signalled, they're there
+  auto [result, timestamps] = m_TimestampPool.getResults<uint64_t>(
+      currentFrame * TIMESTAMPS_PER_FRAME, TIMESTAMPS_PER_FRAME,
+      TIMESTAMPS_PER_FRAME * sizeof(uint64_t), sizeof(uint64_t),
+      vk::QueryResultFlagBits::e64);
+  if (result != vk::Result::eSuccess)
+    return;
+
+  double ns[TIMESTAMPS_PER_FRAME];
+  for (uint32_t i = 0; i < TIMESTAMPS_PER_FRAME; ++i) {
+    ns[i] = timestamps[i] * m_TimestampPeriod;
+  }
+
+  // The GPU's clock has nothing to do with ours. A frame can't start
+  // before it was submitted, so the offset is the smallest one that keeps
+  // every frame so far behind its submit.
+  m_GpuClockOffset = std::max(m_GpuClockOffset, submitted - ns[0]);
+  profiler::recordGpu(m_GpuSim ? "gpu sim" : "cell upload",
+                      uint64_t(ns[0] + m_GpuClockOffset),
+                      uint64_t(ns[1] + m_GpuClockOffset));
+  profiler::recordGpu("render pass", uint64_t(ns[2] + m_GpuClockOffset),
+                      uint64_t(ns[3] + m_GpuClockOffset));
+#endif
 }
 
 void Renderer::recordCommandBuffer(vk::raii::CommandBuffer &_commandBuffer,
@@ -796,14 +1142,37 @@ void Renderer::recordCommandBuffer(vk::raii::CommandBuffer &_commandBuffer,
       &clearValue // pClearValues
   };
 
+#if ENGINE_PROFILER
+  const uint32_t firstQuery = currentFrame * TIMESTAMPS_PER_FRAME;
+  if (*m_TimestampPool) {
+    _commandBuffer.resetQueryPool(*m_TimestampPool, firstQuery,
+                                  TIMESTAMPS_PER_FRAME);
+    _commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe,
+                                  *m_TimestampPool, firstQuery);
+  }
+#endif
+
+  // neither compute nor copies can run inside a render pass
+  if (m_GpuSim) {
+    m_GpuSim->recordStep(_commandBuffer, m_GpuTicks);
+  } else {
+    updateCells(_commandBuffer);
+  }
+
+#if ENGINE_PROFILER
+  if (*m_TimestampPool) {
+    _commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe,
+                                  *m_TimestampPool, firstQuery + 1);
+    _commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe,
+                                  *m_TimestampPool, firstQuery + 2);
+  }
+#endif
+
   _commandBuffer.beginRenderPass(renderPassBeginInfo,
                                  vk::SubpassContents::eInline);
   _commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics,
                               *graphicsPipeline);
 
-  _commandBuffer.bindVertexBuffers(0, *vertexBuffer, {0});
-  _commandBuffer.bindIndexBuffer(*indexBuffer, 0, vk::IndexType::eUint16);
-
   vk::Viewport viewport{
       0.0f,                                            // x
       0.0f,                                            // y
@@ -821,19 +1190,71 @@ void Renderer::recordCommandBuffer(vk::raii::CommandBuffer &_commandBuffer,
   _commandBuffer.setScissor(0, scissor);
 
   _commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
-                                    *pipelineLayout, 0, *descriptorSet,
+                                    *pipelineLayout, 0,
+                                    *m_CellSlots[currentFrame].descriptorSet,
                                     nullptr);
 
-  updateCells();
-
-  _commandBuffer.drawIndexed(indices.size(), ubo.grid_size.x * ubo.grid_size.y,
-                             0, 0, 0);
+  // every pixel looks its cell up, the cost doesn't grow with the grid
+  _commandBuffer.draw(3, 1, 0, 0);
 
   _commandBuffer.endRenderPass();
 
+#if ENGINE_PROFILER
+  if (*m_TimestampPool) {
+    _commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe,
+                                  *m_TimestampPool, firstQuery + 3);
+  }
+#endif
+
+  if (headless()) {
+    recordReadback(_commandBuffer, _imageIndex);
+  }
+
   _commandBuffer.end();
 }
 
+void Renderer::recordReadback(vk::raii::CommandBuffer &_commandBuffer,
+                              uint32_t _imageIndex) {
+  // the oldest request not taken by a frame yet
+  auto readback = std::find_if(
+      m_Readbacks.begin(), m_Readbacks.end(),
+      [](const FrameReadback &candidate) { return candidate.frame == 0; });
+  if (readback == m_Readbacks.end())
+    return;
+  readback->slot = currentFrame;
+  // drawFrame bumps m_FrameCount right after recording
+  readback->frame = m_FrameCount + 1;
+
+  // the render pass leaves the image as a transfer source
+  vk::ImageMemoryBarrier rendered(
+      vk::AccessFlagBits::eColorAttachmentWrite,
+      vk::AccessFlagBits::eTransferRead, vk::ImageLayout::eTransferSrcOptimal,
+      vk::ImageLayout::eTransferSrcOptimal, VK_QUEUE_FAMILY_IGNORED,
+      VK_QUEUE_FAMILY_IGNORED, swapchainImages[_imageIndex],
+      vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1));
+  _commandBuffer.pipelineBarrier(
+      vk::PipelineStageFlagBits::eColorAttachmentOutput,
+      vk::PipelineStageFlagBits::eTransfer, vk::DependencyFlags{}, nullptr,
+      nullptr, rendered);
+
+  // row 0 of a Vulkan image is its top, so this comes out top row first
+  vk::BufferImageCopy region(
+      0, 0, 0,
+      vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1),
+      vk::Offset3D{0, 0, 0},
+      vk::Extent3D(swapchainImageExtent.width, swapchainImageExtent.height, 1));
+  _commandBuffer.copyImageToBuffer(swapchainImages[_imageIndex],
+                                   vk::ImageLayout::eTransferSrcOptimal,
+                                   *readback->buffer, region);
+
+  vk::MemoryBarrier copied(vk::AccessFlagBits::eTransferWrite,
+                           vk::AccessFlagBits::eHostRead);
+  _commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                 vk::PipelineStageFlagBits::eHost,
+                                 vk::DependencyFlags{}, copied, nullptr,
+                                 nullptr);
+}
+
 int Renderer::rateDeviceSuitability(const vk::raii::PhysicalDevice _device) {
   // if all required queue families aren't found, don't use the device
   if (!queryQueueFamilyIndices(_device).isComplete()) {
@@ -843,11 +1264,13 @@ int Renderer::rateDeviceSuitability(const vk::raii::PhysicalDevice _device) {
     return -2;
   }
 
-  SwapchainSupportDetails SwapchainDetails = querySwapchainSupport(_device);
-  bool swapchainAdequate = !SwapchainDetails.formats.empty() ||
-                           !SwapchainDetails.presentModes.empty();
-  if (!swapchainAdequate) {
-    return -3;
+  if (!headless()) {
+    SwapchainSupportDetails SwapchainDetails = querySwapchainSupport(_device);
+    bool swapchainAdequate = !SwapchainDetails.formats.empty() ||
+                             !SwapchainDetails.presentModes.empty();
+    if (!swapchainAdequate) {
+      return -3;
+    }
   }
 
   int score = 1;
@@ -878,12 +1301,20 @@ Renderer::queryQueueFamilyIndices(vk::raii::PhysicalDevice _device) {
   queueFamilyProperties = _device.getQueueFamilyProperties();
 
   for (uint32_t i = 0; i < queueFamilyProperties.size(); ++i) {
-    if (queueFamilyProperties.at(i).queueFlags & vk::QueueFlagBits::eGraphics) {
+    // graphics queues usually do compute too, the GPU sim relies on that
+    vk::QueueFlags queueFlags = queueFamilyProperties.at(i).queueFlags;
+    if ((queueFlags & vk::QueueFlagBits::eGraphics) &&
+        (queueFlags & vk::QueueFlagBits::eCompute)) {
       indices.graphicsFamily = i;
     }
 
+    // headless nothing is presented, the graphics queue stands in
     vk::Bool32 presentSupport = false;
-    presentSupport = _device.getSurfaceSupportKHR(i, *surface);
+    if (headless()) {
+      presentSupport = indices.graphicsFamily == i;
+    } else {
+      presentSupport = _device.getSurfaceSupportKHR(i, *surface);
+    }
     if (presentSupport) {
       indices.presentFamily = i;
     }
@@ -892,6 +1323,7 @@ Renderer::queryQueueFamilyIndices(vk::raii::PhysicalDevice _device) {
       break;
     }
   }
+  indices.transferFamily = UploadContext::findTransferFamily(_device);
 
   return indices;
 }
@@ -917,8 +1349,9 @@ bool Renderer::checkDeviceExtensionSupport(vk::raii::PhysicalDevice _device) {
 
   // Make a set of all required extensions and remove them from the set if
   // they're found. If all required extensions are found, the set is empty.
-  std::set<std::string> requiredExtensions(DeviceExtensions.begin(),
-                                           DeviceExtensions.end());
+  std::vector<const char *> deviceExtensions = getRequiredDeviceExtensions();
+  std::set<std::string> requiredExtensions(deviceExtensions.begin(),
+                                           deviceExtensions.end());
   for (const auto &extension : availableExtensions) {
     requiredExtensions.erase(extension.extensionName);
   }
@@ -941,14 +1374,35 @@ vk::SurfaceFormatKHR Renderer::chooseSwapSurfaceFormat(
   return _surfaceFormats[0];
 }
 
+void Renderer::setPresentMode(PresentMode mode) {
+  if (mode == m_PresentMode)
+    return;
+  m_PresentMode = mode;
+  // headless has no swapchain to recreate
+  m_PresentModeChanged = !headless();
+}
+
 // Returns the way in which the Swapchain present images to the screen (Vsync,
-// Triple Buffering etc.)
+// Triple Buffering etc.), by order of preference for m_PresentMode
 vk::PresentModeKHR
 Renderer::choostSwapPresentMode(std::vector<vk::PresentModeKHR> _presentModes) {
-  for (const vk::PresentModeKHR &presentMode : _presentModes) {
-    if (presentMode == vk::PresentModeKHR::eMailbox) {
-      // if Triple Buffering is supported, use it.
-      return presentMode;
+  std::vector<vk::PresentModeKHR> preferred;
+  switch (m_PresentMode) {
+  case PresentMode::LowLatency:
+    // Triple Buffering never tears, immediate does but doesn't queue
+    preferred = {vk::PresentModeKHR::eMailbox, vk::PresentModeKHR::eImmediate};
+    break;
+  case PresentMode::Uncapped:
+    preferred = {vk::PresentModeKHR::eImmediate, vk::PresentModeKHR::eMailbox};
+    break;
+  case PresentMode::PowerSaving:
+    break;
+  }
+
+  for (vk::PresentModeKHR mode : preferred) {
+    if (std::find(_presentModes.begin(), _presentModes.end(), mode) !=
+        _presentModes.end()) {
+      return mode;
     }
   }
 
@@ -980,10 +1434,12 @@ Renderer::chooseSwapExtent(const vk::SurfaceCapabilitiesKHR _capabilities) {
 // Check if Instance Extensions required by the application are supported by the
 // Vulkan Implementation and return them.
 std::vector<const char *> Renderer::getRequiredInstanceExtensions() {
-  // Gathering extensions required by GLFW
+  // Gathering extensions required by GLFW, none headless
   uint32_t glfwExtensionCount = 0;
-  const char **glfwExtensions;
-  glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+  const char **glfwExtensions = nullptr;
+  if (!headless()) {
+    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+  }
 
   // Lambda to check if the required instance extension is supported by the
   // Vulkan implementation.
@@ -1035,6 +1491,12 @@ std::vector<const char *> Renderer::getRequiredInstanceExtensions() {
   return extensions;
 }
 
+std::vector<const char *> Renderer::getRequiredDeviceExtensions() {
+  if (headless())
+    return {};
+  return DeviceExtensions;
+}
+
 bool Renderer::checkValidationLayerSupport() {
   std::vector<vk::LayerProperties> availableLayers;
   availableLayers = vk::enumerateInstanceLayerProperties();
@@ -0,0 +1,240 @@
+#include <uploadContext.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <tuple>
+
+namespace {
+
+// keeps copies out of the ring on the device's preferred copy alignment
+const vk::DeviceSize STAGING_ALIGNMENT = 16;
+
+vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+} // namespace
+
+std::optional<uint32_t> UploadContext::findTransferFamily(
+    const vk::raii::PhysicalDevice &physicalDevice) {
+  std::vector<vk::QueueFamilyProperties> families =
+      physicalDevice.getQueueFamilyProperties();
+
+  std::optional<uint32_t> found;
+  for (uint32_t i = 0; i < families.size(); ++i) {
+    vk::QueueFlags flags = families[i].queueFlags;
+    if (!(flags & vk::QueueFlagBits::eTransfer) ||
+        (flags & vk::QueueFlagBits::eGraphics)) {
+      continue;
+    }
+    if (!(flags & vk::QueueFlagBits::eCompute))
+      return i;
+    if (!found)
+      found = i;
+  }
+  return found;
+}
+
+UploadContext::UploadContext(const vk::raii::Device &device,
+                             GpuAllocator &allocator, uint32_t queueFamily,
+                             const vk::raii::Queue &queue,
+                             uint32_t graphicsFamily, vk::DeviceSize ringSize)
+    : m_Device(device), m_Queue(queue), m_Allocator(allocator),
+      m_RingSize(ringSize) {
+  m_QueueFamilies.push_back(queueFamily);
+  if (graphicsFamily != queueFamily) {
+    m_QueueFamilies.push_back(graphicsFamily);
+  }
+
+  m_CommandPool = vk::raii::CommandPool(
+      m_Device,
+      vk::CommandPoolCreateInfo(
+          vk::CommandPoolCreateFlagBits::eTransient |
+              vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+          queueFamily));
+
+  std::tie(m_Ring, m_RingMemory) = m_Allocator.createBuffer(
+      m_RingSize, vk::BufferUsageFlagBits::eTransferSrc, MemoryUsage::Upload);
+}
+
+UploadContext::~UploadContext() {
+  for (Batch &batch : m_Batches) {
+    while (m_Device.waitForFences(*batch.fence, VK_TRUE, UINT64_MAX) ==
+           vk::Result::eTimeout)
+      ;
+  }
+}
+
+void UploadContext::upload(vk::Buffer dst, vk::DeviceSize offset,
+                           const void *data, vk::DeviceSize size) {
+  if (size == 0)
+    return;
+
+  vk::DeviceSize ringOffset = 0;
+  if (reserve(size, ringOffset)) {
+    memcpy(static_cast<uint8_t *>(m_RingMemory.mapped()) + ringOffset, data,
+           size);
+    m_Ops.push_back({*m_Ring, dst, vk::BufferCopy(ringOffset, offset, size)});
+    return;
+  }
+
+  // more than the whole ring, it gets a staging buffer of its own
+  auto staging = m_Allocator.createBuffer(
+      size, vk::BufferUsageFlagBits::eTransferSrc, MemoryUsage::Upload);
+  memcpy(staging.second.mapped(), data, size);
+  m_Ops.push_back({*staging.first, dst, vk::BufferCopy(0, offset, size)});
+  m_Staging.push_back(std::move(staging));
+}
+
+void UploadContext::fill(vk::Buffer dst, vk::DeviceSize offset,
+                         vk::DeviceSize size, uint32_t value) {
+  m_Ops.push_back({nullptr, dst, vk::BufferCopy(0, offset, size), value});
+}
+
+bool UploadContext::reserve(vk::DeviceSize size, vk::DeviceSize &offset) {
+  if (size > m_RingSize)
+    return false;
+
+  while (true) {
+    if (m_RingUsed == 0) {
+      m_RingHead = 0;
+      m_RingTail = 0;
+    }
+
+    vk::DeviceSize start = alignUp(m_RingHead, STAGING_ALIGNMENT);
+    vk::DeviceSize taken = 0;
+    bool full = m_RingUsed > 0 && m_RingHead == m_RingTail;
+    if (!full && m_RingHead >= m_RingTail) {
+      if (start + size <= m_RingSize) {
+        taken = start + size - m_RingHead;
+      } else if (size <= m_RingTail) {
+        // wraps, the end of the ring goes unused until the tail passes it
+        start = 0;
+        taken = m_RingSize - m_RingHead + size;
+      }
+    } else if (!full && start + size <= m_RingTail) {
+      taken = start + size - m_RingHead;
+    }
+
+    if (taken) {
+      offset = start;
+      m_RingHead = (start + size) % m_RingSize;
+      m_RingUsed += taken;
+      m_OpsRingBytes += taken;
+      return true;
+    }
+
+    // Full, what's queued is sent off and the oldest batch waited for. An
+    // empty ring always fits size, so this ends.
+    flush();
+    if (!m_Batches.empty()) {
+      wait(m_Batches.front().ticket);
+    }
+  }
+}
+
+uint64_t UploadContext::flush() {
+  retire();
+  if (m_Ops.empty())
+    return m_NextTicket - 1;
+
+  Batch batch;
+  batch.ticket = m_NextTicket++;
+  if (!m_Recycled.empty()) {
+    batch.commandBuffer = std::move(m_Recycled.back().commandBuffer);
+    batch.fence = std::move(m_Recycled.back().fence);
+    m_Recycled.pop_back();
+  } else {
+    batch.commandBuffer = std::move(
+        vk::raii::CommandBuffers(
+            m_Device, vk::CommandBufferAllocateInfo(
+                          *m_CommandPool, vk::CommandBufferLevel::ePrimary, 1))
+            .front());
+    batch.fence = vk::raii::Fence(m_Device, vk::FenceCreateInfo{});
+  }
+  batch.ringBytes = m_OpsRingBytes;
+  batch.ringEnd = m_RingHead;
+  batch.staging = std::move(m_Staging);
+
+  batch.commandBuffer.begin(vk::CommandBufferBeginInfo{
+      vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+  record(batch.commandBuffer);
+  batch.commandBuffer.end();
+
+  m_Queue.submit(vk::SubmitInfo(nullptr, nullptr, *batch.commandBuffer,
+                                nullptr),
+                 *batch.fence);
+
+  m_Ops.clear();
+  m_Staging.clear();
+  m_OpsRingBytes = 0;
+  m_Batches.push_back(std::move(batch));
+  return m_Batches.back().ticket;
+}
+
+void UploadContext::record(const vk::raii::CommandBuffer &commandBuffer) {
+  std::vector<vk::BufferCopy> regions;
+  for (size_t i = 0; i < m_Ops.size(); ++i) {
+    const Op &op = m_Ops[i];
+
+    // copies and fills run in any order inside one command, so a switch
+    // between them waits for what came before
+    if (i > 0 && bool(op.src) != bool(m_Ops[i - 1].src)) {
+      vk::MemoryBarrier barrier(vk::AccessFlagBits::eTransferWrite,
+                                vk::AccessFlagBits::eTransferWrite);
+      commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                    vk::PipelineStageFlagBits::eTransfer,
+                                    vk::DependencyFlags{}, barrier, nullptr,
+                                    nullptr);
+    }
+
+    if (!op.src) {
+      commandBuffer.fillBuffer(op.dst, op.region.dstOffset, op.region.size,
+                               op.value);
+      continue;
+    }
+
+    // copies between the same two buffers go in one command
+    regions.push_back(op.region);
+    bool last = i + 1 == m_Ops.size() || m_Ops[i + 1].src != op.src ||
+                m_Ops[i + 1].dst != op.dst;
+    if (last) {
+      commandBuffer.copyBuffer(op.src, op.dst, regions);
+      regions.clear();
+    }
+  }
+}
+
+bool UploadContext::isComplete(uint64_t ticket) {
+  retire();
+  return ticket <= m_CompletedTicket;
+}
+
+void UploadContext::wait(uint64_t ticket) {
+  for (Batch &batch : m_Batches) {
+    if (batch.ticket > ticket)
+      break;
+    while (m_Device.waitForFences(*batch.fence, VK_TRUE, UINT64_MAX) ==
+           vk::Result::eTimeout)
+      ;
+  }
+  retire();
+}
+
+void UploadContext::retire() {
+  while (!m_Batches.empty() &&
+         m_Batches.front().fence.getStatus() == vk::Result::eSuccess) {
+    Batch &batch = m_Batches.front();
+    m_RingTail = batch.ringEnd;
+    m_RingUsed -= batch.ringBytes;
+    m_CompletedTicket = batch.ticket;
+    if (m_Recycled.size() < MAX_RECYCLED) {
+      m_Device.resetFences(*batch.fence);
+      batch.commandBuffer.reset();
+      m_Recycled.push_back(
+          {std::move(batch.commandBuffer), std::move(batch.fence)});
+    }
+    m_Batches.pop_front();
+  }
+}
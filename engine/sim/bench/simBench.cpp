@@ -0,0 +1,497 @@
+// Headless benchmark for Sim::step.
+//
+// Runs the sim against a handful of preset scenarios and prints one JSON
+// object per scenario on stdout, e.g.
+//   {"scenario":"sand_column","cells":65536,"steps":500,"ns_per_cell":1.9,...}
+// The checksum field hashes the final world so behaviour changes show up too.
+//
+// usage: sim_bench [--steps N] [--warmup N] [--threads N] [--size WxH]
+//                  [--seed N] [--slice-us N] [--engine cells|bitboard]
+//                  [--kernel scalar|avx2|neon] [--cross-check]
+//                  [--scenario NAME] [--snapshot PATH]
+//                  [--replay JOURNAL [--load SNAPSHOT]]
+//
+// --engine bitboard runs BitboardSim on the scenarios it can load, with
+// --cross-check every step is compared against its scalar kernel.
+// --snapshot saves every finished world to PATH, restores it into a new Sim
+// and checks both carry on the same, with the save and load times.
+// --replay steps a journal recorded with application --record instead of the
+// scenarios, as fast as it goes. Journals that don't start at tick 0 need the
+// snapshot they started from.
+
+#include <bitboardSim.hpp>
+#include <config.hpp>
+#include <journal.hpp>
+#include <sim.hpp>
+#include <snapshot.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+struct Scenario {
+  const char *name;
+  void (*setup)(Sim &sim);
+};
+
+void setupEmpty(Sim &) {}
+
+// a solid block of sand a quarter of the grid wide, floor to ceiling
+void setupSandColumn(Sim &sim) {
+  for (uint32_t y = 0; y < sim.height(); ++y) {
+    for (uint32_t x = sim.width() * 3 / 8; x < sim.width() * 5 / 8; ++x) {
+      sim.set(x, y, ElementType::Sand);
+    }
+  }
+}
+
+// a wall of water held against the left edge, released on the first step
+void setupDamBreak(Sim &sim) {
+  for (uint32_t y = 0; y < sim.height() * 3 / 4; ++y) {
+    for (uint32_t x = 0; x < sim.width() / 3; ++x) {
+      sim.set(x, y, ElementType::Water);
+    }
+  }
+}
+
+// half the cells filled at random with an even split of sand and water
+void setupMixed(Sim &sim) {
+  std::mt19937 rng(1234);
+  std::uniform_int_distribution<uint32_t> pick(0, 3);
+
+  for (uint32_t y = 0; y < sim.height(); ++y) {
+    for (uint32_t x = 0; x < sim.width(); ++x) {
+      switch (pick(rng)) {
+      case 0:
+        sim.set(x, y, ElementType::Sand);
+        break;
+      case 1:
+        sim.set(x, y, ElementType::Water);
+        break;
+      default:
+        break;
+      }
+    }
+  }
+}
+
+// stone shelves with oil poured over water, sand on top and smoke trapped
+// underneath, every material in one scene
+void setupLayers(Sim &sim) {
+  const uint32_t w = sim.width();
+  const uint32_t h = sim.height();
+
+  for (uint32_t x = 0; x < w; ++x) {
+    if (x % std::max(w / 4, 1u) < w / 8) {
+      sim.set(x, h / 4, ElementType::Stone);
+    }
+  }
+  for (uint32_t y = 0; y < h / 4; ++y) {
+    for (uint32_t x = 0; x < w; ++x) {
+      sim.set(x, y, y < h / 8 ? ElementType::Smoke : ElementType::Air);
+    }
+  }
+  for (uint32_t y = h / 4 + 1; y < h; ++y) {
+    for (uint32_t x = 0; x < w; ++x) {
+      if (y < h / 2)
+        sim.set(x, y, ElementType::Water);
+      else if (y < h * 5 / 8)
+        sim.set(x, y, ElementType::Oil);
+      else if (y > h * 3 / 4 && x % 3 == 0)
+        sim.set(x, y, ElementType::Sand);
+    }
+  }
+}
+
+// a floor of smoke rising past a row of stone baffles, the only scenario
+// where most of the work moves up with the scan
+void setupSmoke(Sim &sim) {
+  const uint32_t w = sim.width();
+  const uint32_t h = sim.height();
+
+  for (uint32_t y = 0; y < h / 4; ++y) {
+    for (uint32_t x = 0; x < w; ++x) {
+      sim.set(x, y, ElementType::Smoke);
+    }
+  }
+  for (uint32_t x = 0; x < w; ++x) {
+    if (x % std::max(w / 8, 1u) < w / 16) {
+      sim.set(x, h / 2, ElementType::Stone);
+    }
+  }
+}
+
+const Scenario scenarios[] = {
+    {"empty", setupEmpty},
+    {"sand_column", setupSandColumn},
+    {"dam_break", setupDamBreak},
+    {"mixed_50", setupMixed},
+    {"layers", setupLayers},
+    {"smoke", setupSmoke},
+};
+
+// FNV-1a over the render grid, lets runs across builds be compared for
+// identical results as well as speed
+uint64_t checksum(const tGrid &worldMatrix) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const Cell &cell : worldMatrix) {
+    hash = (hash ^ cell.value) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty())
+    return 0.0;
+  size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(i, sorted.size() - 1)];
+}
+
+struct Options {
+  uint32_t steps = 500;
+  uint32_t warmup = 20;
+  uint32_t threads = 1;
+  uint32_t width = DEFAULT_GRID_SIZE_X;
+  uint32_t height = DEFAULT_GRID_SIZE_Y;
+  uint64_t seed = 0;
+  // >0 runs every step as Sim::stepFor slices of this many microseconds
+  uint32_t sliceUs = 0;
+  // steps BitboardSim instead of Sim, scenarios it can't load are skipped
+  bool bitboard = false;
+  BitboardSim::Kernel kernel = BitboardSim::bestKernel();
+  // steps a scalar BitboardSim alongside and fails on the first difference
+  bool crossCheck = false;
+  // save / restore round trip through this file after the run
+  std::string snapshot;
+  std::string replay;
+  // world a replay starts from
+  std::string load;
+};
+
+void step(Sim &sim, const Options &options) {
+  if (!options.sliceUs) {
+    sim.step();
+    return;
+  }
+  while (!sim.stepFor(std::chrono::steady_clock::now() +
+                      std::chrono::microseconds(options.sliceUs)))
+    ;
+}
+
+struct Timing {
+  double total = 0.0;
+  std::vector<double> latencies;
+};
+
+// untimed runs after every step, warmup included, and isn't in the total
+template <typename Step, typename Untimed>
+Timing measure(const Options &options, Step &&step, Untimed &&untimed) {
+  using clock = std::chrono::steady_clock;
+
+  for (uint32_t i = 0; i < options.warmup; ++i) {
+    step();
+    untimed();
+  }
+
+  Timing timing;
+  timing.latencies.reserve(options.steps);
+
+  for (uint32_t i = 0; i < options.steps; ++i) {
+    auto before = clock::now();
+    step();
+    auto after = clock::now();
+    double ns =
+        std::chrono::duration<double, std::nano>(after - before).count();
+    timing.latencies.push_back(ns);
+    timing.total += ns;
+    untimed();
+  }
+
+  std::sort(timing.latencies.begin(), timing.latencies.end());
+  return timing;
+}
+
+template <typename Step>
+Timing measure(const Options &options, Step &&step) {
+  return measure(options, std::forward<Step>(step), []() {});
+}
+
+void report(const Scenario &scenario, const Options &options,
+            const char *engine, uint32_t width, uint32_t height,
+            uint32_t threads, const Timing &timing, size_t activeChunks,
+            const tGrid &worldMatrix) {
+  const uint32_t steps = options.steps;
+  const uint64_t cells = uint64_t(width) * height;
+  double nsPerCell = steps ? timing.total / (double(steps) * cells) : 0.0;
+  double stepsPerSec = timing.total > 0.0 ? steps / (timing.total * 1e-9) : 0.0;
+
+  std::printf("{\"scenario\":\"%s\",\"engine\":\"%s\",\"width\":%u,"
+              "\"height\":%u,\"cells\":%llu,\"threads\":%u,\"steps\":%u,"
+              "\"ns_per_cell\":%.4f,\"steps_per_sec\":%.2f,\"p50_us\":%.3f,"
+              "\"p99_us\":%.3f,\"active_chunks\":%zu,\"checksum\":\"%016llx\"}\n",
+              scenario.name, engine, width, height,
+              static_cast<unsigned long long>(cells), threads, steps, nsPerCell,
+              stepsPerSec, percentile(timing.latencies, 0.50) * 1e-3,
+              percentile(timing.latencies, 0.99) * 1e-3, activeChunks,
+              static_cast<unsigned long long>(checksum(worldMatrix)));
+  std::fflush(stdout);
+}
+
+void runBitboard(const Scenario &scenario, const Options &options, Sim &sim) {
+  if (!BitboardSim::supports(sim)) {
+    std::printf("{\"scenario\":\"%s\",\"engine\":\"bitboard\","
+                "\"skipped\":\"materials\"}\n",
+                scenario.name);
+    std::fflush(stdout);
+    return;
+  }
+
+  BitboardSim board(sim, options.kernel);
+  // only with --cross-check, stepped and compared outside the timing
+  std::unique_ptr<BitboardSim> reference;
+  if (options.crossCheck)
+    reference =
+        std::make_unique<BitboardSim>(sim, BitboardSim::Kernel::Scalar);
+  bool mismatch = false;
+
+  Timing timing = measure(
+      options, [&]() { board.step(); },
+      [&]() {
+        if (!reference)
+          return;
+        reference->step();
+        if (!mismatch && !board.sameCells(*reference)) {
+          std::fprintf(stderr,
+                       "%s: %s kernel differs from scalar at tick %llu\n",
+                       scenario.name, BitboardSim::kernelName(board.kernel()),
+                       static_cast<unsigned long long>(board.tick()));
+          mismatch = true;
+        }
+      });
+  if (mismatch)
+    std::exit(1);
+
+  tGrid worldMatrix;
+  board.writeGrid(worldMatrix);
+
+  std::string engine =
+      std::string("bitboard/") + BitboardSim::kernelName(board.kernel());
+  report(scenario, options, engine.c_str(), board.width(), board.height(), 1,
+         timing, 0, worldMatrix);
+}
+
+double msSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void runSnapshot(const Scenario &scenario, const Options &options, Sim &sim,
+                 const tGrid &worldMatrix) {
+  using clock = std::chrono::steady_clock;
+
+  auto start = clock::now();
+  std::shared_ptr<const WorldImage> image = sim.capture();
+  double captureMs = msSince(start);
+
+  start = clock::now();
+  SnapshotWriter writer;
+  writer.save(image, options.snapshot);
+  writer.wait();
+  double saveMs = msSince(start);
+  if (!writer.lastError().empty()) {
+    std::fprintf(stderr, "%s\n", writer.lastError().c_str());
+    std::exit(1);
+  }
+
+  start = clock::now();
+  Snapshot snapshot(options.snapshot);
+  double openMs = msSince(start);
+
+  tGrid restoredMatrix;
+  Sim restored(restoredMatrix, snapshot.width(), snapshot.height(),
+               options.threads);
+  start = clock::now();
+  restored.restore(snapshot);
+  double restoreMs = msSince(start);
+
+  // the restored world has to carry on exactly like the original
+  bool match = checksum(restoredMatrix) == checksum(worldMatrix);
+  for (uint32_t i = 0; i < 50 && match; ++i) {
+    sim.step();
+    restored.step();
+    match = checksum(restoredMatrix) == checksum(worldMatrix);
+  }
+
+  std::printf("{\"scenario\":\"%s\",\"snapshot_bytes\":%zu,"
+              "\"capture_ms\":%.3f,\"save_ms\":%.3f,\"open_ms\":%.3f,"
+              "\"restore_ms\":%.3f,\"resume_match\":%s}\n",
+              scenario.name, snapshot.size(), captureMs, saveMs, openMs,
+              restoreMs, match ? "true" : "false");
+  std::fflush(stdout);
+  if (!match)
+    std::exit(1);
+}
+
+void runReplay(const Options &options) {
+  Journal journal(options.replay);
+
+  tGrid worldMatrix;
+  Sim sim(worldMatrix, journal.width(), journal.height(), options.threads);
+  sim.setSeed(journal.seed());
+  if (!options.load.empty()) {
+    sim.restore(Snapshot(options.load));
+  }
+
+  using clock = std::chrono::steady_clock;
+  Timing timing;
+  auto start = clock::now();
+  journal.replay(sim, [&](Sim &sim) {
+    auto before = clock::now();
+    step(sim, options);
+    timing.latencies.push_back(
+        std::chrono::duration<double, std::nano>(clock::now() - before)
+            .count());
+  });
+  timing.total =
+      std::chrono::duration<double, std::nano>(clock::now() - start).count();
+  std::sort(timing.latencies.begin(), timing.latencies.end());
+
+  Options replayed = options;
+  replayed.steps = static_cast<uint32_t>(timing.latencies.size());
+  const Scenario scenario{"replay", nullptr};
+  report(scenario, replayed, "cells", sim.width(), sim.height(),
+         sim.threadCount(), timing, sim.activeChunkCount(), worldMatrix);
+}
+
+void runScenario(const Scenario &scenario, const Options &options) {
+  tGrid worldMatrix;
+  Sim sim(worldMatrix, options.width, options.height, options.threads);
+  sim.setSeed(options.seed);
+  scenario.setup(sim);
+
+  if (options.bitboard) {
+    runBitboard(scenario, options, sim);
+    return;
+  }
+
+  Timing timing = measure(options, [&]() { step(sim, options); });
+  report(scenario, options, "cells", sim.width(), sim.height(),
+         sim.threadCount(), timing, sim.activeChunkCount(), worldMatrix);
+
+  if (!options.snapshot.empty())
+    runSnapshot(scenario, options, sim, worldMatrix);
+}
+
+void usage(const char *argv0) {
+  std::fprintf(stderr,
+               "usage: %s [--steps N] [--warmup N] [--threads N] "
+               "[--size WxH] [--seed N] [--slice-us N] "
+               "[--engine cells|bitboard] [--kernel scalar|avx2|neon] "
+               "[--cross-check] [--scenario NAME] [--snapshot PATH] "
+               "[--replay JOURNAL [--load SNAPSHOT]]\n"
+               "scenarios:",
+               argv0);
+  for (const Scenario &s : scenarios) {
+    std::fprintf(stderr, " %s", s.name);
+  }
+  std::fprintf(stderr, "\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  std::string only;
+
+  for (int i = 1; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    if (!std::strcmp(argv[i], "--steps") && hasValue) {
+      options.steps = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!std::strcmp(argv[i], "--warmup") && hasValue) {
+      options.warmup = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!std::strcmp(argv[i], "--threads") && hasValue) {
+      options.threads = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!std::strcmp(argv[i], "--seed") && hasValue) {
+      options.seed = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--slice-us") && hasValue) {
+      options.sliceUs =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!std::strcmp(argv[i], "--size") && hasValue) {
+      // WxH, or a single number for a square world
+      char *end = nullptr;
+      options.width = static_cast<uint32_t>(std::strtoul(argv[++i], &end, 10));
+      options.height = *end == 'x' ? static_cast<uint32_t>(
+                                         std::strtoul(end + 1, nullptr, 10))
+                                   : options.width;
+      if (options.width == 0 || options.height == 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (!std::strcmp(argv[i], "--engine") && hasValue) {
+      std::string engine = argv[++i];
+      if (engine != "cells" && engine != "bitboard") {
+        usage(argv[0]);
+        return 1;
+      }
+      options.bitboard = engine == "bitboard";
+    } else if (!std::strcmp(argv[i], "--kernel") && hasValue) {
+      std::string kernel = argv[++i];
+      bool found = false;
+      for (BitboardSim::Kernel k :
+           {BitboardSim::Kernel::Scalar, BitboardSim::Kernel::Avx2,
+            BitboardSim::Kernel::Neon}) {
+        if (kernel == BitboardSim::kernelName(k)) {
+          options.kernel = k;
+          found = true;
+        }
+      }
+      if (!found || !BitboardSim::kernelAvailable(options.kernel)) {
+        std::fprintf(stderr, "kernel %s isn't available\n", kernel.c_str());
+        return 1;
+      }
+    } else if (!std::strcmp(argv[i], "--cross-check")) {
+      options.crossCheck = true;
+    } else if (!std::strcmp(argv[i], "--scenario") && hasValue) {
+      only = argv[++i];
+    } else if (!std::strcmp(argv[i], "--snapshot") && hasValue) {
+      options.snapshot = argv[++i];
+    } else if (!std::strcmp(argv[i], "--replay") && hasValue) {
+      options.replay = argv[++i];
+    } else if (!std::strcmp(argv[i], "--load") && hasValue) {
+      options.load = argv[++i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!options.replay.empty()) {
+    runReplay(options);
+    return 0;
+  }
+
+  bool ran = false;
+  for (const Scenario &scenario : scenarios) {
+    if (!only.empty() && only != scenario.name)
+      continue;
+    runScenario(scenario, options);
+    ran = true;
+  }
+
+  if (!ran) {
+    usage(argv[0]);
+    return 1;
+  }
+  return 0;
+}
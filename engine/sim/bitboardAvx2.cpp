@@ -0,0 +1,43 @@
+// Built with AVX2 enabled, only ever called once BitboardSim has checked the
+// CPU supports it. Keep the includes to a minimum, inline functions from
+// anywhere else could end up as the AVX2 copy the whole program links to.
+#include <bitboardKernel.hpp>
+
+#include <immintrin.h>
+
+namespace {
+
+struct Avx2Lanes {
+  using V = __m256i;
+  static constexpr uint32_t WORDS = 4;
+
+  static V load(const uint64_t *p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  }
+  static void store(uint64_t *p, V v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+  }
+  static V bor(V a, V b) { return _mm256_or_si256(a, b); }
+  static V band(V a, V b) { return _mm256_and_si256(a, b); }
+  static V andNot(V a, V b) { return _mm256_andnot_si256(b, a); }
+  static V notOr(V a, V b) {
+    return _mm256_xor_si256(_mm256_or_si256(a, b), _mm256_set1_epi64x(-1));
+  }
+  // the unaligned load one word back lines every lane up with the word
+  // before it
+  static V toHigher(const uint64_t *p, uint32_t w) {
+    return _mm256_or_si256(_mm256_slli_epi64(load(p + w), 1),
+                           _mm256_srli_epi64(load(p + w - 1), 63));
+  }
+  static V toLower(const uint64_t *p, uint32_t w) {
+    return _mm256_or_si256(_mm256_srli_epi64(load(p + w), 1),
+                           _mm256_slli_epi64(load(p + w + 1), 63));
+  }
+};
+
+} // namespace
+
+void stepBitboardRowAvx2(const BitboardRow &row,
+                         const BitboardScratch &scratch) {
+  stepBitboardRow<Avx2Lanes>(row, scratch);
+}
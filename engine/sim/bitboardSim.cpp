@@ -0,0 +1,334 @@
+#include <bitboardKernel.hpp>
+#include <bitboardSim.hpp>
+#include <material.hpp>
+#include <rng.hpp>
+#include <sim.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define BITBOARD_NEON
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+
+// words per SIMD register of the widest kernel, rows are padded to it
+const uint32_t LANE_WORDS = 4;
+
+struct ScalarLanes {
+  using V = uint64_t;
+  static constexpr uint32_t WORDS = 1;
+
+  static V load(const uint64_t *p) { return *p; }
+  static void store(uint64_t *p, V v) { *p = v; }
+  static V bor(V a, V b) { return a | b; }
+  static V band(V a, V b) { return a & b; }
+  static V andNot(V a, V b) { return a & ~b; }
+  static V notOr(V a, V b) { return ~(a | b); }
+  static V toHigher(const uint64_t *p, uint32_t w) {
+    // w is unsigned, step back from the pointer rather than the index
+    const uint64_t *word = p + w;
+    return (word[0] << 1) | (word[-1] >> 63);
+  }
+  static V toLower(const uint64_t *p, uint32_t w) {
+    const uint64_t *word = p + w;
+    return (word[0] >> 1) | (word[1] << 63);
+  }
+};
+
+#ifdef BITBOARD_NEON
+struct NeonLanes {
+  using V = uint64x2_t;
+  static constexpr uint32_t WORDS = 2;
+
+  static V load(const uint64_t *p) { return vld1q_u64(p); }
+  static void store(uint64_t *p, V v) { vst1q_u64(p, v); }
+  static V bor(V a, V b) { return vorrq_u64(a, b); }
+  static V band(V a, V b) { return vandq_u64(a, b); }
+  static V andNot(V a, V b) { return vbicq_u64(a, b); }
+  static V notOr(V a, V b) {
+    return vreinterpretq_u64_u32(vmvnq_u32(vreinterpretq_u32_u64(vorrq_u64(a, b))));
+  }
+  static V toHigher(const uint64_t *p, uint32_t w) {
+    return vorrq_u64(vshlq_n_u64(load(p + w), 1),
+                     vshrq_n_u64(load(p + w - 1), 63));
+  }
+  static V toLower(const uint64_t *p, uint32_t w) {
+    return vorrq_u64(vshrq_n_u64(load(p + w), 1),
+                     vshlq_n_u64(load(p + w + 1), 63));
+  }
+};
+#endif
+
+uint32_t countTrailingZeros(uint64_t bits) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, bits);
+  return index;
+#else
+  return __builtin_ctzll(bits);
+#endif
+}
+
+bool cpuHasAvx2() {
+#if defined(SIM_AVX2) && (defined(__GNUC__) || defined(__clang__))
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#elif defined(SIM_AVX2) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+  // the OS has to save the YMM registers as well
+  __cpuid(info, 1);
+  if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return info[1] & (1 << 5);
+#else
+  return false;
+#endif
+}
+
+} // namespace
+
+void stepBitboardRowScalar(const BitboardRow &row,
+                           const BitboardScratch &scratch) {
+  stepBitboardRow<ScalarLanes>(row, scratch);
+}
+
+#ifdef BITBOARD_NEON
+void stepBitboardRowNeon(const BitboardRow &row,
+                         const BitboardScratch &scratch) {
+  stepBitboardRow<NeonLanes>(row, scratch);
+}
+#endif
+
+BitboardSim::BitboardSim(uint32_t width, uint32_t height, Kernel kernel)
+    : m_Width(width), m_Height(height),
+      m_Stride(((width + 63) / 64 + LANE_WORDS - 1) / LANE_WORDS * LANE_WORDS),
+      m_Kernel(kernel) {
+  if (width == 0 || height == 0) {
+    throw std::invalid_argument("[BitboardSim]: World size can't be zero.");
+  }
+  if (!kernelAvailable(kernel)) {
+    throw std::invalid_argument(
+        "[BitboardSim]: Kernel isn't available on this CPU.");
+  }
+
+  size_t words = size_t(m_Stride) * height;
+  for (size_t type = 1; type < ELEMENT_TYPE_COUNT; ++type) {
+    if (supports(static_cast<ElementType>(type)))
+      m_Planes[type].assign(words, 0);
+  }
+
+  m_Blocked.assign(words, 0);
+  uint32_t lastWord = width / 64;
+  for (uint32_t y = 0; y < height; ++y) {
+    uint64_t *blocked = m_Blocked.data() + size_t(y) * m_Stride;
+    if (width % 64)
+      blocked[lastWord] = ~0ull << (width % 64);
+    for (uint32_t w = (width + 63) / 64; w < m_Stride; ++w)
+      blocked[w] = ~0ull;
+  }
+
+  // a zero word either side of every scratch array
+  m_Scratch.assign(size_t(m_Stride + 2) * BITBOARD_SCRATCH_COUNT, 0);
+  m_Vacated.assign(size_t(m_Stride) * 2, 0);
+  m_Preference.assign(m_Stride, 0);
+}
+
+BitboardSim::BitboardSim(const Sim &sim, Kernel kernel)
+    : BitboardSim(sim.width(), sim.height(), kernel) {
+  if (!supports(sim)) {
+    throw std::invalid_argument(
+        "[BitboardSim]: Only sand and static materials can be stepped.");
+  }
+  m_Seed = sim.seed();
+  m_Tick = sim.tick();
+
+  for (uint32_t y = 0; y < m_Height; ++y) {
+    for (uint32_t x = 0; x < m_Width; ++x) {
+      ElementType type = sim.materialAt(x, y);
+      if (type != ElementType::Air)
+        set(x, y, type);
+    }
+  }
+}
+
+bool BitboardSim::supports(ElementType type) {
+  return type == ElementType::Sand || materialOf(type).kernel == nullptr;
+}
+
+bool BitboardSim::supports(const Sim &sim) {
+  for (uint32_t y = 0; y < sim.height(); ++y) {
+    for (uint32_t x = 0; x < sim.width(); ++x) {
+      if (!supports(sim.materialAt(x, y)))
+        return false;
+    }
+  }
+  return true;
+}
+
+BitboardSim::Kernel BitboardSim::bestKernel() {
+  if (kernelAvailable(Kernel::Avx2))
+    return Kernel::Avx2;
+  if (kernelAvailable(Kernel::Neon))
+    return Kernel::Neon;
+  return Kernel::Scalar;
+}
+
+bool BitboardSim::kernelAvailable(Kernel kernel) {
+  switch (kernel) {
+  case Kernel::Scalar:
+    return true;
+  case Kernel::Avx2: {
+    static const bool avx2 = cpuHasAvx2();
+    return avx2;
+  }
+  case Kernel::Neon:
+#ifdef BITBOARD_NEON
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+const char *BitboardSim::kernelName(Kernel kernel) {
+  switch (kernel) {
+  case Kernel::Scalar:
+    return "scalar";
+  case Kernel::Avx2:
+    return "avx2";
+  case Kernel::Neon:
+    return "neon";
+  }
+  return "unknown";
+}
+
+void BitboardSim::set(uint32_t x, uint32_t y, ElementType type) {
+  if (x >= m_Width || y >= m_Height)
+    return;
+  if (!supports(type)) {
+    throw std::invalid_argument(
+        "[BitboardSim]: Only sand and static materials can be stepped.");
+  }
+
+  size_t word = size_t(y) * m_Stride + x / 64;
+  uint64_t bit = 1ull << (x % 64);
+  for (AlignedVector<uint64_t> &plane : m_Planes) {
+    if (!plane.empty())
+      plane[word] &= ~bit;
+  }
+
+  if (type != ElementType::Air)
+    m_Planes[static_cast<size_t>(type)][word] |= bit;
+  if (type == ElementType::Air || type == ElementType::Sand)
+    m_Blocked[word] &= ~bit;
+  else
+    m_Blocked[word] |= bit;
+}
+
+ElementType BitboardSim::get(uint32_t x, uint32_t y) const {
+  size_t word = size_t(y) * m_Stride + x / 64;
+  uint64_t bit = 1ull << (x % 64);
+  for (size_t type = 1; type < ELEMENT_TYPE_COUNT; ++type) {
+    const AlignedVector<uint64_t> &plane = m_Planes[type];
+    if (!plane.empty() && (plane[word] & bit))
+      return static_cast<ElementType>(type);
+  }
+  return ElementType::Air;
+}
+
+void BitboardSim::step() {
+  void (*stepRow)(const BitboardRow &, const BitboardScratch &) =
+      stepBitboardRowScalar;
+  switch (m_Kernel) {
+  case Kernel::Scalar:
+    break;
+  case Kernel::Avx2:
+#ifdef SIM_AVX2
+    stepRow = stepBitboardRowAvx2;
+#endif
+    break;
+  case Kernel::Neon:
+#ifdef BITBOARD_NEON
+    stepRow = stepBitboardRowNeon;
+#endif
+    break;
+  }
+
+  BitboardScratch scratch;
+  uint64_t **buffers[BITBOARD_SCRATCH_COUNT] = {
+      &scratch.a,      &scratch.b,     &scratch.free,  &scratch.right1,
+      &scratch.left1, &scratch.left2, &scratch.right2};
+  for (uint32_t i = 0; i < BITBOARD_SCRATCH_COUNT; ++i) {
+    *buffers[i] = m_Scratch.data() + size_t(i) * (m_Stride + 2) + 1;
+  }
+
+  // row 0 has nowhere to fall, nothing leaves it
+  std::fill(m_Vacated.begin(), m_Vacated.begin() + m_Stride, 0);
+
+  // Bottom-up like Sim, a row only moves once the row below it is done
+  for (uint32_t y = 1; y < m_Height; ++y) {
+    uint64_t *sand = row(ElementType::Sand, y);
+    uint64_t *vacated = m_Vacated.data() + size_t(y & 1) * m_Stride;
+
+    if (std::all_of(sand, sand + m_Stride, [](uint64_t w) { return !w; })) {
+      std::fill(vacated, vacated + m_Stride, 0);
+      continue;
+    }
+
+    // keyed on the row, same as Sim keys its streams on the chunk
+    Rng rng(m_Seed, m_Tick, y);
+    for (uint32_t w = 0; w < m_Stride; ++w) {
+      m_Preference[w] = rng.next();
+    }
+
+    BitboardRow args;
+    args.sand = sand;
+    args.sandBelow = row(ElementType::Sand, y - 1);
+    args.blockedBelow = m_Blocked.data() + size_t(y - 1) * m_Stride;
+    args.vacatedBelow = m_Vacated.data() + size_t((y - 1) & 1) * m_Stride;
+    args.vacated = vacated;
+    args.preference = m_Preference.data();
+    args.words = m_Stride;
+    stepRow(args, scratch);
+  }
+
+  ++m_Tick;
+}
+
+void BitboardSim::writeGrid(tGrid &worldMatrix) const {
+  worldMatrix.assign(size_t(m_Width) * m_Height, Cell{});
+
+  for (size_t type = 1; type < ELEMENT_TYPE_COUNT; ++type) {
+    const AlignedVector<uint64_t> &plane = m_Planes[type];
+    if (plane.empty())
+      continue;
+
+    for (uint32_t y = 0; y < m_Height; ++y) {
+      const uint64_t *words = plane.data() + size_t(y) * m_Stride;
+      for (uint32_t w = 0; w < m_Stride; ++w) {
+        for (uint64_t bits = words[w]; bits; bits &= bits - 1) {
+          uint32_t x = w * 64 + countTrailingZeros(bits);
+          worldMatrix[size_t(y) * m_Width + x].value =
+              static_cast<uint8_t>(type);
+        }
+      }
+    }
+  }
+}
+
+bool BitboardSim::sameCells(const BitboardSim &other) const {
+  return m_Width == other.m_Width && m_Height == other.m_Height &&
+         m_Planes == other.m_Planes;
+}
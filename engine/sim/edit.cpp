@@ -0,0 +1,229 @@
+#include <sim.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+// b > 0
+int64_t floorDiv(int64_t a, int64_t b) {
+  return a / b - (a % b != 0 && a < 0);
+}
+
+int64_t ceilDiv(int64_t a, int64_t b) {
+  return a / b + (a % b != 0 && a > 0);
+}
+
+// largest w with w * w <= value, value >= 0
+int64_t isqrt(int64_t value) {
+  int64_t w = static_cast<int64_t>(std::sqrt(static_cast<double>(value)));
+  while (w > 0 && w * w > value)
+    --w;
+  while ((w + 1) * (w + 1) <= value)
+    ++w;
+  return w;
+}
+
+// Coordinates come from journals too, which can hold anything. Radii and
+// how far outside the grid an edit starts are capped at this, far past any
+// real edit, so the products below can't overflow.
+const int64_t EDIT_REACH = int64_t(1) << 24;
+
+} // namespace
+
+void Sim::writeSpan(uint32_t y, uint32_t x0, uint32_t x1, ElementType type) {
+  static_assert(sizeof(ElementType) == 1 && sizeof(Cell) == 1,
+                "spans are written with memset");
+  const size_t row = size_t(y) * m_Width;
+  const uint32_t length = x1 - x0 + 1;
+  uint8_t *materials = reinterpret_cast<uint8_t *>(m_Materials.data() + row);
+
+  // The census by what's overwritten, instead of countWrite per cell. A
+  // pass per material vectorizes, a histogram stalls on its own counters.
+  const uint8_t *old = materials + x0;
+  for (size_t i = 0; i < ELEMENT_TYPE_COUNT; ++i) {
+    const uint8_t material = static_cast<uint8_t>(i);
+    uint32_t count = 0;
+    for (uint32_t x = 0; x < length; ++x) {
+      count += old[x] == material;
+    }
+    m_Stats.census[i] -= count;
+  }
+  m_Stats.census[static_cast<size_t>(type)] += length;
+
+  std::memset(materials + x0, static_cast<uint8_t>(type), length);
+  std::memset(reinterpret_cast<uint8_t *>(m_WorldMatrix.data() + row) + x0,
+              static_cast<uint8_t>(type), length);
+
+  // the flow directions set() would pick, the bytes at either end are
+  // shared with cells outside the span
+  const size_t bitRow = size_t(y) * m_BitplaneStride;
+  uint8_t *flowsLeft = m_FlowsLeft.data() + bitRow;
+  const uint8_t *seeds = m_FlowSeeds.data() + bitRow;
+  const uint32_t first = x0 >> 3;
+  const uint32_t last = x1 >> 3;
+  const uint8_t firstMask = uint8_t(0xff << (x0 & 7));
+  const uint8_t lastMask = uint8_t(0xff >> (7 - (x1 & 7)));
+  auto blend = [&](uint32_t byte, uint8_t mask) {
+    flowsLeft[byte] = uint8_t((flowsLeft[byte] & ~mask) | (seeds[byte] & mask));
+  };
+  if (first == last) {
+    blend(first, firstMask & lastMask);
+  } else {
+    blend(first, firstMask);
+    std::memcpy(flowsLeft + first + 1, seeds + first + 1, last - first - 1);
+    blend(last, lastMask);
+  }
+
+  // what markDirty does for every cell of it, a cell wakes its 8
+  // neighbours
+  uint32_t wx0 = x0 > 0 ? x0 - 1 : 0;
+  uint32_t wy0 = y > 0 ? y - 1 : 0;
+  uint32_t wx1 = std::min(x1 + 1, m_Width - 1);
+  uint32_t wy1 = std::min(y + 1, m_Height - 1);
+  for (uint32_t cy = wy0 / CHUNK_SIZE; cy <= wy1 / CHUNK_SIZE; ++cy) {
+    for (uint32_t cx = wx0 / CHUNK_SIZE; cx <= wx1 / CHUNK_SIZE; ++cx) {
+      DirtyRect rect;
+      rect.include(std::max(wx0, cx * CHUNK_SIZE),
+                   std::max(wy0, cy * CHUNK_SIZE),
+                   std::min(wx1, cx * CHUNK_SIZE + CHUNK_SIZE - 1),
+                   std::min(wy1, cy * CHUNK_SIZE + CHUNK_SIZE - 1));
+      uint32_t index = cy * m_ChunksX + cx;
+      wakeChunk(index, rect, false);
+      addWritten(index, rect);
+    }
+  }
+}
+
+void Sim::fillRow(int64_t y, int64_t x0, int64_t x1, ElementType type) {
+  if (y < 0 || y >= m_Height)
+    return;
+  x0 = std::max<int64_t>(x0, 0);
+  x1 = std::min<int64_t>(x1, int64_t(m_Width) - 1);
+  if (x0 > x1)
+    return;
+  writeSpan(uint32_t(y), uint32_t(x0), uint32_t(x1), type);
+}
+
+void Sim::fillRect(int64_t x0, int64_t y0, int64_t x1, int64_t y1,
+                   ElementType type) {
+  if (x0 > x1)
+    std::swap(x0, x1);
+  if (y0 > y1)
+    std::swap(y0, y1);
+  y0 = std::max<int64_t>(y0, 0);
+  y1 = std::min<int64_t>(y1, int64_t(m_Height) - 1);
+  for (int64_t y = y0; y <= y1; ++y) {
+    fillRow(y, x0, x1, type);
+  }
+}
+
+void Sim::fillCircle(int64_t x, int64_t y, int64_t radius, ElementType type) {
+  if (radius < 0)
+    return;
+  // a centre further out than the radius misses the grid
+  radius = std::min(radius, EDIT_REACH);
+  if (x < -radius || x >= int64_t(m_Width) + radius || y < -radius ||
+      y >= int64_t(m_Height) + radius)
+    return;
+  int64_t y0 = std::max<int64_t>(y - radius, 0);
+  int64_t y1 = std::min<int64_t>(y + radius, int64_t(m_Height) - 1);
+  for (int64_t row = y0; row <= y1; ++row) {
+    int64_t dy = row - y;
+    int64_t halfWidth = isqrt(radius * radius - dy * dy);
+    fillRow(row, x - halfWidth, x + halfWidth, type);
+  }
+}
+
+// A row of the swept square is an interval: the cells within radius of the
+// part of the segment that's within radius of the row vertically. Done in
+// integers so strokes replay the same everywhere.
+void Sim::stroke(int64_t x0, int64_t y0, int64_t x1, int64_t y1,
+                 int64_t radius, ElementType type) {
+  if (radius < 0)
+    return;
+  // ends pulled in from past EDIT_REACH bend the segment, no drag that
+  // came from a window gets there
+  radius = std::min(radius, EDIT_REACH);
+  const int64_t maxX = int64_t(m_Width) + EDIT_REACH;
+  const int64_t maxY = int64_t(m_Height) + EDIT_REACH;
+  x0 = std::clamp(x0, -EDIT_REACH, maxX);
+  x1 = std::clamp(x1, -EDIT_REACH, maxX);
+  y0 = std::clamp(y0, -EDIT_REACH, maxY);
+  y1 = std::clamp(y1, -EDIT_REACH, maxY);
+  // which end comes first doesn't change what's covered
+  if (y0 > y1) {
+    std::swap(x0, x1);
+    std::swap(y0, y1);
+  }
+  const int64_t dx = x1 - x0;
+  const int64_t dy = y1 - y0;
+
+  int64_t top = std::max<int64_t>(y0 - radius, 0);
+  int64_t bottom = std::min<int64_t>(y1 + radius, int64_t(m_Height) - 1);
+  for (int64_t y = top; y <= bottom; ++y) {
+    if (dy == 0) {
+      fillRow(y, std::min(x0, x1) - radius, std::max(x0, x1) + radius, type);
+      continue;
+    }
+
+    // segment heights this row's brush reaches, x along it is
+    // x0 + dx * (height - y0) / dy, kept as a fraction over dy
+    int64_t low = std::max(y - radius, y0);
+    int64_t high = std::min(y + radius, y1);
+    int64_t a = x0 * dy + dx * (low - y0);
+    int64_t b = x0 * dy + dx * (high - y0);
+    fillRow(y, ceilDiv(std::min(a, b), dy) - radius,
+            floorDiv(std::max(a, b), dy) + radius, type);
+  }
+}
+
+// Scanline fill, every run of the old material is written as one span and
+// seeds the runs touching it above and below.
+size_t Sim::floodFill(int64_t x, int64_t y, ElementType type) {
+  if (x < 0 || y < 0 || x >= m_Width || y >= m_Height)
+    return 0;
+  const ElementType target = materialAt(uint32_t(x), uint32_t(y));
+  if (target == type)
+    return 0;
+
+  size_t written = 0;
+  std::vector<std::pair<uint32_t, uint32_t>> seeds{
+      {uint32_t(x), uint32_t(y)}};
+  // pushes the start of every run of target in x0..x1 of row
+  auto seedRow = [&](uint32_t row, uint32_t x0, uint32_t x1) {
+    bool inRun = false;
+    for (uint32_t cx = x0; cx <= x1; ++cx) {
+      bool match = materialAt(cx, row) == target;
+      if (match && !inRun)
+        seeds.emplace_back(cx, row);
+      inRun = match;
+    }
+  };
+
+  while (!seeds.empty()) {
+    auto [sx, sy] = seeds.back();
+    seeds.pop_back();
+    // filled from another seed meanwhile
+    if (materialAt(sx, sy) != target)
+      continue;
+
+    uint32_t left = sx;
+    while (left > 0 && materialAt(left - 1, sy) == target)
+      --left;
+    uint32_t right = sx;
+    while (right + 1 < m_Width && materialAt(right + 1, sy) == target)
+      ++right;
+
+    writeSpan(sy, left, right, type);
+    written += right - left + 1;
+
+    if (sy > 0)
+      seedRow(sy - 1, left, right);
+    if (sy + 1 < m_Height)
+      seedRow(sy + 1, left, right);
+  }
+  return written;
+}
@@ -1,65 +1,125 @@
 #include <element.hpp>
+#include <material.hpp>
 #include <sim.hpp>
 
-void Element::step(
-    Sim &sim,
-    std::uniform_int_distribution<std::mt19937::result_type> genBool) {
+#include <array>
 
-  uint32_t curr_X = m_GridX;
-  uint32_t curr_Y = m_GridY;
-  Element self = *this;
+namespace {
+
+enum Entry : uint8_t { NEVER, UNLESS_DISPLACED, ALWAYS };
+
+// whether a cell of Type may move into a cell of each material, worked out
+// once per kernel at compile time
+template <ElementType Type>
+constexpr std::array<Entry, ELEMENT_TYPE_COUNT> entryRules() {
+  constexpr const Material &self = MATERIALS[static_cast<size_t>(Type)];
 
-  switch (m_Value) {
-  case ElementType::Sand: {
-
-    std::pair<int, int> positionsToTry[3] = {
-        {0, -1},
-        {-1, -1},
-        {1, -1},
-    };
-
-    for (auto pos : positionsToTry) {
-      auto target = sim.get(m_GridX + pos.first, m_GridY + pos.second);
-      if (target && !target.value().m_HasBeenDisplaced &&
-          target.value().m_Value != ElementType::Sand) {
-        swap(sim, curr_X + pos.first, curr_Y + pos.second, target.value());
-        break;
-      }
+  std::array<Entry, ELEMENT_TYPE_COUNT> rules{};
+  for (size_t i = 0; i < ELEMENT_TYPE_COUNT; ++i) {
+    const Material &other = MATERIALS[i];
+    bool lighter = self.gravity < 0 ? other.density < self.density
+                                    : other.density > self.density;
+    if ((other.flags & MATERIAL_STATIC) || !lighter) {
+      rules[i] = NEVER;
+    } else if ((self.flags & MATERIAL_FLUID) && self.gravity < 0 &&
+               static_cast<ElementType>(i) == ElementType::Air) {
+      // Fluids may pour into the gap a cell has just left, that's what lets
+      // a column of water fall as one. Only those falling against the
+      // bottom-up scan, a rising one would be visited again in every row
+      // it moves into and cross the chunk in one tick. Anything else that
+      // already moved this tick stays put.
+      rules[i] = ALWAYS;
+    } else {
+      rules[i] = UNLESS_DISPLACED;
     }
-    break;
   }
-  case ElementType::Water: {
-    std::pair<int, int> positionsToTry[5] = {
-        {0, -1},
-        {-1, -1},
-        {1, -1},
-        {-1, 0},
-        {1, 0},
-    };
-
-    for (int i = 0; i < 5; i++) {
-      auto pos = positionsToTry[i];
-      auto target = sim.get(m_GridX + pos.first, m_GridY + pos.second);
-      if (target &&
-          target.value().m_Value == ElementType::Air) {
-        swap(sim, curr_X + pos.first, curr_Y + pos.second, target.value());
-        if (i == 4) {
-          auto temp = positionsToTry[4];
-          positionsToTry[4] = positionsToTry[3];
-          positionsToTry[3] = temp;
-        }
-        break;
-      }
+  return rules;
+}
+
+template <ElementType Type>
+bool tryMove(Sim &sim, uint32_t x, uint32_t y, int dx, int dy,
+             Element &element) {
+  static constexpr std::array<Entry, ELEMENT_TYPE_COUNT> rules =
+      entryRules<Type>();
+
+  uint32_t targetX = x + dx;
+  uint32_t targetY = y + dy;
+  if (!sim.insideBounds(targetX, targetY))
+    return false;
+
+  // only the material is read until the move is certain
+  ElementType type = sim.materialAt(targetX, targetY);
+  Entry entry = rules[static_cast<size_t>(type)];
+  if (entry == NEVER)
+    return false;
+  bool displaced = sim.isDisplaced(targetX, targetY);
+  if (entry == UNLESS_DISPLACED && displaced)
+    return false;
+
+  Element target{type, displaced, sim.flowsLeft(targetX, targetY)};
+  element.swap(sim, x, y, targetX, targetY, target);
+  return true;
+}
+
+} // namespace
+
+template <ElementType Type>
+void stepMaterial(Sim &sim, uint32_t x, uint32_t y, Element &element,
+                  Rng &rng) {
+  constexpr const Material &self = MATERIALS[static_cast<size_t>(Type)];
+
+  // Rising cells move the same way as the bottom-up scan, one that moved
+  // into a row still ahead of it this tick has had its turn. The flag can
+  // also be left over from a move into a chunk stepped earlier, the cell
+  // then waits a tick, it mustn't fall asleep over it.
+  if constexpr (self.gravity > 0) {
+    if (element.m_HasBeenDisplaced) {
+      sim.keepAwake(x, y);
+      return;
     }
-    break;
   }
-  case ElementType::Air:
-    break;
+
+  // which side gets tried first, a fixed order makes piles lean
+  int side = rng.nextBool() ? 1 : -1;
+
+  for (uint32_t i = 0; i < self.moveCount; ++i) {
+    const MoveOffset &move = self.moves[i];
+    if (tryMove<Type>(sim, x, y, move.dx * side, move.dy, element))
+      return;
+  }
+
+  if constexpr ((self.flags & MATERIAL_FLUID) != 0) {
+    // keep flowing the same way until blocked, then turn around
+    int dir = element.m_FlowsLeft ? -1 : 1;
+    if (tryMove<Type>(sim, x, y, dir, 0, element))
+      return;
+
+    // the turn is written along with the cell, a stuck cell keeps its way
+    element.m_FlowsLeft = !element.m_FlowsLeft;
+    if (!tryMove<Type>(sim, x, y, -dir, 0, element))
+      element.m_FlowsLeft = !element.m_FlowsLeft;
   }
 }
 
-void Element::swap(Sim &sim, uint32_t x, uint32_t y, Element &element) {
+template void stepMaterial<ElementType::Sand>(Sim &, uint32_t, uint32_t,
+                                              Element &, Rng &);
+template void stepMaterial<ElementType::Water>(Sim &, uint32_t, uint32_t,
+                                               Element &, Rng &);
+template void stepMaterial<ElementType::Oil>(Sim &, uint32_t, uint32_t,
+                                             Element &, Rng &);
+template void stepMaterial<ElementType::Smoke>(Sim &, uint32_t, uint32_t,
+                                               Element &, Rng &);
+
+void Element::step(Sim &sim, uint32_t x, uint32_t y, Rng &rng) {
+  MaterialKernel kernel = materialOf(m_Value).kernel;
+  if (kernel)
+    kernel(sim, x, y, *this, rng);
+}
+
+void Element::swap(Sim &sim, uint32_t x, uint32_t y, uint32_t targetX,
+                   uint32_t targetY, Element &element) {
+  sim.countSwap(m_Value, element.m_Value);
   Element self = *this;
-  sim.set(m_GridX, m_GridY, element);
-  sim.set(x, y, self);
+  sim.set(x, y, element);
+  sim.set(targetX, targetY, self);
 };
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+
+// Row kernel shared by the BitboardSim backends. Only included by the
+// translation units that instantiate it, each with its own lane type, and
+// kept in an unnamed namespace so an AVX2 build of it can never be picked
+// by the linker for a CPU without AVX2.
+
+// One row y and the row below it. Bit i of word w is cell x = w * 64 + i.
+struct BitboardRow {
+  uint64_t *sand;
+  uint64_t *sandBelow;
+  const uint64_t *blockedBelow;
+  // sand that left row y - 1 this tick, nothing may follow it in
+  const uint64_t *vacatedBelow;
+  // written: sand that left row y
+  uint64_t *vacated;
+  // set bits try +x before -x
+  const uint64_t *preference;
+  // a multiple of every lane width
+  uint32_t words;
+};
+
+// Per row temporaries. Each points one word into a buffer with a zero word
+// on both sides, the shifts read one word past either end.
+struct BitboardScratch {
+  uint64_t *a;
+  uint64_t *b;
+  uint64_t *free;
+  uint64_t *right1;
+  uint64_t *left1;
+  uint64_t *left2;
+  uint64_t *right2;
+};
+
+// number of scratch buffers above
+const uint32_t BITBOARD_SCRATCH_COUNT = 7;
+
+void stepBitboardRowScalar(const BitboardRow &row,
+                           const BitboardScratch &scratch);
+void stepBitboardRowAvx2(const BitboardRow &row,
+                         const BitboardScratch &scratch);
+void stepBitboardRowNeon(const BitboardRow &row,
+                         const BitboardScratch &scratch);
+
+namespace {
+
+// L provides a vector type V of L::WORDS words and load/store, or, and,
+// andNot(a, b) = a & ~b, notOr(a, b) = ~(a | b) and the two cross-word
+// shifts: toHigher moves every bit to x + 1, toLower to x - 1.
+//
+// Five passes, each one only reads neighbouring words of arrays the
+// previous passes finished:
+//   1. straight down into cells that are empty and weren't just vacated
+//   2. first choice diagonals, +x movers claim their cells before -x ones
+//   3. drop the movers of pass 2 from the waiting sets
+//   4. second choice diagonals for whoever is left
+//   5. drop those movers too, what remains stays put
+template <typename L>
+void stepBitboardRow(const BitboardRow &row, const BitboardScratch &s) {
+  using V = typename L::V;
+  const uint32_t n = row.words;
+
+  for (uint32_t w = 0; w < n; w += L::WORDS) {
+    V sand = L::load(row.sand + w);
+    V below = L::load(row.sandBelow + w);
+    V occupied = L::bor(L::bor(below, L::load(row.blockedBelow + w)),
+                        L::load(row.vacatedBelow + w));
+    V down = L::andNot(sand, occupied);
+    V rest = L::andNot(sand, down);
+    V pref = L::load(row.preference + w);
+
+    L::store(s.a + w, L::band(rest, pref));
+    L::store(s.b + w, L::andNot(rest, pref));
+    L::store(s.free + w, L::notOr(occupied, down));
+    L::store(row.sandBelow + w, L::bor(below, down));
+  }
+
+  for (uint32_t w = 0; w < n; w += L::WORDS) {
+    V free = L::load(s.free + w);
+    V right = L::band(L::toHigher(s.a, w), free);
+    free = L::andNot(free, right);
+    V left = L::band(L::toLower(s.b, w), free);
+    free = L::andNot(free, left);
+
+    L::store(s.right1 + w, right);
+    L::store(s.left1 + w, left);
+    L::store(s.free + w, free);
+    L::store(row.sandBelow + w,
+             L::bor(L::load(row.sandBelow + w), L::bor(right, left)));
+  }
+
+  for (uint32_t w = 0; w < n; w += L::WORDS) {
+    L::store(s.a + w, L::andNot(L::load(s.a + w), L::toLower(s.right1, w)));
+    L::store(s.b + w, L::andNot(L::load(s.b + w), L::toHigher(s.left1, w)));
+  }
+
+  for (uint32_t w = 0; w < n; w += L::WORDS) {
+    V free = L::load(s.free + w);
+    V left = L::band(L::toLower(s.a, w), free);
+    free = L::andNot(free, left);
+    V right = L::band(L::toHigher(s.b, w), free);
+
+    L::store(s.left2 + w, left);
+    L::store(s.right2 + w, right);
+    L::store(row.sandBelow + w,
+             L::bor(L::load(row.sandBelow + w), L::bor(left, right)));
+  }
+
+  for (uint32_t w = 0; w < n; w += L::WORDS) {
+    V stay = L::bor(L::andNot(L::load(s.a + w), L::toHigher(s.left2, w)),
+                    L::andNot(L::load(s.b + w), L::toLower(s.right2, w)));
+    V sand = L::load(row.sand + w);
+
+    L::store(row.vacated + w, L::andNot(sand, stay));
+    L::store(row.sand + w, stay);
+  }
+}
+
+} // namespace
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <config.hpp>
+#include <elementType.hpp>
+
+#include <array>
+#include <cstdint>
+
+class Sim;
+
+// Stepping engine for granular worlds: sand falling between static
+// materials. Every material gets a bitplane of 64 cells per word and the
+// fall / slide rules are resolved for whole rows at once with word-wide
+// bitwise ops, AVX2 or NEON where the CPU has them.
+//
+// The rules are those of Sim (straight down first, then the diagonals in a
+// random order, never into a cell something just left) but resolved per
+// row rather than per cell, so the two engines don't produce the same
+// worlds. All kernels of this engine do, bit for bit, which is what the
+// cross-check in sim_bench relies on.
+class BitboardSim {
+public:
+  enum class Kernel { Scalar, Avx2, Neon };
+
+  BitboardSim(uint32_t width, uint32_t height, Kernel kernel = bestKernel());
+  // Copies the world, seed and tick out of sim. Throws if sim holds a
+  // material other than sand that moves, check with supports() first.
+  explicit BitboardSim(const Sim &sim, Kernel kernel = bestKernel());
+
+  // air, sand and anything static
+  static bool supports(ElementType type);
+  static bool supports(const Sim &sim);
+
+  // the fastest kernel this CPU can run
+  static Kernel bestKernel();
+  static bool kernelAvailable(Kernel kernel);
+  static const char *kernelName(Kernel kernel);
+  Kernel kernel() const { return m_Kernel; }
+
+  void step();
+
+  uint32_t width() const { return m_Width; }
+  uint32_t height() const { return m_Height; }
+
+  void set(uint32_t x, uint32_t y, ElementType type);
+  ElementType get(uint32_t x, uint32_t y) const;
+
+  void setSeed(uint64_t seed) { m_Seed = seed; }
+  uint64_t tick() const { return m_Tick; }
+
+  // the render grid as Sim writes it, one value per cell
+  void writeGrid(tGrid &worldMatrix) const;
+
+  // true if both hold the same cells, for the cross-check
+  bool sameCells(const BitboardSim &other) const;
+
+private:
+  uint64_t *row(ElementType type, uint32_t y) {
+    return m_Planes[static_cast<size_t>(type)].data() + size_t(y) * m_Stride;
+  }
+  const uint64_t *row(ElementType type, uint32_t y) const {
+    return m_Planes[static_cast<size_t>(type)].data() + size_t(y) * m_Stride;
+  }
+
+private:
+  uint32_t m_Width;
+  uint32_t m_Height;
+  // words per row, padded to a whole number of SIMD registers. The padding
+  // bits are blocked so nothing ever moves into them.
+  uint32_t m_Stride;
+  Kernel m_Kernel;
+
+  uint64_t m_Seed = 0;
+  uint64_t m_Tick = 0;
+
+  // one plane per material, air is whatever is left
+  std::array<AlignedVector<uint64_t>, ELEMENT_TYPE_COUNT> m_Planes;
+  // union of the static planes plus the padding
+  AlignedVector<uint64_t> m_Blocked;
+
+  // per row scratch for the kernels, see bitboardKernel.hpp
+  AlignedVector<uint64_t> m_Scratch;
+  AlignedVector<uint64_t> m_Vacated;
+  AlignedVector<uint64_t> m_Preference;
+};
@@ -0,0 +1,43 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+
+const uint32_t CHUNK_SIZE = 32;
+
+// Inclusive bounds in grid coordinates, empty while min > max.
+struct DirtyRect {
+  uint32_t minX = UINT32_MAX;
+  uint32_t minY = UINT32_MAX;
+  uint32_t maxX = 0;
+  uint32_t maxY = 0;
+
+  bool empty() const { return minX > maxX; }
+
+  void include(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    minX = std::min(minX, x0);
+    minY = std::min(minY, y0);
+    maxX = std::max(maxX, x1);
+    maxY = std::max(maxY, y1);
+  }
+};
+
+// A CHUNK_SIZE x CHUNK_SIZE tile of the grid. Only the cells inside m_Rect
+// are visited by Sim::step, a chunk with an empty m_Rect is asleep.
+struct Chunk {
+  // cells to visit this tick
+  DirtyRect m_Rect;
+  // grown by Sim::set, becomes m_Rect at the start of the next tick
+  DirtyRect m_NextRect;
+};
+
+// Range of chunk columns in one chunk row that have work this tick.
+struct ChunkSpan {
+  uint32_t min = UINT32_MAX;
+  uint32_t max = 0;
+
+  bool empty() const { return min > max; }
+  void include(uint32_t column) {
+    min = std::min(min, column);
+    max = std::max(max, column);
+  }
+};
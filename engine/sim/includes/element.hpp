@@ -1,19 +1,23 @@
 #pragma once
 #include <cstdint>
-#include <random>
 #include <stdint.h>
 #include <elementType.hpp>
+#include <rng.hpp>
 
 class Sim;
 
+// A cell as read out of Sim's planes. It doesn't store its position, the
+// coordinates are derived from the index into the material plane.
 class Element {
 public:
-  void step(Sim &sim, std::uniform_int_distribution<std::mt19937::result_type> genBool);
-  void swap(Sim &sim, uint32_t x, uint32_t y, Element &element);
+  // runs the kernel of this cell's material, see material.hpp
+  void step(Sim &sim, uint32_t x, uint32_t y, Rng &rng);
+  void swap(Sim &sim, uint32_t x, uint32_t y, uint32_t targetX,
+            uint32_t targetY, Element &element);
 
 public:
-  uint32_t m_GridX;
-  uint32_t m_GridY;
-  ElementType m_Value;
+  ElementType m_Value = ElementType::Air;
   bool m_HasBeenDisplaced = false;
+  // which way a fluid flows when it can't fall, travels with the cell
+  bool m_FlowsLeft = false;
 };
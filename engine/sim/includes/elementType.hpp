@@ -1,10 +1,20 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
 #include <type_traits>
-enum class ElementType {
+
+// one byte per cell in the material plane, also the index into MATERIALS
+enum class ElementType : uint8_t {
   Air = 0x00,
   Sand = 0x01,
   Water = 0x02,
+  Stone = 0x03,
+  Oil = 0x04,
+  Smoke = 0x05,
 };
 
+const size_t ELEMENT_TYPE_COUNT = 6;
+
 inline ElementType operator | (ElementType lhs, ElementType rhs) {
   using T = std::underlying_type_t<ElementType>;
   return static_cast<ElementType>(static_cast<T>(lhs) | static_cast<T>(rhs));
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <elementType.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <vector>
+
+class Sim;
+
+// Input journals, version 2. Every edit made to a Sim is logged with the
+// tick it went in before, so a run can be stepped again edit for edit.
+// Together with the world seed that makes it reproduce bit for bit.
+//
+//   header   magic "VJNL", version u32, width u32, height u32, seed u64,
+//            start tick u64 (little endian)
+//   records  kind u8, tick delta varint, then per kind, the numbers as
+//            zigzag varints:
+//              Brush   x, y, material u8
+//              Rect    x, y, x1, y1, material u8
+//              Circle  x, y, radius, material u8
+//              Stroke  x, y, x1, y1, radius, material u8
+//              Fill    x, y, material u8
+//              End     nothing, the tick is where the run stopped
+//
+// Version 1 only had Brush and End, it's read the same. A journal that was
+// cut off before its End record ends at its last edit.
+
+struct JournalEdit {
+  // the Sim call it was
+  enum class Shape : uint8_t {
+    Brush,
+    Rect,
+    Circle,
+    Stroke,
+    Fill,
+  };
+
+  uint64_t tick = 0;
+  Shape shape = Shape::Brush;
+  int64_t x = 0;
+  int64_t y = 0;
+  // the other corner or end, Rect and Stroke
+  int64_t x1 = 0;
+  int64_t y1 = 0;
+  // Circle and Stroke
+  int64_t radius = 0;
+  ElementType type = ElementType::Air;
+};
+
+class JournalWriter {
+public:
+  // the journal starts at sim's current tick, with its seed and size
+  JournalWriter(const std::filesystem::path &path, const Sim &sim);
+  // writes the End record at the last tick seen
+  ~JournalWriter();
+
+  JournalWriter(const JournalWriter &) = delete;
+  JournalWriter &operator=(const JournalWriter &) = delete;
+
+  // a Sim::brush call made before tick was stepped
+  void brush(uint64_t tick, int64_t x, int64_t y, ElementType type);
+  // the same for the other edits
+  void fillRect(uint64_t tick, int64_t x0, int64_t y0, int64_t x1, int64_t y1,
+                ElementType type);
+  void fillCircle(uint64_t tick, int64_t x, int64_t y, int64_t radius,
+                  ElementType type);
+  void stroke(uint64_t tick, int64_t x0, int64_t y0, int64_t x1, int64_t y1,
+              int64_t radius, ElementType type);
+  void floodFill(uint64_t tick, int64_t x, int64_t y, ElementType type);
+  void finish(uint64_t tick);
+
+private:
+  void record(uint8_t kind, uint64_t tick);
+  void putVarint(uint64_t value);
+  void putCoordinate(int64_t value);
+
+private:
+  std::ofstream m_File;
+  uint64_t m_LastTick;
+  bool m_Finished = false;
+};
+
+class Journal {
+public:
+  // reads the whole journal, throws if it isn't one
+  explicit Journal(const std::filesystem::path &path);
+
+  uint32_t width() const { return m_Width; }
+  uint32_t height() const { return m_Height; }
+  uint64_t seed() const { return m_Seed; }
+  uint64_t startTick() const { return m_StartTick; }
+  uint64_t endTick() const { return m_EndTick; }
+  // in tick order
+  const std::vector<JournalEdit> &edits() const { return m_Edits; }
+
+  // Runs sim from startTick to endTick, putting every edit in before its
+  // tick. step has to step sim once, it's there so the caller can time or
+  // slice the steps. sim has to be at startTick with the journal's seed and
+  // size.
+  void replay(Sim &sim, const std::function<void(Sim &)> &step) const;
+  // makes the Sim call edit was
+  static void apply(Sim &sim, const JournalEdit &edit);
+
+private:
+  uint32_t m_Width = 0;
+  uint32_t m_Height = 0;
+  uint64_t m_Seed = 0;
+  uint64_t m_StartTick = 0;
+  uint64_t m_EndTick = 0;
+  std::vector<JournalEdit> m_Edits;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <config.hpp>
+
+#include <array>
+#include <cstdint>
+
+// Block-partitioned (Margolus) update: every tick the grid is cut into 2x2
+// blocks, shifted by one cell on odd ticks, and every block is rewritten on
+// its own. No block reads another one, so the GPU steps them all at once.
+//
+// This is the CPU reference of res/shaders/margolus.comp, it works on the
+// same cells the shader does and the two have to agree bit for bit. Change
+// one, change the other. The rules don't match Sim's, a cell moves at most
+// one cell a tick and only inside its block.
+
+// Materials as the shader sees them, packed one per uint:
+// density | static << 8 | fluid << 9 | rises << 10
+const uint32_t MARGOLUS_MATERIAL_SLOTS = 8;
+const uint32_t MARGOLUS_STATIC = 1u << 8;
+const uint32_t MARGOLUS_FLUID = 1u << 9;
+const uint32_t MARGOLUS_RISES = 1u << 10;
+
+// the shader's push constants, std430
+struct MargolusParams {
+  uint32_t width;
+  uint32_t height;
+  uint32_t tick;
+  uint32_t seed;
+  uint32_t materials[MARGOLUS_MATERIAL_SLOTS];
+};
+
+// blocks per row / column to cover the grid on either offset
+inline uint32_t margolusBlocks(uint32_t size) { return size / 2 + 1; }
+
+// packed from MATERIALS, unused slots are static
+std::array<uint32_t, MARGOLUS_MATERIAL_SLOTS> margolusMaterials();
+
+MargolusParams margolusParams(uint32_t width, uint32_t height, uint32_t tick,
+                              uint32_t seed);
+
+// lowbias32, plain 32 bit maths so GLSL gets the same numbers
+inline uint32_t margolusHash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+// one tick over the whole grid, cells.size() has to be width * height
+void stepMargolus(tGrid &cells, const MargolusParams &params);
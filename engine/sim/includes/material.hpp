@@ -0,0 +1,65 @@
+#pragma once
+#include <elementType.hpp>
+#include <rng.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+class Sim;
+class Element;
+
+enum MaterialFlags : uint8_t {
+  // never moves and nothing moves into it
+  MATERIAL_STATIC = 1 << 0,
+  // flows sideways once it can't fall (or rise) any further, the direction
+  // it flows in is kept per cell
+  MATERIAL_FLUID = 1 << 1,
+};
+
+// Moves one cell of a material. nullptr for materials that never move, those
+// cells are skipped without being read.
+typedef void (*MaterialKernel)(Sim &sim, uint32_t x, uint32_t y,
+                               Element &element, Rng &rng);
+
+struct MoveOffset {
+  int8_t dx;
+  int8_t dy;
+};
+
+struct Material {
+  const char *name;
+  // cells only move into lighter cells, or heavier ones if they rise
+  uint8_t density;
+  uint8_t flags;
+  // -1 falls, 1 rises
+  int8_t gravity;
+  // tried in order before any sideways flow, dx is mirrored by a coin flip
+  // every step so piles don't lean
+  uint8_t moveCount;
+  MoveOffset moves[3];
+  MaterialKernel kernel;
+};
+
+// Defined in element.cpp, one specialisation per material. Everything it
+// reads from the table below is a constant there, so each one compiles down
+// to its own straight-line rule.
+template <ElementType Type>
+void stepMaterial(Sim &sim, uint32_t x, uint32_t y, Element &element, Rng &rng);
+
+// indexed by ElementType
+inline constexpr Material MATERIALS[ELEMENT_TYPE_COUNT] = {
+    {"air", 10, 0, 0, 0, {}, nullptr},
+    {"sand", 160, 0, -1, 3, {{0, -1}, {1, -1}, {-1, -1}},
+     stepMaterial<ElementType::Sand>},
+    {"water", 100, MATERIAL_FLUID, -1, 3, {{0, -1}, {1, -1}, {-1, -1}},
+     stepMaterial<ElementType::Water>},
+    {"stone", 255, MATERIAL_STATIC, 0, 0, {}, nullptr},
+    {"oil", 80, MATERIAL_FLUID, -1, 3, {{0, -1}, {1, -1}, {-1, -1}},
+     stepMaterial<ElementType::Oil>},
+    {"smoke", 1, MATERIAL_FLUID, 1, 3, {{0, 1}, {1, 1}, {-1, 1}},
+     stepMaterial<ElementType::Smoke>},
+};
+
+inline const Material &materialOf(ElementType type) {
+  return MATERIALS[static_cast<size_t>(type)];
+}
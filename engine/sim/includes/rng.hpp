@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+
+// splitmix64 finaliser, spreads a counter over all 64 bits
+inline uint64_t mix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+// xorshift64*, a few instructions per number. Sim gives every chunk its
+// own stream keyed on (world seed, tick, chunk), so what a chunk draws
+// doesn't depend on which thread steps it.
+class Rng {
+public:
+  explicit Rng(uint64_t seed = 0) : m_State(mix64(seed) | 1) {}
+
+  Rng(uint64_t seed, uint64_t tick, uint64_t stream)
+      : Rng(mix64(mix64(seed) ^ tick) ^ stream) {}
+
+  uint64_t next() {
+    m_State ^= m_State >> 12;
+    m_State ^= m_State << 25;
+    m_State ^= m_State >> 27;
+    return m_State * 0x2545f4914f6cdd1dull;
+  }
+
+  bool nextBool() { return next() >> 63; }
+
+private:
+  uint64_t m_State;
+};
@@ -1,26 +1,280 @@
 #pragma once
 
+#include <chunk.hpp>
 #include <config.hpp>
 #include <element.hpp>
+#include <rng.hpp>
+#include <workerPool.hpp>
 
 #include <array>
+#include <chrono>
 #include <cstdint>
+#include <memory>
 #include <optional>
+#include <utility>
+#include <vector>
+
+class Snapshot;
+struct ChunkPlanes;
+struct WorldImage;
+
+// what one material's cells did in a tick
+struct MaterialActivity {
+  // cells of it inside the awake rects
+  uint64_t visited = 0;
+  // moved into air
+  uint64_t moved = 0;
+  // traded places with another material, e.g. sand sinking through water
+  uint64_t swapped = 0;
+  // visited but never read past the material, it has no kernel
+  uint64_t skipped = 0;
+};
+
+struct SimStats {
+  // ticks taken when these were gathered
+  uint64_t tick = 0;
+  // live cells of every material, kept up to date by each write
+  std::array<uint64_t, ELEMENT_TYPE_COUNT> census{};
+  // the last tick, indexed by ElementType
+  std::array<MaterialActivity, ELEMENT_TYPE_COUNT> activity{};
+  MaterialActivity total;
+
+  uint32_t activeChunks = 0;
+  uint32_t chunkCount = 0;
+  // awake chunks out of all of them and visited cells out of all of them,
+  // the last tick
+  double chunkActivity = 0.0;
+  double cellActivity = 0.0;
+};
 
 class Sim {
 public:
-  Sim(tGrid &worldMatrix);
+  // worldMatrix is resized to width * height
+  Sim(tGrid &worldMatrix, uint32_t width = DEFAULT_GRID_SIZE_X,
+      uint32_t height = DEFAULT_GRID_SIZE_Y, uint32_t threadCount = 1);
   void step();
+  // Steps until the tick is done or the deadline passes, whichever comes
+  // first. Returns true once the tick is complete, otherwise the next call
+  // carries on where this one stopped. The grid mustn't be edited while a
+  // tick is in progress.
+  bool stepFor(std::chrono::steady_clock::time_point deadline);
+  bool stepInProgress() const { return m_StepInProgress; }
+
+  uint32_t width() const { return m_Width; }
+  uint32_t height() const { return m_Height; }
 
   void set(uint32_t x, uint32_t y, Element &elem);
   void set(uint32_t x, uint32_t y, ElementType type);
 
-  bool insideBounds(uint32_t x, uint32_t y);
-  std::optional<Element> get(uint32_t x, uint32_t y);
+  // these two are on the hot path of Element::step, keep them inline
+  bool insideBounds(uint32_t x, uint32_t y) const {
+    return x < m_Width && y < m_Height;
+  }
+  std::optional<Element> get(uint32_t x, uint32_t y) const {
+    if (insideBounds(x, y)) {
+      return Element{m_Materials[size_t(y) * m_Width + x], isDisplaced(x, y),
+                     flowsLeft(x, y)};
+    }
+    return std::nullopt;
+  }
+
+  // unchecked, callers test insideBounds first
+  ElementType materialAt(uint32_t x, uint32_t y) const {
+    return m_Materials[size_t(y) * m_Width + x];
+  }
+  bool isDisplaced(uint32_t x, uint32_t y) const {
+    return testBit(m_Displaced, x, y);
+  }
+  bool flowsLeft(uint32_t x, uint32_t y) const {
+    return testBit(m_FlowsLeft, x, y);
+  }
 
   void mouse(double xpos, double ypos, bool sink = false);
+  // the grid cell under a window position
+  std::pair<int64_t, int64_t> windowToGrid(double xpos, double ypos) const;
+  // half the size of the mouse's square brush
+  static constexpr int64_t BRUSH_RADIUS = 3;
+  // fills the 7x7 square around (x, y), clipped to the grid
+  void brush(int64_t x, int64_t y, ElementType type);
+
+  // Edits by the shape, between ticks only. Each one is clipped to the grid
+  // once and written a row span at a time, the chunks a span touches are
+  // woken in one go. Coordinates may lie outside the grid. The world ends up
+  // the same as with set() on every cell covered.
+  //
+  // corners inclusive, in any order
+  void fillRect(int64_t x0, int64_t y0, int64_t x1, int64_t y1,
+                ElementType type);
+  // the cells no further than radius from (x, y)
+  void fillCircle(int64_t x, int64_t y, int64_t radius, ElementType type);
+  // The square brush of half size radius dragged from (x0, y0) to (x1, y1),
+  // every cell it passes over, what a drag between two cursor samples
+  // covers. With both ends the same it's brush().
+  void stroke(int64_t x0, int64_t y0, int64_t x1, int64_t y1, int64_t radius,
+              ElementType type);
+  // The 4-connected region of the material at (x, y), returns the cells
+  // written. Nothing if it's type already.
+  size_t floodFill(int64_t x, int64_t y, ElementType type);
+
+  // Threads used by step(), including the caller. The result of a step
+  // doesn't depend on it.
+  void setThreadCount(uint32_t threadCount);
+  uint32_t threadCount() const { return m_Pool->threadCount(); }
+
+  // Every random choice in a step comes from this seed and the tick count,
+  // the same seed and edits replay bit for bit.
+  void setSeed(uint64_t seed) { m_Seed = seed; }
+  uint64_t seed() const { return m_Seed; }
+  // steps taken so far
+  uint64_t tick() const { return m_Tick; }
+
+  // number of chunks that were awake during the last step
+  size_t activeChunkCount() const { return m_ActiveChunks.size(); }
+
+  // Counters of the last finished tick and the current census, between
+  // ticks only. Workers count into their own StepContext, they're added up
+  // once a tick is through.
+  const SimStats &stats() const { return m_Stats; }
+  // Element::swap, a cell of mover traded places with one of target
+  void countSwap(ElementType mover, ElementType target);
+  // a kernel's cell that didn't move but has to be visited next tick
+  void keepAwake(uint32_t x, uint32_t y) { markDirty(x, y); }
+
+  // Appends a rect per chunk covering every cell written since the last
+  // call, between ticks only. Returns false if the whole world has to be
+  // taken as changed, e.g. after restore().
+  bool takeDirtyRects(std::vector<DirtyRect> &rects);
+
+  // Copy of the world for saving, only valid between ticks. Chunks that
+  // haven't changed since the last capture are shared with it instead of
+  // copied, so this costs about as much as the chunks stepped since.
+  std::shared_ptr<const WorldImage> capture();
+  // Replaces the world, seed and tick with a snapshot of the same size.
+  // Chunks are decoded in parallel on the step threads, a corrupt one throws
+  // with the world half restored.
+  void restore(const Snapshot &snapshot);
+
+private:
+  // Chunks are stepped in four checkerboard phases. Chunks of one phase are
+  // a whole chunk apart, nothing one of them reads or writes (its own cells
+  // plus a 1 cell border) can overlap another's, so they run in parallel.
+  uint32_t phaseOf(uint32_t chunk) const {
+    return ((chunk / m_ChunksX) & 1) * 2 + ((chunk % m_ChunksX) & 1);
+  }
+
+  // a dirty rect for another chunk, queued while that chunk may be shared
+  struct DirtyMark {
+    uint32_t chunk;
+    DirtyRect rect;
+    bool current;
+  };
+
+  // per worker state while stepping a chunk
+  struct StepContext {
+    uint32_t chunk = 0;
+    uint32_t phase = 0;
+    uint32_t scanX = 0;
+    uint32_t scanY = 0;
+    // direction of the row being scanned
+    bool scanLeft = false;
+    std::vector<DirtyMark> marks;
+    // chunks whose m_NextRect this worker took from empty
+    std::vector<uint32_t> woken;
+    // reseeded for every chunk
+    Rng rng;
+    // this tick's counts so far, see mergeStats
+    std::array<MaterialActivity, ELEMENT_TYPE_COUNT> activity{};
+    std::array<int64_t, ELEMENT_TYPE_COUNT> census{};
+  };
+
+  void beginStep();
+  void markDirty(uint32_t x, uint32_t y);
+  void wakeChunk(uint32_t chunk, const DirtyRect &rect, bool current);
+  void stepChunk(uint32_t chunk, StepContext &context);
+  void stepCell(uint32_t x, uint32_t y, StepContext &context);
+  void applyMarks();
+  // adds the workers' counts up at the end of a tick
+  void mergeStats();
+  void recount();
+  void countWrite(ElementType before, ElementType after);
+
+  void addWritten(uint32_t chunk, const DirtyRect &rect);
+  // Sim::set(x, y, type) on x0..x1 of row y, inside the grid. Wakes the
+  // chunks around the span once instead of per cell, between ticks only.
+  void writeSpan(uint32_t y, uint32_t x0, uint32_t x1, ElementType type);
+  // same, clipped to the grid first
+  void fillRow(int64_t y, int64_t x0, int64_t x1, ElementType type);
+
+  void readChunk(uint32_t chunk, ChunkPlanes &planes) const;
+  void writeChunk(uint32_t chunk, const ChunkPlanes &planes);
+
+  bool testBit(const AlignedVector<uint8_t> &plane, uint32_t x,
+               uint32_t y) const {
+    size_t word = size_t(y) * m_BitplaneStride + (x >> 3);
+    return (plane[word] >> (x & 7)) & 1;
+  }
+  void writeBit(AlignedVector<uint8_t> &plane, uint32_t x, uint32_t y,
+                bool value) {
+    uint8_t shift = x & 7;
+    uint8_t &word = plane[size_t(y) * m_BitplaneStride + (x >> 3)];
+    word = uint8_t((word & ~(1u << shift)) | (uint32_t(value) << shift));
+  }
+
+  void setDisplaced(uint32_t x, uint32_t y, bool displaced) {
+    writeBit(m_Displaced, x, y, displaced);
+  }
 
 private:
+  // set while a thread is inside stepChunk
+  static thread_local StepContext *s_Context;
+
   tGrid &m_WorldMatrix;
-  std::array<Element, GRID_SIZE_Y * GRID_SIZE_X> m_ElementsMatrix;
+
+  uint64_t m_Seed = 0;
+  uint64_t m_Tick = 0;
+
+  // where a sliced step left off
+  bool m_StepInProgress = false;
+  uint32_t m_Phase = 0;
+  uint32_t m_PhaseCursor = 0;
+
+  uint32_t m_Width;
+  uint32_t m_Height;
+  uint32_t m_ChunksX;
+  uint32_t m_ChunksY;
+  // bytes per row of the bitplanes
+  uint32_t m_BitplaneStride;
+
+  // Structure of arrays, one byte of material per cell plus one bit each of
+  // m_HasBeenDisplaced and m_FlowsLeft. Positions are implied by the index
+  // (y * W + x). The bitplanes use byte words and start every row on a new
+  // byte, the cells two parallel chunks can write then never share a memory
+  // location.
+  AlignedVector<ElementType> m_Materials;
+  AlignedVector<uint8_t> m_Displaced;
+  AlignedVector<uint8_t> m_FlowsLeft;
+  // m_FlowsLeft as set() leaves every cell, written spans copy it
+  AlignedVector<uint8_t> m_FlowSeeds;
+
+  std::vector<Chunk> m_Chunks;
+  // chunks with a non-empty m_Rect / m_NextRect, so waking and retiring
+  // them never has to walk the whole chunk array
+  std::vector<uint32_t> m_ActiveChunks;
+  std::vector<uint32_t> m_NextActiveChunks;
+  std::vector<uint32_t> m_PhaseChunks;
+
+  std::unique_ptr<WorkerPool> m_Pool;
+  std::vector<StepContext> m_Contexts;
+
+  // last capture and the chunks that changed since, set for every chunk
+  // that gets woken
+  std::shared_ptr<const WorldImage> m_LastImage;
+  std::vector<uint8_t> m_ChunkChanged;
+
+  // cells written since the last takeDirtyRects, per chunk
+  std::vector<DirtyRect> m_Written;
+  std::vector<uint32_t> m_WrittenChunks;
+  bool m_WrittenAll = true;
+
+  SimStats m_Stats;
 };
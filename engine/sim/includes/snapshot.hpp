@@ -0,0 +1,142 @@
+#pragma once
+
+#include <chunk.hpp>
+#include <elementType.hpp>
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// World snapshots on disk, version 1. Everything is little endian.
+//
+//   header   magic "VSNP", version, width, height, chunk size, chunk count,
+//            seed, tick
+//   index    one entry per chunk, row-major from the bottom row up:
+//            offset u64, size u32, wake rect u8[4]
+//   payload  per chunk, the material plane then the displaced and flowsLeft
+//            bitplanes, each as an encoding byte and its data
+//
+// A chunk that's one material with the same bits throughout has size 0, the
+// offset holds the value instead (material | displaced << 8 | flowsLeft << 9).
+// The wake rect is the chunk's m_NextRect in chunk coordinates, 0xff for a
+// sleeping chunk, so a restored world carries on exactly where it was saved.
+
+static_assert(CHUNK_SIZE == 32, "snapshot bit rows are one uint32 per row");
+
+// One chunk's cells. Cells past the edge of the world are air.
+struct ChunkPlanes {
+  std::array<ElementType, CHUNK_SIZE * CHUNK_SIZE> materials{};
+  // one row of CHUNK_SIZE bits each, bit x is cell x
+  std::array<uint32_t, CHUNK_SIZE> displaced{};
+  std::array<uint32_t, CHUNK_SIZE> flowsLeft{};
+};
+
+// An immutable copy of a world, the chunks are shared between copies.
+// Sim::capture only copies the chunks that changed since its last capture,
+// everything else points at the same ChunkPlanes as before.
+struct WorldImage {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t chunksX = 0;
+  uint32_t chunksY = 0;
+  uint64_t seed = 0;
+  uint64_t tick = 0;
+
+  std::vector<std::shared_ptr<const ChunkPlanes>> chunks;
+  // m_NextRect of every chunk, in grid coordinates
+  std::vector<DirtyRect> wake;
+};
+
+// Writes image to path, through a temporary file that replaces path once
+// it's complete.
+void writeSnapshot(const WorldImage &image, const std::filesystem::path &path);
+
+// A snapshot file mapped into memory. Opening only checks the header and the
+// index, a chunk's data is read and decoded when it's asked for.
+class Snapshot {
+public:
+  explicit Snapshot(const std::filesystem::path &path);
+  ~Snapshot();
+
+  Snapshot(const Snapshot &) = delete;
+  Snapshot &operator=(const Snapshot &) = delete;
+
+  uint32_t width() const { return m_Width; }
+  uint32_t height() const { return m_Height; }
+  uint32_t chunksX() const { return m_ChunksX; }
+  uint32_t chunksY() const { return m_ChunksY; }
+  uint32_t chunkCount() const { return m_ChunksX * m_ChunksY; }
+  uint64_t seed() const { return m_Seed; }
+  uint64_t tick() const { return m_Tick; }
+  // bytes on disk
+  size_t size() const { return m_Size; }
+
+  // Decodes one chunk, safe to call from several threads at once. Throws on
+  // a corrupt chunk.
+  void decodeChunk(uint32_t chunk, ChunkPlanes &planes) const;
+  // the chunk's wake rect in grid coordinates, empty if it was asleep
+  DirtyRect chunkWake(uint32_t chunk) const;
+
+private:
+  const uint8_t *indexEntry(uint32_t chunk) const;
+  void unmap();
+
+private:
+  const uint8_t *m_Data = nullptr;
+  size_t m_Size = 0;
+#ifdef _WIN32
+  void *m_File = nullptr;
+  void *m_Mapping = nullptr;
+#endif
+
+  uint32_t m_Width = 0;
+  uint32_t m_Height = 0;
+  uint32_t m_ChunksX = 0;
+  uint32_t m_ChunksY = 0;
+  uint64_t m_Seed = 0;
+  uint64_t m_Tick = 0;
+};
+
+// Writes snapshots on a thread of its own, the caller only pays for the
+// capture. A save queued while another one is still waiting replaces it.
+class SnapshotWriter {
+public:
+  SnapshotWriter();
+  // finishes the save in progress and the queued one
+  ~SnapshotWriter();
+
+  SnapshotWriter(const SnapshotWriter &) = delete;
+  SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+  void save(std::shared_ptr<const WorldImage> image,
+            const std::filesystem::path &path);
+  // blocks until nothing is queued or being written
+  void wait();
+
+  uint64_t completed();
+  // empty unless the last save failed
+  std::string lastError();
+
+private:
+  void run();
+
+private:
+  std::mutex m_Mutex;
+  std::condition_variable m_Wake;
+  std::condition_variable m_Idle;
+
+  std::shared_ptr<const WorldImage> m_Pending;
+  std::filesystem::path m_PendingPath;
+  bool m_Writing = false;
+  bool m_Stop = false;
+  uint64_t m_Completed = 0;
+  std::string m_LastError;
+
+  std::thread m_Thread;
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent threads for Sim::step, so a tick doesn't pay for spawning
+// threads four times over.
+class WorkerPool {
+public:
+  // threadCount includes the calling thread, 1 runs everything inline
+  explicit WorkerPool(uint32_t threadCount = 1);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  uint32_t threadCount() const {
+    return static_cast<uint32_t>(m_Threads.size()) + 1;
+  }
+
+  // Calls task(index, worker) for every index in [0, count) and returns once
+  // all of them are done. The calling thread takes part as worker 0.
+  void run(uint32_t count,
+           const std::function<void(uint32_t, uint32_t)> &task);
+
+private:
+  void workerLoop(uint32_t worker);
+  void drain(uint32_t worker);
+
+private:
+  std::vector<std::thread> m_Threads;
+
+  std::mutex m_Mutex;
+  std::condition_variable m_Wake;
+  std::condition_variable m_Done;
+
+  const std::function<void(uint32_t, uint32_t)> *m_Task = nullptr;
+  uint32_t m_Count = 0;
+  std::atomic<uint32_t> m_Next{0};
+  // threads that haven't finished the current job yet
+  uint32_t m_Busy = 0;
+  uint64_t m_Generation = 0;
+  bool m_Quit = false;
+};
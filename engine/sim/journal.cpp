@@ -0,0 +1,270 @@
+#include <journal.hpp>
+#include <sim.hpp>
+
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+namespace {
+
+const char MAGIC[4] = {'V', 'J', 'N', 'L'};
+const uint32_t VERSION = 2;
+const size_t HEADER_SIZE = 32;
+
+enum Record : uint8_t {
+  End = 0,
+  Brush = 1,
+  Rect = 2,
+  Circle = 3,
+  Stroke = 4,
+  Fill = 5,
+};
+
+uint64_t zigzag(int64_t value) {
+  return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+  return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+uint64_t getLE(const uint8_t *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; ++i)
+    value |= uint64_t(in[i]) << (8 * i);
+  return value;
+}
+
+// reads past the end throw, a half written record is where the journal ends
+struct Reader {
+  const uint8_t *in;
+  const uint8_t *end;
+
+  bool done() const { return in == end; }
+
+  uint8_t byte() {
+    if (in == end)
+      throw std::out_of_range("[Journal]: Record is cut off.");
+    return *in++;
+  }
+
+  uint64_t varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t b = byte();
+      value |= uint64_t(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return value;
+    }
+    throw std::runtime_error("[Journal]: Varint is too long!");
+  }
+
+  int64_t coordinate() { return unzigzag(varint()); }
+
+  ElementType material() {
+    ElementType type = static_cast<ElementType>(byte());
+    if (static_cast<size_t>(type) >= ELEMENT_TYPE_COUNT) {
+      throw std::runtime_error("[Journal]: Unknown material!");
+    }
+    return type;
+  }
+};
+
+} // namespace
+
+JournalWriter::JournalWriter(const std::filesystem::path &path,
+                             const Sim &sim)
+    : m_File(path, std::ios::binary | std::ios::trunc),
+      m_LastTick(sim.tick()) {
+  if (!m_File) {
+    throw std::runtime_error("[Journal]: Failed to open " + path.string());
+  }
+
+  uint8_t header[HEADER_SIZE];
+  std::memcpy(header, MAGIC, 4);
+  auto putLE = [&](size_t at, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i)
+      header[at + i] = uint8_t(value >> (8 * i));
+  };
+  putLE(4, VERSION, 4);
+  putLE(8, sim.width(), 4);
+  putLE(12, sim.height(), 4);
+  putLE(16, sim.seed(), 8);
+  putLE(24, sim.tick(), 8);
+  m_File.write(reinterpret_cast<const char *>(header), HEADER_SIZE);
+}
+
+JournalWriter::~JournalWriter() {
+  if (!m_Finished)
+    finish(m_LastTick);
+}
+
+void JournalWriter::putVarint(uint64_t value) {
+  while (value >= 0x80) {
+    m_File.put(char(uint8_t(value) | 0x80));
+    value >>= 7;
+  }
+  m_File.put(char(value));
+}
+
+void JournalWriter::putCoordinate(int64_t value) { putVarint(zigzag(value)); }
+
+void JournalWriter::record(uint8_t kind, uint64_t tick) {
+  if (m_Finished)
+    throw std::logic_error("[Journal]: Journal is already finished.");
+  if (tick < m_LastTick)
+    throw std::invalid_argument("[Journal]: Ticks have to go forward.");
+
+  m_File.put(char(kind));
+  putVarint(tick - m_LastTick);
+  m_LastTick = tick;
+}
+
+void JournalWriter::brush(uint64_t tick, int64_t x, int64_t y,
+                          ElementType type) {
+  record(Brush, tick);
+  putCoordinate(x);
+  putCoordinate(y);
+  m_File.put(char(type));
+}
+
+void JournalWriter::fillRect(uint64_t tick, int64_t x0, int64_t y0,
+                             int64_t x1, int64_t y1, ElementType type) {
+  record(Rect, tick);
+  putCoordinate(x0);
+  putCoordinate(y0);
+  putCoordinate(x1);
+  putCoordinate(y1);
+  m_File.put(char(type));
+}
+
+void JournalWriter::fillCircle(uint64_t tick, int64_t x, int64_t y,
+                               int64_t radius, ElementType type) {
+  record(Circle, tick);
+  putCoordinate(x);
+  putCoordinate(y);
+  putCoordinate(radius);
+  m_File.put(char(type));
+}
+
+void JournalWriter::stroke(uint64_t tick, int64_t x0, int64_t y0, int64_t x1,
+                           int64_t y1, int64_t radius, ElementType type) {
+  record(Stroke, tick);
+  putCoordinate(x0);
+  putCoordinate(y0);
+  putCoordinate(x1);
+  putCoordinate(y1);
+  putCoordinate(radius);
+  m_File.put(char(type));
+}
+
+void JournalWriter::floodFill(uint64_t tick, int64_t x, int64_t y,
+                              ElementType type) {
+  record(Fill, tick);
+  putCoordinate(x);
+  putCoordinate(y);
+  m_File.put(char(type));
+}
+
+void JournalWriter::finish(uint64_t tick) {
+  record(End, tick);
+  m_Finished = true;
+  m_File.flush();
+}
+
+Journal::Journal(const std::filesystem::path &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("[Journal]: Failed to open " + path.string());
+  }
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+
+  if (data.size() < HEADER_SIZE || std::memcmp(data.data(), MAGIC, 4) != 0) {
+    throw std::runtime_error("[Journal]: Not an input journal: " +
+                             path.string());
+  }
+  uint32_t version = uint32_t(getLE(&data[4], 4));
+  if (version < 1 || version > VERSION) {
+    throw std::runtime_error("[Journal]: Unsupported journal version!");
+  }
+  m_Width = uint32_t(getLE(&data[8], 4));
+  m_Height = uint32_t(getLE(&data[12], 4));
+  m_Seed = getLE(&data[16], 8);
+  m_StartTick = getLE(&data[24], 8);
+  m_EndTick = m_StartTick;
+
+  Reader reader{data.data() + HEADER_SIZE, data.data() + data.size()};
+  uint64_t tick = m_StartTick;
+  try {
+    while (!reader.done()) {
+      uint8_t kind = reader.byte();
+      tick += reader.varint();
+
+      if (kind == End) {
+        m_EndTick = tick;
+        return;
+      }
+      if (kind > Fill || (version == 1 && kind != Brush)) {
+        throw std::runtime_error("[Journal]: Unknown record kind!");
+      }
+
+      JournalEdit edit;
+      edit.tick = tick;
+      edit.shape = static_cast<JournalEdit::Shape>(kind - Brush);
+      edit.x = reader.coordinate();
+      edit.y = reader.coordinate();
+      if (kind == Rect || kind == Stroke) {
+        edit.x1 = reader.coordinate();
+        edit.y1 = reader.coordinate();
+      }
+      if (kind == Circle || kind == Stroke) {
+        edit.radius = reader.coordinate();
+      }
+      edit.type = reader.material();
+      m_Edits.push_back(edit);
+      m_EndTick = tick;
+    }
+  } catch (const std::out_of_range &) {
+    // cut off mid record, keep what came before it
+  }
+}
+
+void Journal::replay(Sim &sim,
+                     const std::function<void(Sim &)> &step) const {
+  if (sim.width() != m_Width || sim.height() != m_Height ||
+      sim.seed() != m_Seed || sim.tick() != m_StartTick) {
+    throw std::invalid_argument(
+        "[Journal]: Sim doesn't match the journal's start.");
+  }
+
+  auto edit = m_Edits.begin();
+  while (true) {
+    for (; edit != m_Edits.end() && edit->tick == sim.tick(); ++edit) {
+      apply(sim, *edit);
+    }
+    if (sim.tick() >= m_EndTick)
+      break;
+    step(sim);
+  }
+}
+
+void Journal::apply(Sim &sim, const JournalEdit &edit) {
+  switch (edit.shape) {
+  case JournalEdit::Shape::Brush:
+    sim.brush(edit.x, edit.y, edit.type);
+    break;
+  case JournalEdit::Shape::Rect:
+    sim.fillRect(edit.x, edit.y, edit.x1, edit.y1, edit.type);
+    break;
+  case JournalEdit::Shape::Circle:
+    sim.fillCircle(edit.x, edit.y, edit.radius, edit.type);
+    break;
+  case JournalEdit::Shape::Stroke:
+    sim.stroke(edit.x, edit.y, edit.x1, edit.y1, edit.radius, edit.type);
+    break;
+  case JournalEdit::Shape::Fill:
+    sim.floodFill(edit.x, edit.y, edit.type);
+    break;
+  }
+}
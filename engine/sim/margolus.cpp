@@ -0,0 +1,135 @@
+#include <margolus.hpp>
+#include <material.hpp>
+
+#include <utility>
+
+namespace {
+
+// stands in for cells past the edge of the grid, never moves
+const uint32_t OUTSIDE = 0xff;
+
+struct Block {
+  // 0 bottom left, 1 bottom right, 2 top left, 3 top right
+  uint32_t cells[4];
+  uint32_t info[4];
+};
+
+uint32_t density(uint32_t info) { return info & 0xff; }
+bool movable(uint32_t info) { return !(info & MARGOLUS_STATIC); }
+
+// swaps a and b if a is heavier, a being the upper one of the two
+bool settle(Block &block, int a, int b) {
+  if (movable(block.info[a]) && movable(block.info[b]) &&
+      density(block.info[a]) > density(block.info[b])) {
+    std::swap(block.cells[a], block.cells[b]);
+    std::swap(block.info[a], block.info[b]);
+    return true;
+  }
+  return false;
+}
+
+// a fluid spreading sideways into a cell it would fall (or rise) into
+bool flowsInto(uint32_t from, uint32_t to) {
+  if (!(from & MARGOLUS_FLUID))
+    return false;
+  return (from & MARGOLUS_RISES) ? density(from) < density(to)
+                                 : density(from) > density(to);
+}
+
+void flow(Block &block, int a, int b) {
+  uint32_t infoA = block.info[a];
+  uint32_t infoB = block.info[b];
+  if (movable(infoA) && movable(infoB) &&
+      (flowsInto(infoA, infoB) || flowsInto(infoB, infoA))) {
+    std::swap(block.cells[a], block.cells[b]);
+    std::swap(block.info[a], block.info[b]);
+  }
+}
+
+// The whole rule, mirrored line for line in margolus.comp.
+void stepBlock(Block &block, uint32_t random) {
+  // straight down (or up, for what's lighter than air) in both columns
+  bool moved = settle(block, 2, 0);
+  moved |= settle(block, 3, 1);
+
+  // then the diagonals, in a random order
+  if (random & 1) {
+    moved |= settle(block, 3, 0);
+    moved |= settle(block, 2, 1);
+  } else {
+    moved |= settle(block, 2, 1);
+    moved |= settle(block, 3, 0);
+  }
+
+  // fluids spread sideways once nothing in the block fell
+  if (!moved) {
+    if (random & 2)
+      flow(block, 0, 1);
+    if (random & 4)
+      flow(block, 2, 3);
+  }
+}
+
+} // namespace
+
+std::array<uint32_t, MARGOLUS_MATERIAL_SLOTS> margolusMaterials() {
+  static_assert(ELEMENT_TYPE_COUNT <= MARGOLUS_MATERIAL_SLOTS,
+                "margolus.comp has no room for more materials");
+
+  std::array<uint32_t, MARGOLUS_MATERIAL_SLOTS> packed;
+  packed.fill(0xff | MARGOLUS_STATIC);
+  for (size_t i = 0; i < ELEMENT_TYPE_COUNT; ++i) {
+    const Material &material = MATERIALS[i];
+    packed[i] = material.density;
+    if (material.flags & MATERIAL_STATIC)
+      packed[i] |= MARGOLUS_STATIC;
+    if (material.flags & MATERIAL_FLUID)
+      packed[i] |= MARGOLUS_FLUID;
+    if (material.gravity > 0)
+      packed[i] |= MARGOLUS_RISES;
+  }
+  return packed;
+}
+
+MargolusParams margolusParams(uint32_t width, uint32_t height, uint32_t tick,
+                              uint32_t seed) {
+  MargolusParams params{width, height, tick, seed, {}};
+  std::array<uint32_t, MARGOLUS_MATERIAL_SLOTS> materials = margolusMaterials();
+  std::copy(materials.begin(), materials.end(), params.materials);
+  return params;
+}
+
+void stepMargolus(tGrid &cells, const MargolusParams &params) {
+  const uint32_t offset = params.tick & 1;
+  const uint32_t tickHash = margolusHash(params.tick ^ margolusHash(params.seed));
+
+  for (uint32_t by = 0; by < margolusBlocks(params.height); ++by) {
+    for (uint32_t bx = 0; bx < margolusBlocks(params.width); ++bx) {
+      // on odd ticks the first block hangs one cell off the edge, the
+      // unsigned wrap takes it out of bounds
+      uint32_t x0 = bx * 2 - offset;
+      uint32_t y0 = by * 2 - offset;
+
+      Block block;
+      size_t index[4];
+      for (int i = 0; i < 4; ++i) {
+        uint32_t x = x0 + (i & 1);
+        uint32_t y = y0 + (i >> 1);
+        bool inside = x < params.width && y < params.height;
+
+        index[i] = inside ? size_t(y) * params.width + x : 0;
+        block.cells[i] = inside ? cells[index[i]].value : OUTSIDE;
+        block.info[i] = block.cells[i] < MARGOLUS_MATERIAL_SLOTS
+                            ? params.materials[block.cells[i]]
+                            : 0xff | MARGOLUS_STATIC;
+      }
+
+      stepBlock(block, margolusHash(bx ^ margolusHash(by ^ tickHash)));
+
+      for (int i = 0; i < 4; ++i) {
+        if (block.cells[i] != OUTSIDE)
+          cells[index[i]].value = static_cast<uint8_t>(block.cells[i]);
+      }
+    }
+  }
+}
@@ -1,76 +1,524 @@
 #include <config.hpp>
+#include <algorithm>
 #include <cstdint>
-#include <random>
+#include <cstring>
+#include <exception>
+#include <material.hpp>
+#include <mutex>
+#include <profiler.hpp>
 #include <sim.hpp>
+#include <snapshot.hpp>
+#include <stdexcept>
 
-Sim::Sim(tGrid &worldMatrix) : m_WorldMatrix(worldMatrix) {
-  // initial state
+thread_local Sim::StepContext *Sim::s_Context = nullptr;
 
-  for (uint32_t y = 0; y < GRID_SIZE_Y; ++y) {
-    for (uint32_t x = 0; x < GRID_SIZE_X; ++x) {
-      m_ElementsMatrix[y * GRID_SIZE_X + x] = {x, y, ElementType::Air};
-    }
+Sim::Sim(tGrid &worldMatrix, uint32_t width, uint32_t height,
+         uint32_t threadCount)
+    : m_WorldMatrix(worldMatrix), m_Width(width), m_Height(height),
+      m_ChunksX((width + CHUNK_SIZE - 1) / CHUNK_SIZE),
+      m_ChunksY((height + CHUNK_SIZE - 1) / CHUNK_SIZE),
+      m_BitplaneStride((width + 7) / 8) {
+  if (width == 0 || height == 0) {
+    throw std::invalid_argument("[Sim]: World size can't be zero.");
   }
+  setThreadCount(threadCount);
 
-  for (int y = 2; y < GRID_SIZE_Y; ++y) {
-    // m_ElementsMatrix[y * GRID_SIZE_X + GRID_SIZE_X / 2 - 4].m_Value =
-    //     ElementType::Sand;
-    // m_ElementsMatrix[y * GRID_SIZE_X + GRID_SIZE_X / 2].m_Value =
-    // ElementType::Sand;
-    // m_ElementsMatrix[y * GRID_SIZE_X + GRID_SIZE_X / 2 + 4].m_Value =
-    //     ElementType::Sand;
+  // initial state
+  size_t cellCount = size_t(width) * height;
+  m_Materials.assign(cellCount, ElementType::Air);
+  m_Displaced.assign(size_t(m_BitplaneStride) * height, 0);
+  m_FlowsLeft.assign(size_t(m_BitplaneStride) * height, 0);
+  m_FlowSeeds.assign(size_t(m_BitplaneStride) * height, 0);
+  for (uint32_t y = 0; y < height; ++y) {
+    for (uint32_t x = 0; x < width; ++x) {
+      writeBit(m_FlowSeeds, x, y, mix64(size_t(y) * width + x) & 1);
+    }
   }
+  m_Chunks.resize(size_t(m_ChunksX) * m_ChunksY);
+  m_ChunkChanged.assign(m_Chunks.size(), 1);
+  m_Written.resize(m_Chunks.size());
+  m_WorldMatrix.assign(cellCount, Cell{});
+
+  m_Stats.chunkCount = static_cast<uint32_t>(m_Chunks.size());
+  m_Stats.census[static_cast<size_t>(ElementType::Air)] = cellCount;
 }
 
 void Sim::set(uint32_t x, uint32_t y, Element &element) {
   if (insideBounds(x, y)) {
-    m_ElementsMatrix[y * GRID_SIZE_X + x] = element;
-    m_ElementsMatrix[y * GRID_SIZE_X + x].m_GridX = x;
-    m_ElementsMatrix[y * GRID_SIZE_X + x].m_GridY = y;
-    m_ElementsMatrix[y * GRID_SIZE_X + x].m_HasBeenDisplaced = true;
+    size_t index = size_t(y) * m_Width + x;
+    countWrite(m_Materials[index], element.m_Value);
+    m_Materials[index] = element.m_Value;
+    setDisplaced(x, y, true);
+    writeBit(m_FlowsLeft, x, y, element.m_FlowsLeft);
 
-    m_WorldMatrix[y * GRID_SIZE_X + x].value =
-        static_cast<uint32_t>(element.m_Value);
+    m_WorldMatrix[index].value = static_cast<uint8_t>(element.m_Value);
+    markDirty(x, y);
   }
 }
 
 void Sim::set(uint32_t x, uint32_t y, ElementType type) {
   if (insideBounds(x, y)) {
-    m_ElementsMatrix[y * GRID_SIZE_X + x].m_Value = type;
+    size_t index = size_t(y) * m_Width + x;
+    countWrite(m_Materials[index], type);
+    m_Materials[index] = type;
+    // new fluid picks a way to flow from its position, a placed blob then
+    // spreads both ways the same on every replay
+    writeBit(m_FlowsLeft, x, y, mix64(index) & 1);
 
-    m_WorldMatrix[y * GRID_SIZE_X + x].value = static_cast<uint32_t>(type);
+    m_WorldMatrix[index].value = static_cast<uint8_t>(type);
+    markDirty(x, y);
   }
 }
 
-std::optional<Element> Sim::get(uint32_t x, uint32_t y) {
-  if (insideBounds(x, y)) {
-    return m_ElementsMatrix[y * GRID_SIZE_X + x];
+void Sim::countWrite(ElementType before, ElementType after) {
+  if (before == after)
+    return;
+
+  if (StepContext *context = s_Context) {
+    --context->census[static_cast<size_t>(before)];
+    ++context->census[static_cast<size_t>(after)];
+  } else {
+    --m_Stats.census[static_cast<size_t>(before)];
+    ++m_Stats.census[static_cast<size_t>(after)];
   }
-  return std::nullopt;
 }
 
-bool Sim::insideBounds(uint32_t x, uint32_t y) {
-  return x >= 0 && y >= 0 && x < GRID_SIZE_X && y < GRID_SIZE_Y;
+void Sim::countSwap(ElementType mover, ElementType target) {
+  // only kernels swap, and only while stepping
+  StepContext *context = s_Context;
+  if (!context)
+    return;
+
+  MaterialActivity &activity = context->activity[static_cast<size_t>(mover)];
+  if (target == ElementType::Air) {
+    ++activity.moved;
+  } else {
+    ++activity.swapped;
+  }
+}
+
+void Sim::mergeStats() {
+  m_Stats.activity = {};
+  for (StepContext &context : m_Contexts) {
+    for (size_t i = 0; i < ELEMENT_TYPE_COUNT; ++i) {
+      m_Stats.activity[i].visited += context.activity[i].visited;
+      m_Stats.activity[i].moved += context.activity[i].moved;
+      m_Stats.activity[i].swapped += context.activity[i].swapped;
+      // wraps around like the signed delta would
+      m_Stats.census[i] += static_cast<uint64_t>(context.census[i]);
+    }
+    context.activity = {};
+    context.census = {};
+  }
+
+  m_Stats.total = MaterialActivity{};
+  for (size_t i = 0; i < ELEMENT_TYPE_COUNT; ++i) {
+    MaterialActivity &activity = m_Stats.activity[i];
+    // cells without a kernel are all skipped, no need to count them apart
+    if (!MATERIALS[i].kernel)
+      activity.skipped = activity.visited;
+    m_Stats.total.visited += activity.visited;
+    m_Stats.total.moved += activity.moved;
+    m_Stats.total.swapped += activity.swapped;
+    m_Stats.total.skipped += activity.skipped;
+  }
+
+  m_Stats.tick = m_Tick;
+  m_Stats.activeChunks = static_cast<uint32_t>(m_ActiveChunks.size());
+  m_Stats.chunkActivity = double(m_Stats.activeChunks) / m_Chunks.size();
+  m_Stats.cellActivity =
+      double(m_Stats.total.visited) / (double(m_Width) * m_Height);
+}
+
+// after the whole world was replaced
+void Sim::recount() {
+  m_Stats.census = {};
+  for (ElementType material : m_Materials) {
+    ++m_Stats.census[static_cast<size_t>(material)];
+  }
 }
 
 void Sim::mouse(double xpos, double ypos, bool sink) {
-  uint32_t x = (xpos / WIDTH) * GRID_SIZE_X;
-  uint32_t y = GRID_SIZE_Y - (ypos / HEIGHT) * GRID_SIZE_Y;
+  std::pair<int64_t, int64_t> cell = windowToGrid(xpos, ypos);
+  brush(cell.first, cell.second, sink ? ElementType::Water : ElementType::Sand);
+}
+
+std::pair<int64_t, int64_t> Sim::windowToGrid(double xpos, double ypos) const {
+  return {static_cast<int64_t>((xpos / WIDTH) * m_Width),
+          static_cast<int64_t>(m_Height - (ypos / HEIGHT) * m_Height)};
+}
+
+void Sim::brush(int64_t x, int64_t y, ElementType type) {
+  // a centre this far out misses the grid wherever it is, and x + radius
+  // can't overflow
+  x = std::clamp<int64_t>(x, -BRUSH_RADIUS - 1,
+                          int64_t(m_Width) + BRUSH_RADIUS);
+  y = std::clamp<int64_t>(y, -BRUSH_RADIUS - 1,
+                          int64_t(m_Height) + BRUSH_RADIUS);
+  fillRect(x - BRUSH_RADIUS, y - BRUSH_RADIUS, x + BRUSH_RADIUS,
+           y + BRUSH_RADIUS, type);
+}
+
+void Sim::setThreadCount(uint32_t threadCount) {
+  threadCount = std::max(threadCount, 1u);
+  m_Pool = std::make_unique<WorkerPool>(threadCount);
+  m_Contexts.resize(threadCount);
+}
+
+// A changed cell can make any of its 8 neighbours move, so the whole 3x3
+// block is woken, across chunk borders if needed.
+void Sim::markDirty(uint32_t x, uint32_t y) {
+  uint32_t x0 = x > 0 ? x - 1 : 0;
+  uint32_t y0 = y > 0 ? y - 1 : 0;
+  uint32_t x1 = std::min(x + 1, m_Width - 1);
+  uint32_t y1 = std::min(y + 1, m_Height - 1);
 
-  for (int i = -3; i < 4; i++) {
-    for (int j = -3; j < 4; j++) {
-      set(x + i, y + j, sink ? ElementType::Water : ElementType::Sand);
+  StepContext *context = s_Context;
+
+  for (uint32_t cy = y0 / CHUNK_SIZE; cy <= y1 / CHUNK_SIZE; ++cy) {
+    for (uint32_t cx = x0 / CHUNK_SIZE; cx <= x1 / CHUNK_SIZE; ++cx) {
+      uint32_t index = cy * m_ChunksX + cx;
+
+      DirtyRect rect;
+      rect.include(std::max(x0, cx * CHUNK_SIZE), std::max(y0, cy * CHUNK_SIZE),
+                   std::min(x1, cx * CHUNK_SIZE + CHUNK_SIZE - 1),
+                   std::min(y1, cy * CHUNK_SIZE + CHUNK_SIZE - 1));
+
+      if (!context) {
+        // edits between steps
+        wakeChunk(index, rect, false);
+        addWritten(index, rect);
+      } else if (index == context->chunk) {
+        // Only this worker touches its own chunk. Cells still ahead of the
+        // scan get visited this tick, the same as a full scan would.
+        Chunk &chunk = m_Chunks[index];
+        if (chunk.m_NextRect.empty())
+          context->woken.push_back(index);
+        chunk.m_NextRect.include(rect.minX, rect.minY, rect.maxX, rect.maxY);
+
+        bool aheadInRow = context->scanLeft ? rect.minX < context->scanX
+                                            : rect.maxX > context->scanX;
+        if (rect.maxY > context->scanY ||
+            (rect.maxY == context->scanY && aheadInRow)) {
+          chunk.m_Rect.include(rect.minX, rect.minY, rect.maxX, rect.maxY);
+        }
+      } else {
+        // neighbours can be written by two workers at once, queue it up.
+        // Chunks of a later phase still get to see it this tick.
+        context->marks.push_back({index, rect, phaseOf(index) > context->phase});
+      }
+    }
+  }
+}
+
+void Sim::wakeChunk(uint32_t index, const DirtyRect &rect, bool current) {
+  Chunk &chunk = m_Chunks[index];
+
+  if (chunk.m_NextRect.empty())
+    m_NextActiveChunks.push_back(index);
+  chunk.m_NextRect.include(rect.minX, rect.minY, rect.maxX, rect.maxY);
+
+  if (current) {
+    if (chunk.m_Rect.empty())
+      m_ActiveChunks.push_back(index);
+    chunk.m_Rect.include(rect.minX, rect.minY, rect.maxX, rect.maxY);
+  }
+}
+
+// Merging rects is order independent, so the result doesn't depend on how
+// the chunks were spread over the workers.
+void Sim::applyMarks() {
+  for (StepContext &context : m_Contexts) {
+    for (const DirtyMark &mark : context.marks) {
+      wakeChunk(mark.chunk, mark.rect, mark.current);
     }
+    m_NextActiveChunks.insert(m_NextActiveChunks.end(), context.woken.begin(),
+                              context.woken.end());
+    context.marks.clear();
+    context.woken.clear();
   }
 }
 
+void Sim::stepCell(uint32_t x, uint32_t y, StepContext &context) {
+  size_t index = size_t(y) * m_Width + x;
+  ElementType material = m_Materials[index];
+  ++context.activity[static_cast<size_t>(material)].visited;
+  // static materials and air have no kernel and are never read past this
+  MaterialKernel kernel = materialOf(material).kernel;
+  if (kernel) {
+    Element element{m_Materials[index], isDisplaced(x, y), flowsLeft(x, y)};
+    kernel(*this, x, y, element, context.rng);
+  }
+
+  setDisplaced(x, y, false);
+}
+
+void Sim::stepChunk(uint32_t index, StepContext &context) {
+  s_Context = &context;
+  context.chunk = index;
+  context.rng = Rng(m_Seed, m_Tick, index);
+
+  // Bottom-up, the horizontal direction flips every row and every tick so
+  // nothing drifts to one side. The rect can still grow while stepping so
+  // it's re-read as the scan goes.
+  const DirtyRect &rect = m_Chunks[index].m_Rect;
+  for (uint32_t y = rect.minY; y <= rect.maxY; ++y) {
+    context.scanY = y;
+    context.scanLeft = (y + m_Tick) & 1;
+
+    if (context.scanLeft) {
+      for (uint32_t x = rect.maxX + 1; x-- > rect.minX;) {
+        context.scanX = x;
+        stepCell(x, y, context);
+      }
+    } else {
+      for (uint32_t x = rect.minX; x <= rect.maxX; ++x) {
+        context.scanX = x;
+        stepCell(x, y, context);
+      }
+    }
+  }
+
+  s_Context = nullptr;
+}
+
 void Sim::step() {
-  std::uniform_int_distribution<std::mt19937::result_type> genBool(0, 1);
+  while (!stepFor(std::chrono::steady_clock::time_point::max()))
+    ;
+}
+
+bool Sim::stepFor(std::chrono::steady_clock::time_point deadline) {
+  PROFILE_ZONE("Sim::stepFor");
+  if (!m_StepInProgress) {
+    beginStep();
+  }
 
-  for (Element &element : m_ElementsMatrix) {
-    if (element.m_Value != ElementType::Air)
-      element.step(*this, genBool);
+  const bool sliced = deadline != std::chrono::steady_clock::time_point::max();
 
-    element.m_HasBeenDisplaced = false;
+  for (; m_Phase < 4; ++m_Phase) {
+    if (m_PhaseCursor == 0) {
+      m_PhaseChunks.clear();
+      for (uint32_t index : m_ActiveChunks) {
+        if (phaseOf(index) == m_Phase)
+          m_PhaseChunks.push_back(index);
+      }
+
+      for (StepContext &context : m_Contexts) {
+        context.phase = m_Phase;
+      }
+    }
+
+    // Chunks of a phase don't depend on each other and marks are only
+    // applied once the phase is through, so stopping between two batches
+    // gives the same result as running the phase in one go.
+    uint32_t count = static_cast<uint32_t>(m_PhaseChunks.size());
+    while (m_PhaseCursor < count) {
+      if (sliced && std::chrono::steady_clock::now() >= deadline)
+        return false;
+
+      uint32_t batch = sliced ? std::min(count - m_PhaseCursor,
+                                         m_Pool->threadCount() * 2)
+                              : count - m_PhaseCursor;
+      uint32_t first = m_PhaseCursor;
+      m_Pool->run(batch, [this, first](uint32_t i, uint32_t worker) {
+        stepChunk(m_PhaseChunks[first + i], m_Contexts[worker]);
+      });
+      m_PhaseCursor += batch;
+    }
+
+    applyMarks();
+    m_PhaseCursor = 0;
+  }
+
+  // everything this tick wrote woke the chunk it's in
+  for (uint32_t index : m_NextActiveChunks) {
+    addWritten(index, m_Chunks[index].m_NextRect);
+  }
+
+  m_StepInProgress = false;
+  ++m_Tick;
+  mergeStats();
+  return true;
+}
+
+void Sim::addWritten(uint32_t index, const DirtyRect &rect) {
+  DirtyRect &written = m_Written[index];
+  if (written.empty())
+    m_WrittenChunks.push_back(index);
+  written.include(rect.minX, rect.minY, rect.maxX, rect.maxY);
+}
+
+bool Sim::takeDirtyRects(std::vector<DirtyRect> &rects) {
+  for (uint32_t index : m_WrittenChunks) {
+    rects.push_back(m_Written[index]);
+    m_Written[index] = DirtyRect{};
+  }
+  m_WrittenChunks.clear();
+
+  bool partial = !m_WrittenAll;
+  m_WrittenAll = false;
+  return partial;
+}
+
+void Sim::beginStep() {
+  // last tick's rects retire, whatever was touched since wakes up
+  for (uint32_t index : m_ActiveChunks) {
+    m_Chunks[index].m_Rect = DirtyRect{};
+  }
+  m_ActiveChunks.swap(m_NextActiveChunks);
+  m_NextActiveChunks.clear();
+
+  for (uint32_t index : m_ActiveChunks) {
+    Chunk &chunk = m_Chunks[index];
+    chunk.m_Rect = chunk.m_NextRect;
+    chunk.m_NextRect = DirtyRect{};
+    m_ChunkChanged[index] = 1;
+  }
+
+  m_StepInProgress = true;
+  m_Phase = 0;
+  m_PhaseCursor = 0;
+}
+
+void Sim::readChunk(uint32_t index, ChunkPlanes &planes) const {
+  const uint32_t x0 = (index % m_ChunksX) * CHUNK_SIZE;
+  const uint32_t y0 = (index / m_ChunksX) * CHUNK_SIZE;
+  const uint32_t width = std::min(CHUNK_SIZE, m_Width - x0);
+  const uint32_t height = std::min(CHUNK_SIZE, m_Height - y0);
+  // chunks start on a byte of the bitplanes, CHUNK_SIZE / 8 bytes a row
+  const uint32_t byte0 = x0 / 8;
+  const uint32_t bytes = std::min(CHUNK_SIZE / 8, m_BitplaneStride - byte0);
+  const uint32_t rowMask = width == 32 ? ~0u : (1u << width) - 1;
+
+  planes = ChunkPlanes{};
+  for (uint32_t y = 0; y < height; ++y) {
+    size_t row = size_t(y0 + y) * m_Width + x0;
+    std::copy_n(&m_Materials[row], width, &planes.materials[y * CHUNK_SIZE]);
+
+    size_t word = size_t(y0 + y) * m_BitplaneStride + byte0;
+    uint32_t displaced = 0;
+    uint32_t flowsLeft = 0;
+    for (uint32_t i = 0; i < bytes; ++i) {
+      displaced |= uint32_t(m_Displaced[word + i]) << (8 * i);
+      flowsLeft |= uint32_t(m_FlowsLeft[word + i]) << (8 * i);
+    }
+    planes.displaced[y] = displaced & rowMask;
+    planes.flowsLeft[y] = flowsLeft & rowMask;
   }
 }
+
+void Sim::writeChunk(uint32_t index, const ChunkPlanes &planes) {
+  const uint32_t x0 = (index % m_ChunksX) * CHUNK_SIZE;
+  const uint32_t y0 = (index / m_ChunksX) * CHUNK_SIZE;
+  const uint32_t width = std::min(CHUNK_SIZE, m_Width - x0);
+  const uint32_t height = std::min(CHUNK_SIZE, m_Height - y0);
+  const uint32_t byte0 = x0 / 8;
+  const uint32_t bytes = std::min(CHUNK_SIZE / 8, m_BitplaneStride - byte0);
+  const uint32_t rowMask = width == 32 ? ~0u : (1u << width) - 1;
+
+  for (uint32_t y = 0; y < height; ++y) {
+    size_t row = size_t(y0 + y) * m_Width + x0;
+    std::copy_n(&planes.materials[y * CHUNK_SIZE], width, &m_Materials[row]);
+    for (uint32_t x = 0; x < width; ++x) {
+      m_WorldMatrix[row + x].value = static_cast<uint8_t>(m_Materials[row + x]);
+    }
+
+    size_t word = size_t(y0 + y) * m_BitplaneStride + byte0;
+    uint32_t displaced = planes.displaced[y] & rowMask;
+    uint32_t flowsLeft = planes.flowsLeft[y] & rowMask;
+    for (uint32_t i = 0; i < bytes; ++i) {
+      m_Displaced[word + i] = uint8_t(displaced >> (8 * i));
+      m_FlowsLeft[word + i] = uint8_t(flowsLeft >> (8 * i));
+    }
+  }
+}
+
+std::shared_ptr<const WorldImage> Sim::capture() {
+  if (m_StepInProgress) {
+    throw std::logic_error("[Sim]: Can't capture the world mid-tick.");
+  }
+
+  // touched since the last tick started, not yet picked up by beginStep
+  for (uint32_t index : m_NextActiveChunks) {
+    m_ChunkChanged[index] = 1;
+  }
+
+  auto image = std::make_shared<WorldImage>();
+  image->width = m_Width;
+  image->height = m_Height;
+  image->chunksX = m_ChunksX;
+  image->chunksY = m_ChunksY;
+  image->seed = m_Seed;
+  image->tick = m_Tick;
+  image->chunks.resize(m_Chunks.size());
+  image->wake.resize(m_Chunks.size());
+
+  for (uint32_t i = 0; i < m_Chunks.size(); ++i) {
+    if (m_ChunkChanged[i] || !m_LastImage) {
+      auto planes = std::make_shared<ChunkPlanes>();
+      readChunk(i, *planes);
+      image->chunks[i] = std::move(planes);
+      m_ChunkChanged[i] = 0;
+    } else {
+      image->chunks[i] = m_LastImage->chunks[i];
+    }
+    image->wake[i] = m_Chunks[i].m_NextRect;
+  }
+
+  m_LastImage = image;
+  return image;
+}
+
+void Sim::restore(const Snapshot &snapshot) {
+  if (m_StepInProgress) {
+    throw std::logic_error("[Sim]: Can't restore the world mid-tick.");
+  }
+  if (snapshot.width() != m_Width || snapshot.height() != m_Height) {
+    throw std::invalid_argument(
+        "[Sim]: Snapshot size doesn't match the world.");
+  }
+
+  // Everything is decoded before anything is written, a corrupt chunk
+  // throws with the world as it was.
+  std::vector<ChunkPlanes> decoded(m_Chunks.size());
+  std::mutex errorMutex;
+  std::exception_ptr error;
+  m_Pool->run(static_cast<uint32_t>(m_Chunks.size()),
+              [&](uint32_t index, uint32_t) {
+                try {
+                  snapshot.decodeChunk(index, decoded[index]);
+                } catch (...) {
+                  std::lock_guard<std::mutex> lock(errorMutex);
+                  if (!error)
+                    error = std::current_exception();
+                }
+              });
+  if (error)
+    std::rethrow_exception(error);
+
+  // every chunk writes its own cells and whole bytes of the bitplanes
+  m_Pool->run(static_cast<uint32_t>(m_Chunks.size()),
+              [&](uint32_t index, uint32_t) {
+                writeChunk(index, decoded[index]);
+              });
+
+  m_ActiveChunks.clear();
+  m_NextActiveChunks.clear();
+  for (uint32_t i = 0; i < m_Chunks.size(); ++i) {
+    Chunk &chunk = m_Chunks[i];
+    chunk.m_Rect = DirtyRect{};
+    chunk.m_NextRect = snapshot.chunkWake(i);
+    if (!chunk.m_NextRect.empty())
+      m_NextActiveChunks.push_back(i);
+  }
+
+  m_Seed = snapshot.seed();
+  m_Tick = snapshot.tick();
+  recount();
+  m_Stats.tick = m_Tick;
+  m_Stats.activity = {};
+  m_Stats.total = MaterialActivity{};
+  m_LastImage.reset();
+  std::fill(m_ChunkChanged.begin(), m_ChunkChanged.end(), 1);
+  m_WrittenAll = true;
+}
@@ -0,0 +1,477 @@
+#include <snapshot.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char MAGIC[4] = {'V', 'S', 'N', 'P'};
+const uint32_t VERSION = 1;
+const size_t HEADER_SIZE = 40;
+const size_t INDEX_ENTRY_SIZE = 16;
+
+const size_t MATERIAL_BYTES = CHUNK_SIZE * CHUNK_SIZE;
+const size_t BITPLANE_BYTES = CHUNK_SIZE * sizeof(uint32_t);
+
+// a sleeping chunk's wake rect
+const uint8_t NO_WAKE = 0xff;
+
+enum Encoding : uint8_t {
+  // one byte repeated over the whole plane
+  Uniform = 0,
+  Raw = 1,
+  // (run length - 1, byte) pairs
+  Rle = 2,
+};
+
+void put32(std::vector<uint8_t> &out, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    out.push_back(uint8_t(value >> (8 * i)));
+}
+
+void put64(std::vector<uint8_t> &out, uint64_t value) {
+  for (int i = 0; i < 8; ++i)
+    out.push_back(uint8_t(value >> (8 * i)));
+}
+
+uint32_t get32(const uint8_t *in) {
+  return uint32_t(in[0]) | uint32_t(in[1]) << 8 | uint32_t(in[2]) << 16 |
+         uint32_t(in[3]) << 24;
+}
+
+uint64_t get64(const uint8_t *in) {
+  return uint64_t(get32(in)) | uint64_t(get32(in + 4)) << 32;
+}
+
+void encodePlane(std::vector<uint8_t> &out, const uint8_t *plane,
+                 size_t size) {
+  if (std::all_of(plane, plane + size,
+                  [&](uint8_t b) { return b == plane[0]; })) {
+    out.push_back(Uniform);
+    out.push_back(plane[0]);
+    return;
+  }
+
+  std::vector<uint8_t> rle;
+  for (size_t i = 0; i < size && rle.size() < size;) {
+    size_t run = 1;
+    while (i + run < size && run < 256 && plane[i + run] == plane[i])
+      ++run;
+    rle.push_back(uint8_t(run - 1));
+    rle.push_back(plane[i]);
+    i += run;
+  }
+
+  // noisy planes, e.g. flowsLeft under a fresh fluid, don't shrink
+  if (rle.size() < size) {
+    out.push_back(Rle);
+    out.insert(out.end(), rle.begin(), rle.end());
+  } else {
+    out.push_back(Raw);
+    out.insert(out.end(), plane, plane + size);
+  }
+}
+
+// decodes one plane starting at in, returns where the next one starts
+const uint8_t *decodePlane(const uint8_t *in, const uint8_t *end,
+                           uint8_t *plane, size_t size) {
+  if (in >= end)
+    throw std::runtime_error("[Snapshot]: Chunk data is truncated!");
+
+  uint8_t encoding = *in++;
+  switch (encoding) {
+  case Uniform:
+    if (in >= end)
+      throw std::runtime_error("[Snapshot]: Chunk data is truncated!");
+    std::memset(plane, *in, size);
+    return in + 1;
+  case Raw:
+    if (size_t(end - in) < size)
+      throw std::runtime_error("[Snapshot]: Chunk data is truncated!");
+    std::memcpy(plane, in, size);
+    return in + size;
+  case Rle: {
+    size_t filled = 0;
+    while (filled < size) {
+      if (end - in < 2)
+        throw std::runtime_error("[Snapshot]: Chunk data is truncated!");
+      size_t run = size_t(in[0]) + 1;
+      if (run > size - filled)
+        throw std::runtime_error("[Snapshot]: Run overflows its plane!");
+      std::memset(plane + filled, in[1], run);
+      filled += run;
+      in += 2;
+    }
+    return in;
+  }
+  default:
+    throw std::runtime_error("[Snapshot]: Unknown plane encoding!");
+  }
+}
+
+void bitsToBytes(const std::array<uint32_t, CHUNK_SIZE> &rows, uint8_t *out) {
+  for (uint32_t y = 0; y < CHUNK_SIZE; ++y) {
+    for (int i = 0; i < 4; ++i)
+      out[y * 4 + i] = uint8_t(rows[y] >> (8 * i));
+  }
+}
+
+void bytesToBits(const uint8_t *in, std::array<uint32_t, CHUNK_SIZE> &rows) {
+  for (uint32_t y = 0; y < CHUNK_SIZE; ++y)
+    rows[y] = get32(in + y * 4);
+}
+
+// the packed value of a chunk that's the same everywhere inside the world
+bool uniformValue(const ChunkPlanes &planes, uint32_t width, uint32_t height,
+                  uint64_t &value) {
+  uint32_t rowMask = width >= 32 ? ~0u : (1u << width) - 1;
+  ElementType material = planes.materials[0];
+  bool displaced = planes.displaced[0] & 1;
+  bool flowsLeft = planes.flowsLeft[0] & 1;
+
+  for (uint32_t y = 0; y < height; ++y) {
+    for (uint32_t x = 0; x < width; ++x) {
+      if (planes.materials[y * CHUNK_SIZE + x] != material)
+        return false;
+    }
+    if ((planes.displaced[y] & rowMask) != (displaced ? rowMask : 0) ||
+        (planes.flowsLeft[y] & rowMask) != (flowsLeft ? rowMask : 0))
+      return false;
+  }
+
+  value = uint64_t(material) | uint64_t(displaced) << 8 |
+          uint64_t(flowsLeft) << 9;
+  return true;
+}
+
+} // namespace
+
+void writeSnapshot(const WorldImage &image, const std::filesystem::path &path) {
+  const uint32_t chunkCount = image.chunksX * image.chunksY;
+  if (image.chunks.size() != chunkCount || image.wake.size() != chunkCount) {
+    throw std::invalid_argument("[Snapshot]: Image has the wrong chunk count!");
+  }
+
+  std::vector<uint8_t> index;
+  std::vector<uint8_t> payload;
+  index.reserve(size_t(chunkCount) * INDEX_ENTRY_SIZE);
+
+  const uint64_t payloadStart =
+      HEADER_SIZE + uint64_t(chunkCount) * INDEX_ENTRY_SIZE;
+  uint8_t bytes[BITPLANE_BYTES];
+
+  for (uint32_t i = 0; i < chunkCount; ++i) {
+    const ChunkPlanes &planes = *image.chunks[i];
+    const uint32_t x0 = (i % image.chunksX) * CHUNK_SIZE;
+    const uint32_t y0 = (i / image.chunksX) * CHUNK_SIZE;
+
+    uint64_t value = 0;
+    if (uniformValue(planes, std::min(CHUNK_SIZE, image.width - x0),
+                     std::min(CHUNK_SIZE, image.height - y0), value)) {
+      put64(index, value);
+      put32(index, 0);
+    } else {
+      size_t before = payload.size();
+      encodePlane(payload,
+                  reinterpret_cast<const uint8_t *>(planes.materials.data()),
+                  MATERIAL_BYTES);
+      bitsToBytes(planes.displaced, bytes);
+      encodePlane(payload, bytes, BITPLANE_BYTES);
+      bitsToBytes(planes.flowsLeft, bytes);
+      encodePlane(payload, bytes, BITPLANE_BYTES);
+
+      put64(index, payloadStart + before);
+      put32(index, static_cast<uint32_t>(payload.size() - before));
+    }
+
+    const DirtyRect &wake = image.wake[i];
+    if (wake.empty()) {
+      index.insert(index.end(), 4, NO_WAKE);
+    } else {
+      index.push_back(uint8_t(std::max(wake.minX, x0) - x0));
+      index.push_back(uint8_t(std::max(wake.minY, y0) - y0));
+      index.push_back(uint8_t(std::min(wake.maxX - x0, CHUNK_SIZE - 1)));
+      index.push_back(uint8_t(std::min(wake.maxY - y0, CHUNK_SIZE - 1)));
+    }
+  }
+
+  std::vector<uint8_t> header(MAGIC, MAGIC + 4);
+  put32(header, VERSION);
+  put32(header, image.width);
+  put32(header, image.height);
+  put32(header, CHUNK_SIZE);
+  put32(header, chunkCount);
+  put64(header, image.seed);
+  put64(header, image.tick);
+
+  // unique per writer, another instance may be saving to the same path
+  std::filesystem::path temporary = path;
+  temporary += ".tmp" + std::to_string(std::random_device{}());
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(header.data()), header.size());
+    file.write(reinterpret_cast<const char *>(index.data()), index.size());
+    file.write(reinterpret_cast<const char *>(payload.data()), payload.size());
+    if (!file) {
+      file.close();
+      std::error_code ignored;
+      std::filesystem::remove(temporary, ignored);
+      throw std::runtime_error("[Snapshot]: Failed to write " +
+                               temporary.string());
+    }
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temporary, path, error);
+  if (error) {
+    std::error_code ignored;
+    std::filesystem::remove(temporary, ignored);
+    throw std::runtime_error("[Snapshot]: Failed to replace " + path.string() +
+                             ": " + error.message());
+  }
+}
+
+Snapshot::Snapshot(const std::filesystem::path &path) {
+#ifdef _WIN32
+  HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    throw std::runtime_error("[Snapshot]: Failed to open " + path.string());
+  }
+  m_File = file;
+
+  LARGE_INTEGER size;
+  GetFileSizeEx(file, &size);
+  m_Size = static_cast<size_t>(size.QuadPart);
+
+  if (m_Size > 0) {
+    m_Mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_Mapping) {
+      m_Data = static_cast<const uint8_t *>(
+          MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+    if (!m_Data) {
+      unmap();
+      throw std::runtime_error("[Snapshot]: Failed to map " + path.string());
+    }
+  }
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("[Snapshot]: Failed to open " + path.string());
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    m_Size = static_cast<size_t>(info.st_size);
+    void *data = mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, fd, 0);
+    m_Data = data == MAP_FAILED ? nullptr : static_cast<const uint8_t *>(data);
+  }
+  // the mapping keeps the file alive
+  ::close(fd);
+
+  if (!m_Data && m_Size > 0) {
+    throw std::runtime_error("[Snapshot]: Failed to map " + path.string());
+  }
+#endif
+
+  try {
+    if (m_Size < HEADER_SIZE || std::memcmp(m_Data, MAGIC, 4) != 0) {
+      throw std::runtime_error("[Snapshot]: Not a world snapshot: " +
+                               path.string());
+    }
+    if (get32(m_Data + 4) != VERSION) {
+      throw std::runtime_error("[Snapshot]: Unsupported snapshot version!");
+    }
+
+    m_Width = get32(m_Data + 8);
+    m_Height = get32(m_Data + 12);
+    uint32_t chunkSize = get32(m_Data + 16);
+    uint32_t chunkCount = get32(m_Data + 20);
+    m_Seed = get64(m_Data + 24);
+    m_Tick = get64(m_Data + 32);
+
+    m_ChunksX = (m_Width + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    m_ChunksY = (m_Height + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if (m_Width == 0 || m_Height == 0 || chunkSize != CHUNK_SIZE ||
+        uint64_t(m_ChunksX) * m_ChunksY != chunkCount) {
+      throw std::runtime_error("[Snapshot]: Header doesn't add up!");
+    }
+
+    // every chunk has to point inside the file, checked once here so
+    // decodeChunk doesn't have to
+    if ((m_Size - HEADER_SIZE) / INDEX_ENTRY_SIZE < chunkCount) {
+      throw std::runtime_error("[Snapshot]: Chunk index is truncated!");
+    }
+    for (uint32_t i = 0; i < chunkCount; ++i) {
+      const uint8_t *entry = indexEntry(i);
+      uint64_t offset = get64(entry);
+      uint32_t size = get32(entry + 8);
+      if (size > 0 && (offset > m_Size || size > m_Size - offset)) {
+        throw std::runtime_error("[Snapshot]: Chunk points past the file!");
+      }
+    }
+  } catch (...) {
+    unmap();
+    throw;
+  }
+}
+
+Snapshot::~Snapshot() { unmap(); }
+
+void Snapshot::unmap() {
+#ifdef _WIN32
+  if (m_Data)
+    UnmapViewOfFile(m_Data);
+  if (m_Mapping)
+    CloseHandle(m_Mapping);
+  if (m_File)
+    CloseHandle(m_File);
+  m_Mapping = m_File = nullptr;
+#else
+  if (m_Data)
+    munmap(const_cast<uint8_t *>(m_Data), m_Size);
+#endif
+  m_Data = nullptr;
+}
+
+const uint8_t *Snapshot::indexEntry(uint32_t chunk) const {
+  return m_Data + HEADER_SIZE + size_t(chunk) * INDEX_ENTRY_SIZE;
+}
+
+void Snapshot::decodeChunk(uint32_t chunk, ChunkPlanes &planes) const {
+  if (chunk >= chunkCount()) {
+    throw std::out_of_range("[Snapshot]: Chunk index out of range!");
+  }
+
+  const uint8_t *entry = indexEntry(chunk);
+  uint64_t offset = get64(entry);
+  uint32_t size = get32(entry + 8);
+
+  if (size == 0) {
+    // offset is the packed value of a uniform chunk
+    ElementType material = static_cast<ElementType>(offset & 0xff);
+    if (static_cast<size_t>(material) >= ELEMENT_TYPE_COUNT) {
+      throw std::runtime_error("[Snapshot]: Unknown material!");
+    }
+    planes.materials.fill(material);
+    planes.displaced.fill((offset >> 8) & 1 ? ~0u : 0u);
+    planes.flowsLeft.fill((offset >> 9) & 1 ? ~0u : 0u);
+    return;
+  }
+
+  const uint8_t *in = m_Data + offset;
+  const uint8_t *end = in + size;
+  uint8_t bytes[BITPLANE_BYTES];
+
+  in = decodePlane(in, end,
+                   reinterpret_cast<uint8_t *>(planes.materials.data()),
+                   MATERIAL_BYTES);
+  for (ElementType material : planes.materials) {
+    if (static_cast<size_t>(material) >= ELEMENT_TYPE_COUNT) {
+      throw std::runtime_error("[Snapshot]: Unknown material!");
+    }
+  }
+
+  in = decodePlane(in, end, bytes, BITPLANE_BYTES);
+  bytesToBits(bytes, planes.displaced);
+  decodePlane(in, end, bytes, BITPLANE_BYTES);
+  bytesToBits(bytes, planes.flowsLeft);
+}
+
+DirtyRect Snapshot::chunkWake(uint32_t chunk) const {
+  const uint8_t *wake = indexEntry(chunk) + 12;
+  DirtyRect rect;
+  if (wake[0] == NO_WAKE)
+    return rect;
+
+  uint32_t x0 = (chunk % m_ChunksX) * CHUNK_SIZE;
+  uint32_t y0 = (chunk / m_ChunksX) * CHUNK_SIZE;
+  uint32_t x1 = std::min(x0 + std::min<uint32_t>(wake[2], CHUNK_SIZE - 1),
+                         m_Width - 1);
+  uint32_t y1 = std::min(y0 + std::min<uint32_t>(wake[3], CHUNK_SIZE - 1),
+                         m_Height - 1);
+  rect.include(std::min(x0 + wake[0], x1), std::min(y0 + wake[1], y1), x1, y1);
+  return rect;
+}
+
+SnapshotWriter::SnapshotWriter() : m_Thread(&SnapshotWriter::run, this) {}
+
+SnapshotWriter::~SnapshotWriter() {
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Stop = true;
+  }
+  m_Wake.notify_one();
+  m_Thread.join();
+}
+
+void SnapshotWriter::save(std::shared_ptr<const WorldImage> image,
+                          const std::filesystem::path &path) {
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Pending = std::move(image);
+    m_PendingPath = path;
+  }
+  m_Wake.notify_one();
+}
+
+void SnapshotWriter::wait() {
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  m_Idle.wait(lock, [this] { return !m_Pending && !m_Writing; });
+}
+
+uint64_t SnapshotWriter::completed() {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Completed;
+}
+
+std::string SnapshotWriter::lastError() {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_LastError;
+}
+
+void SnapshotWriter::run() {
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  while (true) {
+    m_Wake.wait(lock, [this] { return m_Pending || m_Stop; });
+    if (!m_Pending)
+      break;
+
+    std::shared_ptr<const WorldImage> image = std::move(m_Pending);
+    std::filesystem::path path = std::move(m_PendingPath);
+    m_Pending.reset();
+    m_Writing = true;
+    lock.unlock();
+
+    std::string error;
+    try {
+      writeSnapshot(*image, path);
+    } catch (const std::exception &e) {
+      error = e.what();
+    }
+    image.reset();
+
+    lock.lock();
+    m_Writing = false;
+    m_LastError = error;
+    if (error.empty())
+      ++m_Completed;
+    m_Idle.notify_all();
+  }
+}
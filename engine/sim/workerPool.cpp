@@ -0,0 +1,74 @@
+#include <workerPool.hpp>
+
+WorkerPool::WorkerPool(uint32_t threadCount) {
+  for (uint32_t i = 1; i < threadCount; ++i) {
+    m_Threads.emplace_back(&WorkerPool::workerLoop, this, i);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Quit = true;
+  }
+  m_Wake.notify_all();
+
+  for (std::thread &thread : m_Threads) {
+    thread.join();
+  }
+}
+
+void WorkerPool::run(uint32_t count,
+                     const std::function<void(uint32_t, uint32_t)> &task) {
+  // not worth waking anyone up for
+  if (m_Threads.empty() || count <= 1) {
+    for (uint32_t i = 0; i < count; ++i) {
+      task(i, 0);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Task = &task;
+    m_Count = count;
+    m_Next.store(0, std::memory_order_relaxed);
+    m_Busy = static_cast<uint32_t>(m_Threads.size());
+    ++m_Generation;
+  }
+  m_Wake.notify_all();
+
+  drain(0);
+
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  m_Done.wait(lock, [this] { return m_Busy == 0; });
+  m_Task = nullptr;
+}
+
+void WorkerPool::workerLoop(uint32_t worker) {
+  uint64_t generation = 0;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m_Mutex);
+      m_Wake.wait(lock,
+                  [&] { return m_Quit || m_Generation != generation; });
+      if (m_Quit)
+        return;
+      generation = m_Generation;
+    }
+
+    drain(worker);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (--m_Busy == 0)
+      m_Done.notify_one();
+  }
+}
+
+void WorkerPool::drain(uint32_t worker) {
+  uint32_t index;
+  while ((index = m_Next.fetch_add(1, std::memory_order_relaxed)) < m_Count) {
+    (*m_Task)(index, worker);
+  }
+}
@@ -0,0 +1,81 @@
+#include <simScheduler.hpp>
+
+#include <algorithm>
+
+SimScheduler::SimScheduler(Sim &sim, const SchedulerConfig &config)
+    : m_Sim(sim), m_Config(config), m_LastUpdate(clock::now()) {}
+
+void SimScheduler::reset(clock::time_point now) {
+  m_LastUpdate = now;
+  m_Accumulator = std::chrono::nanoseconds(0);
+}
+
+uint32_t SimScheduler::update(clock::time_point now) {
+  const auto period = m_Config.tickPeriod;
+  const auto maxBacklog = period * m_Config.maxSubsteps;
+
+  m_Accumulator += now - m_LastUpdate;
+  m_LastUpdate = now;
+
+  // too far behind to ever catch up, let the sim slow down instead of
+  // spending every frame on stale ticks
+  if (m_Accumulator > maxBacklog) {
+    m_Stats.droppedTicks += (m_Accumulator - maxBacklog) / period;
+    m_Accumulator = maxBacklog;
+  }
+
+  const bool sliced = m_Config.frameBudget.count() > 0;
+  const auto deadline =
+      sliced ? now + m_Config.frameBudget : clock::time_point::max();
+
+  uint32_t substeps = 0;
+  auto updateStart = clock::now();
+
+  while (substeps < m_Config.maxSubsteps) {
+    if (!m_Sim.stepInProgress()) {
+      if (m_Accumulator < period)
+        break;
+      // a tick pays for its period when it starts
+      m_Accumulator -= period;
+    }
+
+    auto sliceStart = clock::now();
+    bool done = m_Sim.stepFor(deadline);
+    m_PartialTickMs +=
+        std::chrono::duration<double, std::milli>(clock::now() - sliceStart)
+            .count();
+
+    if (!done) {
+      ++m_PartialSlices;
+      break;
+    }
+
+    ++substeps;
+    ++m_Stats.ticks;
+    if (m_PartialSlices > 0)
+      ++m_Stats.slicedTicks;
+
+    m_Stats.lastTickMs = m_PartialTickMs;
+    m_Stats.maxTickMs = std::max(m_Stats.maxTickMs, m_PartialTickMs);
+    m_Stats.avgTickMs = m_Stats.ticks == 1
+                            ? m_PartialTickMs
+                            : m_Stats.avgTickMs * 0.95 + m_PartialTickMs * 0.05;
+    m_PartialTickMs = 0.0;
+    m_PartialSlices = 0;
+
+    if (sliced && clock::now() >= deadline)
+      break;
+  }
+
+  m_Stats.lastSubsteps = substeps;
+  m_Stats.lastUpdateMs =
+      std::chrono::duration<double, std::milli>(clock::now() - updateStart)
+          .count();
+  return substeps;
+}
+
+SimScheduler::clock::time_point SimScheduler::nextTickTime() const {
+  if (m_Sim.stepInProgress() || m_Accumulator >= m_Config.tickPeriod)
+    return m_LastUpdate;
+  return m_LastUpdate + (m_Config.tickPeriod - m_Accumulator);
+}
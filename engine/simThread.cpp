@@ -0,0 +1,163 @@
+#include <profiler.hpp>
+#include <simThread.hpp>
+
+#include <algorithm>
+
+SimThread::SimThread(Sim &sim, tGrid &worldMatrix)
+    : m_Sim(sim), m_WorldMatrix(worldMatrix), m_Frames(SimFrame{worldMatrix}),
+      m_Scheduler(sim) {}
+
+SimThread::~SimThread() { stop(); }
+
+void SimThread::start(const SchedulerConfig &config) {
+  if (m_Running.exchange(true))
+    return;
+
+  m_Scheduler.setConfig(config);
+  m_Thread = std::thread(&SimThread::run, this);
+}
+
+void SimThread::stop() {
+  if (!m_Running.exchange(false))
+    return;
+
+  m_Thread.join();
+}
+
+bool SimThread::push(const SimCommand &command) {
+  return m_Commands.push(command);
+}
+
+const SimFrame &SimThread::latestFrame() {
+  m_Frames.update();
+  return m_Frames.front();
+}
+
+bool SimThread::dirtySince(uint64_t from, uint64_t to,
+                           std::vector<DirtyRect> &rects) {
+  std::lock_guard<std::mutex> lock(m_DirtyMutex);
+  if (from >= to)
+    return true;
+  if (m_DirtyHistory.empty() || m_DirtyHistory.front().generation > from + 1)
+    return false;
+
+  for (const DirtyEntry &entry : m_DirtyHistory) {
+    if (entry.generation <= from || entry.generation > to)
+      continue;
+    if (!entry.partial)
+      return false;
+    rects.insert(rects.end(), entry.rects.begin(), entry.rects.end());
+  }
+  return true;
+}
+
+// Only the rects that changed since the back frame was last written are
+// copied into it, a quiet world costs next to nothing to publish.
+void SimThread::publish() {
+  PROFILE_ZONE("SimThread::publish");
+  m_DirtyScratch.clear();
+  bool partial = m_Sim.takeDirtyRects(m_DirtyScratch);
+
+  SimFrame &frame = m_Frames.back();
+  uint64_t stale = frame.generation;
+  {
+    std::lock_guard<std::mutex> lock(m_DirtyMutex);
+    m_DirtyHistory.push_back({++m_Generation, partial, m_DirtyScratch});
+    if (m_DirtyHistory.size() > DIRTY_HISTORY)
+      m_DirtyHistory.pop_front();
+  }
+
+  m_DirtyScratch.clear();
+  if (dirtySince(stale, m_Generation, m_DirtyScratch)) {
+    const uint32_t width = m_Sim.width();
+    for (const DirtyRect &rect : m_DirtyScratch) {
+      for (uint32_t y = rect.minY; y <= rect.maxY; ++y) {
+        size_t row = size_t(y) * width;
+        std::copy(m_WorldMatrix.begin() + row + rect.minX,
+                  m_WorldMatrix.begin() + row + rect.maxX + 1,
+                  frame.cells.begin() + row + rect.minX);
+      }
+    }
+  } else {
+    std::copy(m_WorldMatrix.begin(), m_WorldMatrix.end(), frame.cells.begin());
+  }
+  frame.generation = m_Generation;
+  frame.commands = m_CommandsApplied;
+  m_Frames.publish();
+}
+
+SchedulerStats SimThread::stats() {
+  std::lock_guard<std::mutex> lock(m_StatsMutex);
+  return m_Stats;
+}
+
+SimStats SimThread::simStats() {
+  std::lock_guard<std::mutex> lock(m_StatsMutex);
+  return m_SimStats;
+}
+
+void SimThread::apply(const SimCommand &command) {
+  switch (command.type) {
+  case SimCommand::Type::Mouse: {
+    // same edit as Sim::mouse, in grid terms so a journal doesn't depend on
+    // the window
+    auto [x, y] = m_Sim.windowToGrid(command.xpos, command.ypos);
+    ElementType type = command.sink ? ElementType::Water : ElementType::Sand;
+    if (m_Journal)
+      m_Journal->brush(m_Sim.tick(), x, y, type);
+    m_Sim.brush(x, y, type);
+    break;
+  }
+  case SimCommand::Type::Stroke: {
+    auto [x0, y0] = m_Sim.windowToGrid(command.fromX, command.fromY);
+    auto [x1, y1] = m_Sim.windowToGrid(command.xpos, command.ypos);
+    ElementType type = command.sink ? ElementType::Water : ElementType::Sand;
+    if (m_Journal)
+      m_Journal->stroke(m_Sim.tick(), x0, y0, x1, y1, Sim::BRUSH_RADIUS, type);
+    m_Sim.stroke(x0, y0, x1, y1, Sim::BRUSH_RADIUS, type);
+    break;
+  }
+  case SimCommand::Type::Save:
+    // only the chunks changed since the last save are copied here, the
+    // encoding and the disk are the writer's problem
+    m_SnapshotWriter.save(m_Sim.capture(), m_SnapshotPath);
+    break;
+  }
+}
+
+void SimThread::run() {
+  PROFILE_THREAD("sim");
+  m_Scheduler.reset(SimScheduler::clock::now());
+
+  while (m_Running.load(std::memory_order_relaxed)) {
+    // edits only go in between ticks, never into a half stepped world
+    if (!m_Sim.stepInProgress()) {
+      SimCommand command;
+      while (m_Commands.pop(command)) {
+        apply(command);
+        ++m_CommandsApplied;
+      }
+    }
+
+    bool ticked = m_Scheduler.update(SimScheduler::clock::now()) > 0;
+    if (ticked)
+      publish();
+
+    {
+      std::lock_guard<std::mutex> lock(m_StatsMutex);
+      m_Stats = m_Scheduler.stats();
+      // only changes with a tick, edits between them wait for the next one
+      if (ticked)
+        m_SimStats = m_Sim.stats();
+    }
+
+    if (!m_Sim.stepInProgress())
+      std::this_thread::sleep_until(m_Scheduler.nextTickTime());
+  }
+
+  // a tick stopped halfway isn't counted, a replay ends on the last whole one
+  if (m_Journal) {
+    m_Journal->finish(m_Sim.tick());
+    m_Journal.reset();
+  }
+}
@@ -0,0 +1,27 @@
+#version 460
+
+layout(location = 0) in vec2 inUV;
+
+layout(location = 0) out vec4 outColor;
+
+layout(binding = 0) uniform UniformBufferObject {
+    vec2 grid_size;
+    // indexed by the cell's material byte
+    vec4 palette[256];
+} ubo;
+
+// one byte per cell, four to a word (Cell in engine/cell/cell.hpp)
+layout(std430, binding = 1) readonly buffer StorageBufferObject {
+    uint cell_words[];
+} ssbo;
+
+uint cellValue(uint i) {
+    return (ssbo.cell_words[i >> 2] >> ((i & 3u) * 8u)) & 0xffu;
+}
+
+void main() {
+    uvec2 size = uvec2(ubo.grid_size);
+    // row-major, the row length is the grid width
+    uvec2 cell = min(uvec2(inUV * ubo.grid_size), size - 1u);
+    outColor = ubo.palette[cellValue(cell.y * size.x + cell.x)];
+}
@@ -0,0 +1,14 @@
+#version 460
+
+// One triangle that covers the whole screen, the grid is looked up per pixel
+// in gridf.frag.
+
+// 0 at the bottom of the screen, row 0 of the grid
+layout(location = 0) out vec2 outUV;
+
+void main() {
+    // (-1, -1), (3, -1), (-1, 3)
+    vec2 pos = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2) * 2.0 - 1.0;
+    outUV = vec2(pos.x + 1.0, 1.0 - pos.y) * 0.5;
+    gl_Position = vec4(pos, 0.0, 1.0);
+}